@@ -0,0 +1,173 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * bench_server.c
+ * Connection rate and request rate of the server as the number of
+ * client threads T grows from 1
+ *
+ * Each thread speaks the protocol directly, without mylib:
+ *     connections/s  connect, hello and close, over and over
+ *     requests/s     stat of the server directory over a connection of
+ *                    its own, one request in flight at a time
+ * Start the server first on the same serverport15440 (and transport15440),
+ * with workers15440 set to the worker count under test.
+ *
+ * Usage: ./bench_server [max_threads] [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "myframe.h"
+#include "myrpc.h"
+#include "mytransport.h"
+
+static const char *serverip;
+static unsigned short port;
+static int transport;
+static double run_for; /* seconds each measurement lasts */
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Receive one reply and drop it
+ * @return: 0 on success, -1 on error
+ */
+static int drain_reply(struct conn *conn) {
+    char buf[4096];
+    if (conn_recv_exact(conn, buf, FRAME_LEN_SIZE) <= 0)	return -1;
+    uint32_t len = get_le32(buf);
+    while (len > 0) {
+        uint32_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (conn_recv_exact(conn, buf, n) <= 0)	return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Open a connection and exchange hellos, with no capabilities
+ * @return: the connection, NULL on error
+ */
+static struct conn *connect_hello(void) {
+    struct conn *conn = conn_connect(transport, serverip, port);
+    if (conn == NULL)	return NULL;
+
+    struct hello_req hello = {.caps = 0};
+    char msg[FRAME_LEN_SIZE + FRAME_HDR_SIZE + hello_req_fixed_len];
+    put_le32(msg, FRAME_HDR_SIZE + hello_req_fixed_len);
+    encode_frame_header(msg + FRAME_LEN_SIZE, OP_HELLO, 0, hello_req_fixed_len, 0);
+    pack_hello_req(msg + FRAME_LEN_SIZE + FRAME_HDR_SIZE, CODEC_FIXED, &hello);
+    struct iovec iov = {.iov_base = msg, .iov_len = sizeof(msg)};
+    if (conn_send_iov(conn, &iov, 1) < 0 || drain_reply(conn) < 0) {
+        conn_close(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+/*
+ * Connections per second of one thread
+ * @param: arg: set to the count
+ */
+static void *connect_main(void *arg) {
+    long *count = (long *)arg;
+    double end = now_s() + run_for;
+
+    while (now_s() < end) {
+        struct conn *conn = connect_hello();
+        if (conn == NULL) {
+            perror("bench_server: connect");
+            break;
+        }
+        conn_close(conn);
+        (*count)++;
+    }
+    return NULL;
+}
+
+/*
+ * Requests per second of one thread
+ * @param: arg: set to the count
+ */
+static void *request_main(void *arg) {
+    long *count = (long *)arg;
+    struct conn *conn = connect_hello();
+    if (conn == NULL) {
+        perror("bench_server: connect");
+        return NULL;
+    }
+
+    struct stat_req req = {.mask = STAT_F_SIZE};
+    char msg[FRAME_LEN_SIZE + FRAME_HDR_SIZE + stat_req_fixed_len + 1];
+    put_le32(msg, FRAME_HDR_SIZE + stat_req_fixed_len + 1);
+    pack_stat_req(msg + FRAME_LEN_SIZE + FRAME_HDR_SIZE, CODEC_FIXED, &req);
+    msg[sizeof(msg) - 1] = '.';
+
+    double end = now_s() + run_for;
+    uint32_t req_id = 0;
+    while (now_s() < end) {
+        encode_frame_header(msg + FRAME_LEN_SIZE, OP_STAT, 0, stat_req_fixed_len, ++req_id);
+        struct iovec iov = {.iov_base = msg, .iov_len = sizeof(msg)};
+        if (conn_send_iov(conn, &iov, 1) < 0 || drain_reply(conn) < 0) {
+            perror("bench_server: stat");
+            break;
+        }
+        (*count)++;
+    }
+    conn_close(conn);
+    return NULL;
+}
+
+/*
+ * Run fn on threads threads for run_for seconds
+ * @return: operations per second over all of them
+ */
+static double measure(void *(*fn)(void *), int threads) {
+    pthread_t tid[threads];
+    long counts[threads];
+    long total = 0;
+    int i;
+
+    memset(counts, 0, sizeof(counts));
+    double t0 = now_s();
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&tid[i], NULL, fn, &counts[i]) != 0) {
+            threads = i;
+            break;
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(tid[i], NULL);
+        total += counts[i];
+    }
+    return total / (now_s() - t0);
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 16;
+    run_for = argc > 2 ? atof(argv[2]) : 2;
+    int t;
+
+    serverip = getenv("server15440") ? getenv("server15440") : "127.0.0.1";
+    port = getenv("serverport15440") ? (unsigned short)atoi(getenv("serverport15440")) : 15440;
+    transport = transport_from_env();
+
+    printf("server %s:%d over %s, %.1f s per run\n", serverip, port, transport_name(transport), run_for);
+    printf("    %-4s %14s %14s\n", "T", "connections/s", "requests/s");
+    for (t = 1; t <= max_threads; t *= 2) {
+        double conns = measure(connect_main, t);
+        double reqs = measure(request_main, t);
+        printf("    %-4d %14.0f %14.0f\n", t, conns, reqs);
+        fflush(stdout);
+    }
+    return 0;
+}
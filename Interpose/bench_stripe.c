@@ -0,0 +1,104 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * bench_stripe.c
+ * Throughput of remote reads of one large file through mylib as the
+ * number of stripe connections K (stripes15440) grows from 1
+ *
+ * Every K runs in a fresh process with mylib preloaded, which reads the
+ * whole file with read calls of read_size bytes, passes times, and
+ * reports the best pass. Start the server first, in the directory
+ * holding the file, on the same serverport15440 (and transport15440).
+ *
+ * Usage: ./bench_stripe file [max_conns] [read_size] [passes]
+ *     stripesize15440 sets the stripe size, LD_PRELOAD of the children
+ *     defaults to ./mylib.so through the variable bench_lib15440
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Child side: read the file passes times with mylib preloaded
+ * @return: exit status
+ */
+static int run_child(const char *file, size_t read_size, int passes, int k) {
+    char *buf = (char *)malloc(read_size);
+    double best = 0;
+    long long total = 0;
+    int pass;
+
+    if (buf == NULL)	return 1;
+    for (pass = 0; pass < passes; pass++) {
+        double t0 = now_s();
+        int fd = open(file, O_RDONLY);
+        if (fd < 0) {
+            perror("bench_stripe: open");
+            return 1;
+        }
+        ssize_t n;
+        total = 0;
+        while ((n = read(fd, buf, read_size)) > 0)	total += n;
+        close(fd);
+        if (n < 0) {
+            perror("bench_stripe: read");
+            return 1;
+        }
+        double mbs = total / (now_s() - t0) / 1e6;
+        if (mbs > best)	best = mbs;
+    }
+    printf("    K=%-2d %10lld bytes  %9.1f MB/s\n", k, total, best);
+    free(buf);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--child") == 0 && argc == 6) {
+        return run_child(argv[2], (size_t)atol(argv[3]), atoi(argv[4]), atoi(argv[5]));
+    }
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s file [max_conns] [read_size] [passes]\n", argv[0]);
+        return 1;
+    }
+    int max_conns = argc > 2 ? atoi(argv[2]) : 8;
+    const char *read_size = argc > 3 ? argv[3] : "4194304";
+    const char *passes = argc > 4 ? argv[4] : "3";
+    const char *lib = getenv("bench_lib15440") ? getenv("bench_lib15440") : "./mylib.so";
+    int k;
+
+    printf("reads of %s bytes, stripe size %s\n", read_size,
+           getenv("stripesize15440") ? getenv("stripesize15440") : "default");
+    fflush(stdout);
+    for (k = 1; k <= max_conns; k *= 2) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            char kbuf[16];
+            snprintf(kbuf, sizeof(kbuf), "%d", k);
+            setenv("stripes15440", kbuf, 1);
+            setenv("LD_PRELOAD", lib, 1);
+            // mylib logs every call on stderr
+            int devnull = open("/dev/null", O_WRONLY);
+            if (devnull >= 0)	dup2(devnull, 2);
+            execl("/proc/self/exe", argv[0], "--child", argv[1], read_size, passes, kbuf, (char *)NULL);
+            _exit(127);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "bench_stripe: run with K=%d failed\n", k);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * myarena.c
+ * Implementation of the arena defined in myarena.h
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "myarena.h"
+
+#define ARENA_ALIGN 16 /* alignment of what arena_alloc returns, as malloc's */
+
+/* Block holding one allocation that did not fit */
+struct arena_spill {
+    struct arena_spill *next;
+    max_align_t data[]; /* the allocation */
+};
+
+static size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+/*
+ * Take memory from an arena, aligned for any type
+ * @return:
+ *    n bytes valid until the next arena_reset, NULL if out of memory
+ */
+void *arena_alloc(struct arena *a, size_t n) {
+    n = align_up(n > 0 ? n : 1);
+    if (n <= a->cap - a->used) {
+        void *p = a->base + a->used;
+        a->used += n;
+        return p;
+    }
+
+    struct arena_spill *s = (struct arena_spill *)malloc(sizeof(struct arena_spill) + n);
+    if (s == NULL)	return NULL;
+    s->next = a->spills;
+    a->spills = s;
+    a->spilled += n;
+    return s->data;
+}
+
+/*
+ * Release everything taken from an arena, keeping a block large enough
+ * for all of it
+ */
+void arena_reset(struct arena *a) {
+    if (a->spills != NULL) {
+        size_t need = a->used + a->spilled;
+        while (a->spills != NULL) {
+            struct arena_spill *s = a->spills;
+            a->spills = s->next;
+            free(s);
+        }
+        a->spilled = 0;
+
+        // on failure the old block is kept, and the next request spills again
+        char *base = (char *)malloc(need);
+        if (base != NULL) {
+            free(a->base);
+            a->base = base;
+            a->cap = need;
+        }
+    }
+    a->used = 0;
+}
+
+/* Release an arena and its block */
+void arena_free(struct arena *a) {
+    while (a->spills != NULL) {
+        struct arena_spill *s = a->spills;
+        a->spills = s->next;
+        free(s);
+    }
+    a->spilled = 0;
+    a->used = 0;
+    free(a->base);
+    a->base = NULL;
+    a->cap = 0;
+}
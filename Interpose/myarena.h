@@ -0,0 +1,46 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * myarena.h
+ * Bump allocator for the scratch memory of one request on the server.
+ *
+ * Allocations are carved from one block and all released at once by
+ * arena_reset. What did not fit in the block spills into blocks of its
+ * own, and the next reset grows the block to hold all of it, so once
+ * the largest request was seen an arena never calls malloc again.
+ * An arena is used by one thread at a time.
+ */
+
+#ifndef MYARENA_H
+#define MYARENA_H
+
+#include <stddef.h>
+
+struct arena_spill;
+
+struct arena {
+    char *base; /* the block */
+    size_t cap; /* its size */
+    size_t used; /* bytes of it handed out */
+    struct arena_spill *spills; /* blocks of what did not fit, newest first */
+    size_t spilled; /* bytes handed out from them */
+};
+
+/*
+ * Take memory from an arena, aligned for any type
+ * @return:
+ *    n bytes valid until the next arena_reset, NULL if out of memory
+ */
+void *arena_alloc(struct arena *a, size_t n);
+
+/*
+ * Release everything taken from an arena, keeping a block large enough
+ * for all of it
+ */
+void arena_reset(struct arena *a);
+
+/* Release an arena and its block */
+void arena_free(struct arena *a);
+
+#endif
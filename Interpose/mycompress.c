@@ -0,0 +1,307 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * mycompress.c
+ * Implementation of the payload compression defined in mycompress.h
+ *
+ * The codec is a greedy LZ77 with a single-entry hash table, emitting the
+ * LZ4 block layout:
+ *     token            high nibble literal length, low nibble match length - 4
+ *     [255 ...] n      lengths of 15 or more continue in extra bytes
+ *     literals
+ *     u16 offset       distance back to the match, absent in the last sequence
+ *     [255 ...] n
+ * It favours speed over ratio, which suits text and logs on slow links.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "mycompress.h"
+#include "myframe.h"
+
+#define LZ_HASH_BITS 12 /* Hash table of 4096 positions */
+#define LZ_MIN_MATCH 4 /* Shortest match worth an offset */
+#define LZ_LAST_LITERALS 5 /* The block always ends with this many literals */
+#define LZ_MFLIMIT 12 /* No match starts within this many bytes of the end */
+#define LZ_MAX_OFFSET 65535 /* Farthest match a u16 offset reaches */
+#define LZ_SKIP_TRIGGER 6 /* Step grows by one every 2^6 misses in a row */
+
+#define SAMPLE_LEN 4096 /* Size of one sample */
+#define SAMPLE_COUNT 4 /* Samples taken across a large payload */
+
+static struct compress_stats stats; /* Counters of this process */
+
+/* Counters are bumped from every thread of the server */
+#define STATS_ADD(field, v) __atomic_fetch_add(&stats.field, (v), __ATOMIC_RELAXED)
+
+static inline uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * @return: CPU time of the calling thread in ns
+ */
+static uint64_t cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Write the extra bytes of a length of 15 or more
+ * @return: ptr past the bytes written, NULL if they do not fit
+ */
+static char *put_length(char *op, const char *oend, size_t n) {
+    while (n >= 255) {
+        if (op >= oend)	return NULL;
+        *op++ = (char)255;
+        n -= 255;
+    }
+    if (op >= oend)	return NULL;
+    *op++ = (char)n;
+    return op;
+}
+
+/*
+ * Read the extra bytes of a length
+ * @return: 0 on success, -1 if the block is truncated
+ */
+static int get_length(const unsigned char **ip, const unsigned char *iend, size_t *n) {
+    unsigned char b;
+    do {
+        if (*ip >= iend)	return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+/*
+ * Emit one sequence: literals, then a match unless mlen is 0 and off is 0
+ * @return: ptr past the sequence, NULL if it does not fit
+ */
+static char *put_sequence(char *op, const char *oend, const char *lit, size_t lit_len,
+                          size_t off, size_t mlen) {
+    if (op >= oend)	return NULL;
+    char *token = op++;
+    size_t match_code = off ? mlen - LZ_MIN_MATCH : 0;
+    *token = (char)(((lit_len >= 15 ? 15 : lit_len) << 4) | (match_code >= 15 ? 15 : match_code));
+    if (lit_len >= 15 && (op = put_length(op, oend, lit_len - 15)) == NULL)	return NULL;
+    if ((size_t)(oend - op) < lit_len)	return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (off == 0)	return op;
+
+    if (oend - op < 2)	return NULL;
+    put_le16(op, (uint16_t)off);
+    op += 2;
+    if (match_code >= 15)	op = put_length(op, oend, match_code - 15);
+    return op;
+}
+
+/*
+ * Compress src into an LZ4-layout block
+ * @return: length of the block, 0 if it does not fit in cap
+ */
+static size_t lz_compress_block(const char *src, size_t len, char *dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    const char *ip = src, *anchor = src, *end = src + len;
+    const char *mflimit = len > LZ_MFLIMIT ? end - LZ_MFLIMIT : src;
+    const char *mlimit = end - (len > LZ_LAST_LITERALS ? LZ_LAST_LITERALS : len);
+    char *op = dst;
+    const char *oend = dst + cap;
+    unsigned int misses = 0;
+
+    memset(table, 0, sizeof(table));
+    while (ip < mflimit) {
+        uint32_t seq = read32(ip);
+        uint32_t h = lz_hash(seq);
+        const char *ref = src + table[h];
+        table[h] = (uint32_t)(ip - src);
+
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq) {
+            /* skip faster through data that does not match */
+            ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+            continue;
+        }
+        misses = 0;
+
+        const char *mend = ip + LZ_MIN_MATCH;
+        const char *rp = ref + LZ_MIN_MATCH;
+        while (mend < mlimit && *mend == *rp) {
+            mend++;
+            rp++;
+        }
+        op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, mend - ip);
+        if (op == NULL)	return 0;
+        ip = anchor = mend;
+    }
+
+    op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+/*
+ * Decompress an LZ4-layout block
+ * @return: number of bytes written, -1 if the block is malformed or exceeds cap
+ */
+static ssize_t lz_decompress_block(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + len;
+    char *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+        unsigned int token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && get_length(&ip, iend, &lit_len) < 0)	return -1;
+        if ((size_t)(iend - ip) < lit_len || (size_t)(oend - op) < lit_len)	return -1;
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == iend)	break; // the last sequence has no match
+
+        if (iend - ip < 2)	return -1;
+        size_t off = get_le16((const char *)ip);
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst))	return -1;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_length(&ip, iend, &mlen) < 0)	return -1;
+        mlen += LZ_MIN_MATCH;
+        if ((size_t)(oend - op) < mlen)	return -1;
+
+        const char *ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+        } else {
+            // the match overlaps the bytes it produces, copy them in order
+            size_t i;
+            for (i = 0; i < mlen; i++)	op[i] = ref[i];
+        }
+        op += mlen;
+    }
+    return op - dst;
+}
+
+/*
+ * Estimate whether a large payload compresses by compressing a few
+ * samples spread across it
+ * @return: 1 if the samples shrink by at least 1/8, 0 otherwise
+ */
+static int samples_compress(const char *src, size_t len) {
+    char out[SAMPLE_LEN];
+    size_t in_total = 0, out_total = 0;
+    int i;
+
+    for (i = 0; i < SAMPLE_COUNT; i++) {
+        size_t off = (len - SAMPLE_LEN) / (SAMPLE_COUNT - 1) * i;
+        size_t n = lz_compress_block(src + off, SAMPLE_LEN, out, sizeof(out));
+        in_total += SAMPLE_LEN;
+        out_total += n ? n : SAMPLE_LEN;
+    }
+    return out_total <= in_total - in_total / 8;
+}
+
+/*
+ * Compress a payload if that makes it meaningfully smaller
+ * Payloads larger than a few samples are sampled first, so incompressible
+ * data such as media or archives only costs the samples
+ * @param:
+ *    src, len: payload
+ *    dst: where to write the compressed payload, at least len bytes
+ * @return:
+ *    length of the compressed payload, 0 if it should be sent raw
+ */
+size_t compress_payload(const char *src, size_t len, char *dst) {
+    if (len < COMPRESS_MIN_LEN || len > UINT32_MAX)	return 0;
+
+    uint64_t start = cpu_ns();
+    size_t n = 0;
+    STATS_ADD(frames, 1);
+    if (len >= 2 * SAMPLE_COUNT * SAMPLE_LEN && !samples_compress(src, len)) {
+        STATS_ADD(skipped, 1);
+    } else {
+        // it has to save at least 1/16 to be worth decompressing
+        n = lz_compress_block(src, len, dst + COMPRESS_HDR_SIZE, len - len / 16 - COMPRESS_HDR_SIZE);
+    }
+    STATS_ADD(compress_ns, cpu_ns() - start);
+    if (n == 0)	return 0;
+
+    put_le32(dst, (uint32_t)len);
+    n += COMPRESS_HDR_SIZE;
+    STATS_ADD(compressed, 1);
+    STATS_ADD(raw_bytes, len);
+    STATS_ADD(wire_bytes, n);
+    return n;
+}
+
+/*
+ * @return: decompressed length announced by a compressed payload, 0 if truncated
+ */
+size_t compressed_raw_len(const char *src, size_t len) {
+    if (len < COMPRESS_HDR_SIZE)	return 0;
+    return get_le32(src);
+}
+
+/*
+ * Decompress a payload built by compress_payload
+ * @param:
+ *    src, len: compressed payload
+ *    dst, cap: where to write the data
+ * @return:
+ *    number of bytes written, -1 if the payload is malformed or exceeds cap
+ */
+ssize_t decompress_payload(const char *src, size_t len, char *dst, size_t cap) {
+    size_t raw_len = compressed_raw_len(src, len);
+    if (raw_len == 0 || raw_len > cap)	return -1;
+
+    uint64_t start = cpu_ns();
+    ssize_t n = lz_decompress_block(src + COMPRESS_HDR_SIZE, len - COMPRESS_HDR_SIZE, dst, raw_len);
+    STATS_ADD(decompress_ns, cpu_ns() - start);
+    if (n != (ssize_t)raw_len)	return -1;
+    return n;
+}
+
+/* Copy out the counters of this process */
+void get_compress_stats(struct compress_stats *out) {
+    *out = stats;
+}
+
+/*
+ * Print the counters to stderr, nothing if no payload was offered
+ * @param:
+ *    who: prefix naming the process
+ */
+void print_compress_stats(const char *who) {
+    if (stats.frames == 0 && stats.decompress_ns == 0)	return;
+    fprintf(stderr, "%s: compressed %llu of %llu payloads (%llu skipped by sampling), "
+            "%llu -> %llu bytes (ratio %.2f), compress %.3f ms, decompress %.3f ms cpu\n",
+            who, (unsigned long long)stats.compressed, (unsigned long long)stats.frames,
+            (unsigned long long)stats.skipped, (unsigned long long)stats.raw_bytes,
+            (unsigned long long)stats.wire_bytes,
+            stats.wire_bytes ? (double)stats.raw_bytes / stats.wire_bytes : 1.0,
+            stats.compress_ns / 1e6, stats.decompress_ns / 1e6);
+}
+
+/*
+ * Append a payload to a message in compressed form, if it compresses
+ * The frame is flagged FRAME_F_LZ when it does
+ * @return: 1 if the payload was added, 0 if it should be added raw
+ */
+int msg_put_compressed(struct msg_writer *w, const void *p, size_t n) {
+    if (n < COMPRESS_MIN_LEN)	return 0;
+    char *dst = msg_payload_space(w, n);
+    if (dst == NULL)	return 0;
+    size_t len = compress_payload((const char *)p, n, dst);
+    if (len == 0)	return 0;
+    msg_payload_commit(w, len);
+    msg_add_flags(w, FRAME_F_LZ);
+    return 1;
+}
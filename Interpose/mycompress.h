@@ -0,0 +1,78 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * mycompress.h
+ * Payload compression shared by mylib and server.
+ *
+ * A compressed payload is
+ *
+ *     u32 raw_len      length of the payload once decompressed
+ *     block            LZ77 sequences in the LZ4 block layout
+ *
+ * and is marked with FRAME_F_LZ in the frame header. It is only used on
+ * connections where both peers advertised CAP_COMPRESS in OP_HELLO.
+ * Payloads that are small or do not compress well are sent as they are.
+ */
+
+#ifndef MYCOMPRESS_H
+#define MYCOMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define COMPRESS_HDR_SIZE 4 /* Size of the u32 raw length in front of a block */
+#define COMPRESS_MIN_LEN 512 /* Smaller payloads are never worth compressing */
+
+/* Counters of the work done by this process, for tuning the codec */
+struct compress_stats {
+    uint64_t frames; /* payloads offered to compress_payload */
+    uint64_t compressed; /* payloads sent compressed */
+    uint64_t skipped; /* payloads rejected by sampling */
+    uint64_t raw_bytes; /* bytes of the payloads sent compressed */
+    uint64_t wire_bytes; /* bytes they took on the wire */
+    uint64_t compress_ns; /* CPU time spent compressing and sampling */
+    uint64_t decompress_ns; /* CPU time spent decompressing */
+};
+
+/*
+ * Compress a payload if that makes it meaningfully smaller
+ * @param:
+ *    src, len: payload
+ *    dst: where to write the compressed payload, at least len bytes
+ * @return:
+ *    length of the compressed payload, 0 if it should be sent raw
+ */
+size_t compress_payload(const char *src, size_t len, char *dst);
+
+/*
+ * @return: decompressed length announced by a compressed payload, 0 if truncated
+ */
+size_t compressed_raw_len(const char *src, size_t len);
+
+/*
+ * Decompress a payload built by compress_payload
+ * @param:
+ *    src, len: compressed payload
+ *    dst, cap: where to write the data
+ * @return:
+ *    number of bytes written, -1 if the payload is malformed or exceeds cap
+ */
+ssize_t decompress_payload(const char *src, size_t len, char *dst, size_t cap);
+
+struct msg_writer;
+
+/*
+ * Append a payload to a message in compressed form, if it compresses
+ * @return: 1 if the payload was added, 0 if it should be added raw
+ */
+int msg_put_compressed(struct msg_writer *w, const void *p, size_t n);
+
+/* Copy out the counters of this process */
+void get_compress_stats(struct compress_stats *out);
+
+/* Print the counters to stderr, prefixed with who */
+void print_compress_stats(const char *who);
+
+#endif
@@ -0,0 +1,491 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * myframe.c
+ * Implementation of the frame helpers defined in myframe.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "myframe.h"
+
+#define MSG_MIN_CAP 256 /* Initial size of a msg_writer buffer */
+
+/*
+ * Write the frame header that follows the length prefix
+ * @param:
+ *    body: start of the message body (what send_message will send)
+ *    opcode: rpc opcode
+ *    flags: FRAME_F_* bits
+ *    args_len: number of bytes of fixed-width arguments
+ *    req_id: id of the request, echoed by its reply
+ */
+void encode_frame_header(char *body, int opcode, int flags, int args_len, uint32_t req_id) {
+    body[0] = (char)opcode;
+    body[1] = (char)flags;
+    put_le16(body + 2, (uint16_t)args_len);
+    put_le32(body + 4, req_id);
+}
+
+/*
+ * Decode the header of a received frame
+ * @param:
+ *    frame: start of the frame, including the length prefix
+ *    hdr: decoded header
+ * @return:
+ *    0 if the arguments fit in the frame, -1 otherwise
+ */
+int decode_frame_header(const char *frame, struct frame_header *hdr) {
+    hdr->frame_len = get_le32(frame);
+    hdr->opcode = (uint8_t)frame[FRAME_LEN_SIZE];
+    hdr->flags = (uint8_t)frame[FRAME_LEN_SIZE + 1];
+    hdr->args_len = get_le16(frame + FRAME_LEN_SIZE + 2);
+    hdr->req_id = get_le32(frame + FRAME_LEN_SIZE + 4);
+
+    if (hdr->frame_len < FRAME_HDR_SIZE ||
+        hdr->frame_len - FRAME_HDR_SIZE < hdr->args_len) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @return: ptr to the fixed-width arguments of a frame
+ */
+char *frame_args(char *frame) {
+    return frame + FRAME_LEN_SIZE + FRAME_HDR_SIZE;
+}
+
+/*
+ * @return: ptr to the payload, which follows the arguments
+ */
+char *frame_payload(char *frame, const struct frame_header *hdr) {
+    return frame_args(frame) + hdr->args_len;
+}
+
+/*
+ * @return: number of payload bytes in the frame
+ */
+size_t frame_payload_len(const struct frame_header *hdr) {
+    return hdr->frame_len - FRAME_HDR_SIZE - hdr->args_len;
+}
+
+/*
+ * @return: opcode of a received frame
+ */
+int frame_opcode(const char *frame) {
+    return (uint8_t)frame[FRAME_LEN_SIZE];
+}
+
+/*
+ * @return: FRAME_F_* bits of a received frame
+ */
+int frame_flags(const char *frame) {
+    return (uint8_t)frame[FRAME_LEN_SIZE + 1];
+}
+
+/*
+ * @return: request id of a received frame
+ */
+uint32_t frame_req_id(const char *frame) {
+    return get_le32(frame + FRAME_LEN_SIZE + 4);
+}
+
+/*
+ * @return: CODEC_VARINT if the frame arguments are varint encoded
+ */
+int frame_codec(const struct frame_header *hdr) {
+    return (hdr->flags & FRAME_F_VARINT) ? CODEC_VARINT : CODEC_FIXED;
+}
+
+/*
+ * @return: frame flags announcing the codec
+ */
+int codec_flags(int codec) {
+    return codec == CODEC_VARINT ? FRAME_F_VARINT : 0;
+}
+
+/*
+ * Encode an unsigned value as LEB128, 7 bits per byte, low bits first
+ * @return: number of bytes written, at most 10
+ */
+int put_varint(char *p, uint64_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (char)v;
+    return n;
+}
+
+/*
+ * Decode a LEB128 value
+ * @param:
+ *    p: first byte of the varint
+ *    end: first byte past the arguments
+ *    v: decoded value
+ * @return:
+ *    number of bytes consumed, -1 if the varint is truncated or too long
+ */
+int get_varint(const char *p, const char *end, uint64_t *v) {
+    uint64_t res = 0;
+    int n = 0, shift = 0;
+    while (p + n < end && shift < 64) {
+        unsigned char b = (unsigned char)p[n++];
+        res |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = res;
+            return n;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+int put_arg_i32(char *p, int32_t v, int codec) {
+    if (codec == CODEC_VARINT)	return put_varint(p, zigzag_encode(v));
+    put_le32(p, (uint32_t)v);
+    return 4;
+}
+
+int put_arg_u32(char *p, uint32_t v, int codec) {
+    if (codec == CODEC_VARINT)	return put_varint(p, v);
+    put_le32(p, v);
+    return 4;
+}
+
+int put_arg_i64(char *p, int64_t v, int codec) {
+    if (codec == CODEC_VARINT)	return put_varint(p, zigzag_encode(v));
+    put_le64(p, (uint64_t)v);
+    return 8;
+}
+
+int put_arg_u64(char *p, uint64_t v, int codec) {
+    if (codec == CODEC_VARINT)	return put_varint(p, v);
+    put_le64(p, v);
+    return 8;
+}
+
+/*
+ * Encode a lib-created file descriptor
+ * The varint codec sends it relative to FD_OFFSET so it usually takes one byte
+ * @return: number of bytes written
+ */
+int put_arg_fd(char *p, int fd, int codec) {
+    if (codec == CODEC_VARINT)	return put_varint(p, zigzag_encode((int64_t)fd - FD_OFFSET));
+    put_le32(p, (uint32_t)fd);
+    return 4;
+}
+
+/*
+ * Start reading the arguments of a received frame
+ * @param:
+ *    r: reader to initialize
+ *    frame: start of the frame, including the length prefix
+ *    hdr: decoded header of the frame
+ */
+void arg_reader_init(struct arg_reader *r, char *frame, const struct frame_header *hdr) {
+    r->p = frame_args(frame);
+    r->end = r->p + hdr->args_len;
+    r->codec = frame_codec(hdr);
+    r->error = 0;
+}
+
+/*
+ * Read the next argument as raw unsigned bits
+ * @param:
+ *    r: reader
+ *    width: size of the field with the fixed-width codec
+ * @return:
+ *    value read, 0 with r->error set if the arguments are exhausted
+ */
+static uint64_t read_arg_raw(struct arg_reader *r, int width) {
+    uint64_t v = 0;
+    if (r->error)	return 0;
+    if (r->codec == CODEC_VARINT) {
+        int n = get_varint(r->p, r->end, &v);
+        if (n < 0) {
+            r->error = 1;
+            return 0;
+        }
+        r->p += n;
+        return v;
+    }
+    if (r->end - r->p < width) {
+        r->error = 1;
+        return 0;
+    }
+    v = width == 4 ? get_le32(r->p) : get_le64(r->p);
+    r->p += width;
+    return v;
+}
+
+int32_t read_arg_i32(struct arg_reader *r) {
+    uint64_t v = read_arg_raw(r, 4);
+    return r->codec == CODEC_VARINT ? (int32_t)zigzag_decode(v) : (int32_t)v;
+}
+
+uint32_t read_arg_u32(struct arg_reader *r) {
+    return (uint32_t)read_arg_raw(r, 4);
+}
+
+int64_t read_arg_i64(struct arg_reader *r) {
+    uint64_t v = read_arg_raw(r, 8);
+    return r->codec == CODEC_VARINT ? zigzag_decode(v) : (int64_t)v;
+}
+
+uint64_t read_arg_u64(struct arg_reader *r) {
+    return read_arg_raw(r, 8);
+}
+
+int read_arg_fd(struct arg_reader *r) {
+    uint64_t v = read_arg_raw(r, 4);
+    if (r->codec == CODEC_VARINT)	return (int)(zigzag_decode(v) + FD_OFFSET);
+    return (int)(int32_t)v;
+}
+
+/*
+ * Make room for n more bytes in the writer, doubling its buffer if needed
+ * @return: 0 on success, -1 if the buffer could not grow
+ */
+static int msg_reserve(struct msg_writer *w, size_t n) {
+    if (w->error)	return -1;
+    if (w->len + n <= w->cap)	return 0;
+
+    size_t cap = w->cap ? w->cap : MSG_MIN_CAP;
+    while (cap < w->len + n)	cap *= 2;
+    char *buf = (char *)realloc(w->buf, cap);
+    if (buf == NULL) {
+        w->error = 1;
+        return -1;
+    }
+    w->buf = buf;
+    w->cap = cap;
+    return 0;
+}
+
+/*
+ * Start a new message in the writer, keeping its buffer
+ * Room for the length prefix and the header is reserved; both are
+ * filled in by msg_finish once the sizes are known
+ * @param:
+ *    w: writer
+ *    opcode: rpc opcode
+ *    flags: FRAME_F_* bits, the codec flag is added from codec
+ *    codec: codec of the arguments
+ */
+void msg_begin(struct msg_writer *w, int opcode, int flags, int codec) {
+    w->len = 0;
+    w->payload_start = 0;
+    w->ref = NULL;
+    w->ref_len = 0;
+    w->codec = codec;
+    w->error = 0;
+    if (msg_reserve(w, FRAME_LEN_SIZE + FRAME_HDR_SIZE + ARGS_MAX_LEN) < 0)	return;
+    encode_frame_header(w->buf + FRAME_LEN_SIZE, opcode, flags | codec_flags(codec), 0, 0);
+    w->len = FRAME_LEN_SIZE + FRAME_HDR_SIZE;
+}
+
+void msg_put_i32(struct msg_writer *w, int32_t v) {
+    if (msg_reserve(w, 10) == 0)	w->len += put_arg_i32(w->buf + w->len, v, w->codec);
+}
+
+void msg_put_u32(struct msg_writer *w, uint32_t v) {
+    if (msg_reserve(w, 10) == 0)	w->len += put_arg_u32(w->buf + w->len, v, w->codec);
+}
+
+void msg_put_i64(struct msg_writer *w, int64_t v) {
+    if (msg_reserve(w, 10) == 0)	w->len += put_arg_i64(w->buf + w->len, v, w->codec);
+}
+
+void msg_put_u64(struct msg_writer *w, uint64_t v) {
+    if (msg_reserve(w, 10) == 0)	w->len += put_arg_u64(w->buf + w->len, v, w->codec);
+}
+
+void msg_put_fd(struct msg_writer *w, int fd) {
+    if (msg_reserve(w, 10) == 0)	w->len += put_arg_fd(w->buf + w->len, fd, w->codec);
+}
+
+/*
+ * Append payload bytes, which closes the argument section
+ */
+void msg_put_bytes(struct msg_writer *w, const void *p, size_t n) {
+    if (w->payload_start == 0)	w->payload_start = w->len;
+    if (n == 0 || msg_reserve(w, n) < 0)	return;
+    memcpy(w->buf + w->len, p, n);
+    w->len += n;
+}
+
+/*
+ * Append payload bytes by reference, which closes the message
+ * The bytes are not copied; they are sent from p by msg_iov and have to
+ * stay valid until then. Used for the user's buffer of a write.
+ */
+void msg_put_ref(struct msg_writer *w, const void *p, size_t n) {
+    if (w->payload_start == 0)	w->payload_start = w->len;
+    w->ref = (const char *)p;
+    w->ref_len = n;
+}
+
+/*
+ * Make room for n payload bytes that the caller writes in place
+ * Nothing is added until msg_payload_commit says how many were written
+ * @return: ptr to the room, NULL if the buffer could not grow
+ */
+char *msg_payload_space(struct msg_writer *w, size_t n) {
+    if (w->payload_start == 0)	w->payload_start = w->len;
+    if (msg_reserve(w, n) < 0)	return NULL;
+    return w->buf + w->len;
+}
+
+/*
+ * Add the n bytes written in the room given by msg_payload_space
+ */
+void msg_payload_commit(struct msg_writer *w, size_t n) {
+    w->len += n;
+}
+
+/*
+ * Set more FRAME_F_* bits in the header of the message
+ */
+void msg_add_flags(struct msg_writer *w, int flags) {
+    if (w->error)	return;
+    w->buf[FRAME_LEN_SIZE + 1] |= (char)flags;
+}
+
+/*
+ * Set the id the reply to the message will carry
+ */
+void msg_set_req_id(struct msg_writer *w, uint32_t req_id) {
+    if (w->error)	return;
+    put_le32(w->buf + FRAME_LEN_SIZE + 4, req_id);
+}
+
+/*
+ * Fill in the length prefix and the argument length of the message
+ * @return:
+ *    length of the whole frame, 0 if the buffer could not grow
+ */
+size_t msg_finish(struct msg_writer *w) {
+    if (w->error)	return 0;
+    size_t args_end = w->payload_start ? w->payload_start : w->len;
+    put_le16(w->buf + FRAME_LEN_SIZE + 2, (uint16_t)(args_end - FRAME_LEN_SIZE - FRAME_HDR_SIZE));
+    put_le32(w->buf, (uint32_t)(w->len + w->ref_len - FRAME_LEN_SIZE));
+    return w->len + w->ref_len;
+}
+
+/*
+ * Describe a finished message for send_iov
+ * @return: number of iovecs filled in, 1 or 2
+ */
+int msg_iov(const struct msg_writer *w, struct iovec iov[2]) {
+    iov[0].iov_base = w->buf;
+    iov[0].iov_len = w->len;
+    if (w->ref_len == 0)	return 1;
+    iov[1].iov_base = (void *)w->ref;
+    iov[1].iov_len = w->ref_len;
+    return 2;
+}
+
+/*
+ * Wait until a socket takes more bytes or a deadline passes
+ * @return: 0 once it may take some, -1 with errno ETIMEDOUT past the deadline
+ */
+static int wait_writable(int sockfd, uint64_t deadline) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    if (now >= deadline) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    struct pollfd pfd = {.fd = sockfd, .events = POLLOUT};
+    if (poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000)) < 0 && errno != EINTR)	return -1;
+    return 0;
+}
+
+/*
+ * Send a frame held in several buffers with sendmsg
+ * After a partial send the iovecs are advanced past the bytes sent, so
+ * the caller's iov array is modified. EINTR is retried. MSG_NOSIGNAL
+ * turns a vanished peer into EPIPE instead of a SIGPIPE.
+ * With a deadline the socket is never blocked on, it is polled for room
+ * until the deadline instead.
+ * @param:
+ *    deadline: CLOCK_MONOTONIC ns to give up at, 0 to wait as long as it takes
+ * @return: number of bytes sent, -1 if error occurred, with errno
+ *    ETIMEDOUT if the deadline passed, maybe after part of the frame went out
+ */
+ssize_t send_iov(int sockfd, struct iovec *iov, int iovcnt, uint64_t deadline) {
+    struct msghdr mh;
+    ssize_t total = 0;
+    int flags = MSG_NOSIGNAL | (deadline ? MSG_DONTWAIT : 0);
+
+    memset(&mh, 0, sizeof(mh));
+    while (iovcnt > 0) {
+        mh.msg_iov = iov;
+        mh.msg_iovlen = iovcnt;
+        ssize_t sd = sendmsg(sockfd, &mh, flags);
+        if (sd < 0) {
+            if (errno == EINTR)	continue;
+            if (deadline && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (wait_writable(sockfd, deadline) < 0)	return -1;
+                continue;
+            }
+            return -1;
+        }
+        total += sd;
+        // drop the iovecs sent in full, then trim the first one left
+        while (iovcnt > 0 && (size_t)sd >= iov->iov_len) {
+            sd -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + sd;
+            iov->iov_len -= sd;
+        }
+    }
+    return total;
+}
+
+/*
+ * Release the buffer of a writer
+ */
+void msg_free(struct msg_writer *w) {
+    free(w->buf);
+    w->buf = NULL;
+    w->len = w->cap = 0;
+}
+
+/*
+ * Receive exactly len bytes
+ * MSG_WAITALL asks the kernel for all of them at once; it still returns
+ * early when a signal arrives, so the call is repeated for the rest
+ * @return:
+ *    len, 0 if the peer closed before the first byte, -1 on error,
+ *    with errno EPROTO if the peer closed in the middle
+ */
+ssize_t recv_exact(int sockfd, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t rv = recv(sockfd, (char *)buf + got, len - got, MSG_WAITALL);
+        if (rv < 0) {
+            if (errno == EINTR)	continue;
+            return -1;
+        }
+        if (rv == 0) {
+            if (got == 0)	return 0;
+            errno = EPROTO;
+            return -1;
+        }
+        got += rv;
+    }
+    return got;
+}
@@ -0,0 +1,266 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * myframe.h
+ * Binary wire format shared by mylib and server.
+ *
+ * Every message on the wire is one frame:
+ *
+ *     u32 frame_len    number of bytes following this field
+ *     u8  opcode       which RPC (enum rpc_opcode)
+ *     u8  flags        FRAME_F_* bits
+ *     u16 args_len     number of bytes of arguments
+ *     u32 req_id       chosen by the client, echoed by the reply
+ *     args             args_len bytes of integer arguments
+ *     payload          frame_len - FRAME_HDR_SIZE - args_len bytes
+ *
+ * The length prefix is patched in last, by msg_finish on the client and by
+ * build_reply_in_place on the server, once the argument and payload lengths
+ * are known.
+ * A reply echoes the request opcode and id, sets FRAME_F_REPLY and always
+ * carries the i64 return value (result or -errno) as its first argument.
+ * The client may send several requests before reading any reply, and the
+ * server may answer them in any order, so replies are matched to their
+ * requests by req_id. Requests on the same fd are still run in order.
+ *
+ * Arguments are little-endian fixed-width fields, or, when FRAME_F_VARINT
+ * is set, LEB128 varints (zigzag for signed values). The varint codec is
+ * only used after both peers advertised CAP_VARINT in the OP_HELLO
+ * exchange; a reply always uses the codec of its request.
+ * Likewise FRAME_F_LZ marks a compressed payload once both peers
+ * advertised CAP_COMPRESS.
+ *
+ * With CAP_SESSION the hello reply also names the session of the
+ * connection on the server and the key to resume it with. A client whose connection
+ * dropped connects again and sends both in its hello; if the session is
+ * still there, the new connection carries on with its fds and offsets.
+ *
+ * A read or write of more than MAXWRITELEN bytes is streamed as a series
+ * of frames of at most MAXWRITELEN payload bytes each, sent back to back.
+ * Every frame but the last sets FRAME_F_MORE. The client streams write
+ * chunks and only the last one is answered; the server streams read
+ * replies, each carrying the length of its own chunk.
+ * OP_PREAD reads at an offset without moving the file offset, like
+ * pread(2), and is answered like OP_READ.
+ * OP_CANCEL asks the server to give up on an earlier request whose reply
+ * nobody waits for any more. It is not answered itself; the request is
+ * answered -ECANCELED if it had not started, or cut short if it streams,
+ * otherwise it completes as usual.
+ * OP_FSTAT stats an open fd, like fstat(2), and is answered like OP_STAT.
+ */
+
+#ifndef MYFRAME_H
+#define MYFRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define FRAME_LEN_SIZE 4 /* Size of the u32 length prefix */
+#define FRAME_HDR_SIZE 8 /* Size of opcode, flags, args_len and req_id after the prefix */
+#define FD_OFFSET 1000000 /* Starting offset of lib-created file descriptors */
+#define MAXWRITELEN (1 << 20) /* Largest payload of a frame, longer reads and writes are chunked */
+
+/* Frame flags */
+#define FRAME_F_REPLY 0x01 /* Frame is a reply from the server */
+#define FRAME_F_VARINT 0x02 /* Arguments are varint encoded */
+#define FRAME_F_LZ 0x04 /* Payload is compressed, see mycompress.h */
+#define FRAME_F_MORE 0x08 /* More chunks of the same read or write follow */
+
+/* Capabilities advertised in OP_HELLO */
+#define CAP_VARINT 0x01 /* Peer understands FRAME_F_VARINT */
+#define CAP_COMPRESS 0x02 /* Peer understands FRAME_F_LZ */
+#define CAP_SESSION 0x04 /* Client may resume the session over a new connection */
+
+/* Argument codecs */
+#define CODEC_FIXED 0
+#define CODEC_VARINT 1
+
+/* Opcodes carried in the frame header */
+enum rpc_opcode {
+    OP_OPEN = 1,
+    OP_CLOSE,
+    OP_READ,
+    OP_WRITE,
+    OP_LSEEK,
+    OP_STAT,
+    OP_UNLINK,
+    OP_GETDIRENTRIES,
+    OP_GETDIRTREE,
+    OP_HELLO,
+    OP_PREAD,
+    OP_CANCEL,
+    OP_FSTAT,
+    OP_MAX
+};
+
+/*
+ * Upper bound of the encoded arguments of a message with any codec.
+ * The per-rpc argument layouts live in myrpc.h.
+ */
+#define ARGS_MAX_LEN 40
+
+/* Decoded frame header */
+struct frame_header {
+    uint32_t frame_len;
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t args_len;
+    uint32_t req_id;
+};
+
+/* Cursor over the arguments of a received frame */
+struct arg_reader {
+    const char *p;
+    const char *end;
+    int codec;
+    int error; /* set once a read runs past the arguments */
+};
+
+/*
+ * Growable buffer a whole frame is encoded into, length prefix included
+ * The buffer is owned by the caller and reused from one message to the
+ * next, so it only allocates when a message is larger than any before it
+ */
+struct msg_writer {
+    char *buf;
+    size_t len; /* bytes written so far */
+    size_t cap; /* size of buf */
+    size_t payload_start; /* where the arguments end, 0 while still writing them */
+    const char *ref; /* payload sent from the caller's memory after buf, may be NULL */
+    size_t ref_len; /* length of ref */
+    int codec; /* argument codec */
+    int error; /* set if the buffer could not grow */
+};
+
+/* Little-endian fixed-width field accessors */
+static inline void put_le16(char *p, uint16_t v) {
+    p[0] = (char)v;
+    p[1] = (char)(v >> 8);
+}
+
+static inline void put_le32(char *p, uint32_t v) {
+    p[0] = (char)v;
+    p[1] = (char)(v >> 8);
+    p[2] = (char)(v >> 16);
+    p[3] = (char)(v >> 24);
+}
+
+static inline void put_le64(char *p, uint64_t v) {
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint16_t get_le16(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (uint16_t)(u[0] | (u[1] << 8));
+}
+
+static inline uint32_t get_le32(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (uint32_t)u[0] | ((uint32_t)u[1] << 8) |
+           ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+static inline uint64_t get_le64(const char *p) {
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+/* Zigzag mapping of signed values onto small unsigned ones */
+static inline uint64_t zigzag_encode(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* LEB128 varint, returns bytes written or consumed (-1 if truncated) */
+int put_varint(char *p, uint64_t v);
+int get_varint(const char *p, const char *end, uint64_t *v);
+
+/*
+ * Encode one argument with the given codec
+ * @return: number of bytes written
+ */
+int put_arg_i32(char *p, int32_t v, int codec);
+int put_arg_u32(char *p, uint32_t v, int codec);
+int put_arg_i64(char *p, int64_t v, int codec);
+int put_arg_u64(char *p, uint64_t v, int codec);
+int put_arg_fd(char *p, int fd, int codec);
+
+/* Decode arguments in order, 0 is returned and r->error set on overrun */
+void arg_reader_init(struct arg_reader *r, char *frame, const struct frame_header *hdr);
+int32_t read_arg_i32(struct arg_reader *r);
+uint32_t read_arg_u32(struct arg_reader *r);
+int64_t read_arg_i64(struct arg_reader *r);
+uint64_t read_arg_u64(struct arg_reader *r);
+int read_arg_fd(struct arg_reader *r);
+
+/*
+ * Encode a message into a writer: msg_begin, arguments in order,
+ * then optionally payload bytes, then msg_finish
+ */
+void msg_begin(struct msg_writer *w, int opcode, int flags, int codec);
+void msg_put_i32(struct msg_writer *w, int32_t v);
+void msg_put_u32(struct msg_writer *w, uint32_t v);
+void msg_put_i64(struct msg_writer *w, int64_t v);
+void msg_put_u64(struct msg_writer *w, uint64_t v);
+void msg_put_fd(struct msg_writer *w, int fd);
+void msg_put_bytes(struct msg_writer *w, const void *p, size_t n);
+void msg_put_ref(struct msg_writer *w, const void *p, size_t n);
+char *msg_payload_space(struct msg_writer *w, size_t n);
+void msg_payload_commit(struct msg_writer *w, size_t n);
+void msg_add_flags(struct msg_writer *w, int flags);
+void msg_set_req_id(struct msg_writer *w, uint32_t req_id);
+size_t msg_finish(struct msg_writer *w);
+int msg_iov(const struct msg_writer *w, struct iovec iov[2]);
+void msg_free(struct msg_writer *w);
+
+/*
+ * Send a frame held in several buffers with sendmsg, resuming partial
+ * sends and retrying EINTR, until deadline (CLOCK_MONOTONIC ns, 0 for none)
+ * @return: number of bytes sent, -1 if error occurred, ETIMEDOUT past the deadline
+ */
+ssize_t send_iov(int sockfd, struct iovec *iov, int iovcnt, uint64_t deadline);
+
+/*
+ * Receive exactly len bytes with MSG_WAITALL, retrying EINTR
+ * @return: len, 0 if the peer closed before the first byte, -1 on error
+ */
+ssize_t recv_exact(int sockfd, void *buf, size_t len);
+
+/* Opcode of a received frame (starting at the length prefix) */
+int frame_opcode(const char *frame);
+
+/* FRAME_F_* bits of a received frame (starting at the length prefix) */
+int frame_flags(const char *frame);
+
+/* Request id of a received frame (starting at the length prefix) */
+uint32_t frame_req_id(const char *frame);
+
+/* Codec of the arguments of a frame */
+int frame_codec(const struct frame_header *hdr);
+
+/* Frame flags announcing the given codec */
+int codec_flags(int codec);
+
+/* Write opcode, flags, args_len and req_id at the start of a message body */
+void encode_frame_header(char *body, int opcode, int flags, int args_len, uint32_t req_id);
+
+/*
+ * Decode the header of a received frame (starting at the length prefix)
+ * @return: 0 if the header is consistent, -1 otherwise
+ */
+int decode_frame_header(const char *frame, struct frame_header *hdr);
+
+/* Pointer to the fixed-width arguments of a received frame */
+char *frame_args(char *frame);
+
+/* Pointer to, and length of, the payload of a received frame */
+char *frame_payload(char *frame, const struct frame_header *hdr);
+size_t frame_payload_len(const struct frame_header *hdr);
+
+#endif
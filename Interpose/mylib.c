@@ -28,127 +28,384 @@
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <pthread.h>
 #include "mystub.h"
+#include "myframe.h"
+#include "myrpc.h"
+#include "mycompress.h"
+#include "mytransport.h"
 
-#define INTSIZE 13 /* Size of char representation of int */
-#define ULISIZE 26 /* Size of char representation of unsigned long */
-#define LONGSIZE 26 /* Size of char representation of long */
-#define MAXWRITELEN 1000100 /* Maximum length of the marshall message */
-#define FD_OFFSET 1000000 /* Starting offset of lib-created file descriptors */
+#define CONNECTION_MIN_CAP 4096 /* Initial size of connection_buf */
+#define CONN_SLOTS 64 /* Connections to the server one process opens at most */
+#define CONN_FD_RANGE 65536 /* Server fds told apart behind one connection */
 
-char connection_buf[MAXWRITELEN+1]; /* Connection buffer to receive message from server */
-struct dirtreenode *ret_dirtreenode; /* ptr to dirtreenode returned from getdirtree */
-char marshallMsg[MAXWRITELEN]; /* Message buffer when doing marshalling */
-int firstConnect = 1; /* Var to denote whether it is the first connection to server */
+/*
+ * Per-thread state: every application thread marshals into its own
+ * message buffer and receives into its own connection buffer
+ */
+__thread char *connection_buf; /* Connection buffer to receive message from server */
+__thread size_t connection_cap; /* Size of connection_buf, grown for frames such as large dirtrees */
+__thread char *reply_payload; /* Where the payload of the last reply was received */
+__thread struct dirtreenode *ret_dirtreenode; /* ptr to dirtreenode returned from getdirtree */
+__thread struct msg_writer marshallMsg; /* Growable message buffer when doing marshalling */
+int arg_codec = CODEC_FIXED; /* Argument codec agreed with the server in the hello exchange */
+int peer_caps; /* Capabilities agreed with the server in the hello exchange */
 
+/*
+ * Reply received while waiting for another request
+ * Kept in arrival order, as a streamed read answers with several frames
+ */
+struct parked_reply {
+    uint32_t req_id;
+    char *frame; /* whole frame, starting at its length prefix */
+    struct parked_reply *next;
+};
+
+/* Request given up on whose last reply has not come yet */
+struct cancelled_req {
+    uint32_t req_id;
+    struct cancelled_req *next;
+};
+
+/*
+ * Connection to the server, with its own server process and fd table
+ * Each thread opens one on its first call and sends path calls over it.
+ * An fd remembers the connection it was opened over, see lib_fd, so any
+ * thread may use it; a connection is therefore shared and several threads
+ * may wait on it at once. One of them receives frames at a time and parks
+ * the replies of the others, which wait on the condition variable.
+ * When the server offers a session, a connection that drops is resumed
+ * over a new one by the next call, see resume_conn, and keeps its fds.
+ */
+struct client_conn {
+    struct conn *conn;
+    int slot; /* index in conn_slots, also part of the fds opened over it */
+    pthread_mutex_t send_lock; /* held while a message, or a whole stream, goes out */
+    pthread_mutex_t lock; /* guards the fields below */
+    pthread_cond_t replies; /* broadcast when a reply is parked or the receiver steps down */
+    int receiving; /* a thread is reading frames */
+    int dead; /* the server went away or the stream failed */
+    int error; /* errno calls fail with once dead */
+    uint64_t session; /* session of its server, 0 if it cannot be resumed */
+    uint64_t session_key; /* key to resume it with */
+    uint32_t last_req_id; /* id of the last request sent, ids start at 1 */
+    uint32_t first_id; /* requests before it went over a connection since replaced, 0 if none */
+    struct parked_reply *parked_head; /* oldest parked reply */
+    struct parked_reply *parked_tail; /* newest parked reply */
+    struct cancelled_req *cancelled; /* replies to drop on arrival */
+    int threads; /* threads this is the home connection of */
+    int open_fds; /* fds opened over it and not yet closed */
+};
+
+struct client_conn *conn_slots[CONN_SLOTS]; /* open connections */
+pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER; /* guards conn_slots and the counts */
+__thread struct client_conn *home_conn; /* connection of the calling thread */
+pthread_key_t home_key; /* releases the home connection when a thread exits */
+pthread_once_t home_key_once = PTHREAD_ONCE_INIT;
 
 char *serverip; /* server ip address */
 char *serverport; /* server port */
 unsigned short port; /* port number in integer */
-int sockfd; /* socket file descriptor */
-int rv; /* return value of receiving messages */
-struct sockaddr_in srv;
 
-char *get_ret_content(char *ret_val);
+/*
+ * Deadlines
+ * metadeadline15440 and datadeadline15440 bound, in milliseconds, how
+ * long a call of kind DEADLINE_META or DEADLINE_DATA waits for the server
+ * in total. A call past its deadline fails with ETIMEDOUT; the server is
+ * asked to cancel the request left behind and its reply is dropped
+ * whenever it arrives. Unset or 0 waits as long as it takes.
+ */
+int deadline_ms[2]; /* deadline of each kind of call, 0 for none */
+pthread_once_t deadline_once = PTHREAD_ONCE_INIT;
+__thread uint64_t call_deadline; /* CLOCK_MONOTONIC ns the current call ends by, 0 for none */
+__thread int call_kind; /* DEADLINE_* of the current call */
+__thread int call_missed; /* whether the current call was counted as a miss */
+__thread int call_depth; /* START_CALL scopes open on this thread */
+struct rpc_deadline_stats deadline_stats;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void read_deadlines(void) {
+    char *meta = getenv("metadeadline15440");
+    char *data = getenv("datadeadline15440");
+    if (meta && atoi(meta) > 0)	deadline_ms[DEADLINE_META] = atoi(meta);
+    if (data && atoi(data) > 0)	deadline_ms[DEADLINE_DATA] = atoi(data);
+}
 
 /*
- * Client-side marshalling of system calls
- * The main idea is to:
- * 1. Append method name at front
- * 2. Append the method name with a '|' character
- * 3. Append argv (created by caller)
- * 4. Don't forget to append '\0' to terminate char array
+ * Start the clock of an interposed call
+ * A call made from within another one, such as stat_fields_send from
+ * stat_fields, runs on the clock of the outer call
+ * @param:
+ *    kind: DEADLINE_META or DEADLINE_DATA
+ * @return:
+ *    kind, for START_CALL
  */
-char* marshalling_method(const char* func_name, char *argv, int len) {
-    int i;
-    
-    memset(marshallMsg, 0, sizeof(marshallMsg));
-    
-    /* append function name to marshallMsg */
-    strcpy(marshallMsg, func_name);
+static int start_call(int kind) {
+    if (call_depth++ > 0)	return kind;
+    pthread_once(&deadline_once, read_deadlines);
+    call_kind = kind;
+    call_missed = 0;
+    call_deadline = 0;
+    if (deadline_ms[kind] > 0) {
+        call_deadline = now_ns() + (uint64_t)deadline_ms[kind] * 1000000ull;
+        __atomic_fetch_add(&deadline_stats.calls[kind], 1, __ATOMIC_RELAXED);
+    }
+    return kind;
+}
 
-    strcat(marshallMsg, "|");
-	
-    char *traverse = marshallMsg;
-    while (*traverse != '\0')	traverse++;
+/*
+ * Stop the clock once the interposed call returns, so connecting or
+ * reconnecting outside a call never inherits a deadline already past
+ */
+static void end_call(int *kind) {
+    (void)kind;
+    if (--call_depth == 0)	call_deadline = 0;
+}
+
+/*
+ * Count the current call as past its deadline, once however many of its
+ * requests miss it
+ */
+static void count_miss(void) {
+    if (call_missed)	return;
+    call_missed = 1;
+    __atomic_fetch_add(&deadline_stats.misses[call_kind], 1, __ATOMIC_RELAXED);
+}
+
+/* Time the rest of the enclosing function as a call of the given kind */
+#define START_CALL(kind) \
+    int call_scope __attribute__((cleanup(end_call), unused)) = start_call(kind)
 
-    for (i = 0; i < len; i++) {
-        traverse[i] = argv[i];
+/*
+ * Copy the deadline counters
+ */
+void rpc_deadline_stats(struct rpc_deadline_stats *out) {
+    int i;
+    for (i = 0; i < 2; i++) {
+        out->calls[i] = __atomic_load_n(&deadline_stats.calls[i], __ATOMIC_RELAXED);
+        out->misses[i] = __atomic_load_n(&deadline_stats.misses[i], __ATOMIC_RELAXED);
     }
-    traverse[i] = '\0';
+    out->late_replies = __atomic_load_n(&deadline_stats.late_replies, __ATOMIC_RELAXED);
+}
+
+int64_t get_reply(char *frame, char **payload, size_t *payload_len, struct arg_reader *rest);
 
-    return marshallMsg;
+/*
+ * Client-side marshalling of system calls
+ * The message is laid out in marshallMsg as described in myframe.h:
+ * 1. Frame header carrying the opcode (started here)
+ * 2. Arguments, encoded by the caller with the encode_* functions of myrpc.h
+ * 3. Payload, such as a path name or the data to write, added with msg_put_bytes
+ * marshallMsg keeps its buffer across calls, so marshalling does not allocate
+ * once the buffer has grown to the largest message
+ * @param:
+ *    opcode: rpc opcode
+ * @return: ptr to the message writer
+ */
+struct msg_writer *marshalling_method(int opcode) {
+    msg_begin(&marshallMsg, opcode, 0, arg_codec);
+    return &marshallMsg;
 }
 
 /*
  * Wrapper of sending message.
- * I insert 4 byte of int to denote how many bytes behind to transfer
- * Keep sending until all bytes are sent
- * @return: number of bytes sent, or -1 if error occurred
+ * The message already starts with its 4 byte little-endian length
+ * The encoded part and a payload added by reference, such as the user's
+ * write buffer, go out in one sendmsg without being copied together
+ * A server that stops reading holds the send up until the deadline of the
+ * call at most, like the wait for its reply
+ * @return: number of bytes sent, or -1 if error occurred, ETIMEDOUT
+ *    once the deadline passed
  */
-int send_message(int len, char *msg, int sockfd) {
-    // send message to server
-    char *msgLen = (char *)malloc((4 + len) * sizeof(char));
-    memset(msgLen, 0, (4 + len));
-    memcpy(msgLen, &len, 4);
-    memcpy(msgLen + 4, msg, len);
-    int byte_send = 0;
-    
-    len += 4;
-    
-    while (byte_send < len) {
-        int sd = send(sockfd, msgLen + byte_send, len - byte_send, 0);
-        byte_send += sd;
-    }
-    free(msgLen);
-    
-    return byte_send;
+ssize_t send_message(struct msg_writer *msg, struct conn *conn) {
+    struct iovec iov[2];
+    int iovcnt = msg_iov(msg, iov);
+    return conn_send_iov_until(conn, iov, iovcnt, call_deadline);
+}
+
+/*
+ * Make connection_buf hold at least len bytes
+ * @return: 0 on success, -1 if it could not grow
+ */
+static int reserve_connection_buf(size_t len) {
+    if (len <= connection_cap)	return 0;
+    size_t cap = connection_cap ? connection_cap : CONNECTION_MIN_CAP;
+    while (cap < len)	cap *= 2;
+    char *buf = (char *)realloc(connection_buf, cap);
+    if (buf == NULL)	return -1;
+    connection_buf = buf;
+    connection_cap = cap;
+    return 0;
 }
 
 /*
  * Wrapper of receiving message.
- * Receive the first 4 byte of int to denote how many bytes behind to be received
- * Keep receiving until all bytes have been received
- * @return: number of bytes received, or -1 if error occurred
+ * The length prefix and the frame header are received first, then exactly
+ * the rest of the frame, each with a single MSG_WAITALL recv
+ * The arguments always go to connection_buf. The payload of a reply to
+ * want_id goes straight to dst when it is raw and fits there, such as the
+ * data of a read, otherwise it follows the arguments in connection_buf,
+ * NUL-terminated. reply_payload is set to where it went.
+ * @param:
+ *    conn: connection to the server
+ *    want_id: id of the request dst belongs to
+ *    dst: buffer of the caller for the payload, may be NULL
+ *    dst_cap: size of dst
+ * @return: number of bytes received, 0 if the server closed, or -1 if error occurred
  */
-int receive_message(int sockfd) {
-    int recv_byte = 0;
-    memset(connection_buf, 0, sizeof(connection_buf));
-    
-    int len;
-    int first_time = 1;
-    
-    while (1) {
-        rv = recv(sockfd, connection_buf + recv_byte, MAXWRITELEN, 0);
-        if (rv < 0) err(1, 0);
-        if (rv == 0)	return 0;
-        recv_byte += rv;
-        if (first_time == 1) {
-            first_time = 0;
-            memcpy(&len, connection_buf, 4);
-        }
-        if (len + 4 <= recv_byte)	break;
+int receive_message(struct conn *conn, uint32_t want_id, char *dst, size_t dst_cap) {
+    const size_t head = FRAME_LEN_SIZE + FRAME_HDR_SIZE;
+    struct frame_header hdr;
+
+    if (reserve_connection_buf(head + ARGS_MAX_LEN + 1) < 0)	return -1;
+    int rv = conn_recv_exact(conn, connection_buf, head);
+    if (rv <= 0)	return rv;
+    if (decode_frame_header(connection_buf, &hdr) < 0) {
+        errno = EPROTO;
+        return -1;
     }
-    connection_buf[recv_byte] = 0;
-    return recv_byte;
+
+    size_t payload_len = frame_payload_len(&hdr);
+    int direct = dst != NULL && hdr.req_id == want_id && payload_len <= dst_cap &&
+                 !(hdr.flags & FRAME_F_LZ);
+    size_t in_buf = hdr.args_len + (direct ? 0 : payload_len);
+    if (reserve_connection_buf(head + in_buf + 1) < 0)	return -1;
+
+    if (in_buf > 0 && conn_recv_exact(conn, connection_buf + head, in_buf) <= 0)	return -1;
+    connection_buf[head + in_buf] = 0;
+    reply_payload = connection_buf + head + hdr.args_len;
+    if (direct && payload_len > 0) {
+        if (conn_recv_exact(conn, dst, payload_len) <= 0)	return -1;
+        reply_payload = dst;
+    }
+    return head + hdr.frame_len - FRAME_HDR_SIZE;
 }
 
 int (*orig_close)(int fd); /* Original close system call function ptr */
 
 /*
- * Set up socket connection and send marshalling message to server
- * as well as receive marshalling message from the server
+ * Exchange capabilities with the server right after connecting
+ * The hello frame itself always uses the fixed-width codec, so a server
+ * which does not know OP_HELLO simply answers -ENOSYS
+ * Payload compression is only offered when the environment variable
+ * compress15440 is set to 1, as it only pays off on slow links
+ * A session is always asked for, see CAP_SESSION
  * @param:
- *    msg: message to send to server
- *    len: length of the message.
- *         This is necessary because there may be '\0' in the message, such as read and write
- * @return: the marshalling message returned by server
+ *    conn: connection to the server
+ *    session: session and key to resume, 0 for a new session; set to
+ *        those the server keeps, 0 if none, and whether it was resumed
+ * The reply is waited for until the deadline of the call
+ * @return:
+ *    the CAP_* bits supported by both sides, -1 with errno set if the
+ *    server did not answer
+ */
+int say_hello(struct conn *conn, struct hello_reply *session) {
+    /* marshallMsg already holds the caller's message, so build hello aside */
+    struct hello_req hello = {.caps = CAP_VARINT | CAP_SESSION,
+                              .session = session->session, .key = session->key};
+    char *compress = getenv("compress15440");
+    if (compress && atoi(compress) == 1)	hello.caps |= CAP_COMPRESS;
+    memset(session, 0, sizeof(*session));
+
+    char msg[FRAME_LEN_SIZE + FRAME_HDR_SIZE + hello_req_fixed_len];
+    put_le32(msg, FRAME_HDR_SIZE + hello_req_fixed_len);
+    encode_frame_header(msg + FRAME_LEN_SIZE, OP_HELLO, 0, hello_req_fixed_len, 0);
+    pack_hello_req(msg + FRAME_LEN_SIZE + FRAME_HDR_SIZE, CODEC_FIXED, &hello);
+
+    struct iovec iov = {.iov_base = msg, .iov_len = sizeof(msg)};
+    if (conn_send_iov_until(conn, &iov, 1, call_deadline) < 0)	return -1;
+    if (call_deadline) {
+        uint64_t now = now_ns();
+        int ready = now < call_deadline ? conn_wait_readable(conn, (int)((call_deadline - now + 999999) / 1000000)) : 0;
+        if (ready <= 0) {
+            if (ready == 0)	errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    int rcv = receive_message(conn, 0, NULL, 0);
+    if (rcv <= 0) {
+        if (rcv == 0)	errno = ECONNRESET;
+        return -1;
+    }
+
+    int64_t caps = get_reply(connection_buf, NULL, NULL, NULL);
+    if (caps < 0)	return 0;
+    struct frame_header hdr;
+    struct arg_reader args;
+    decode_frame_header(connection_buf, &hdr);
+    arg_reader_init(&args, connection_buf, &hdr);
+    if (!(caps & CAP_SESSION) || decode_hello_reply(&args, session) < 0) {
+        memset(session, 0, sizeof(*session)); // a server without sessions
+    }
+    return (int)(caps & hello.caps);
+}
+
+/*
+ * Close a connection nothing refers to any more and free its slot
+ * Called with slots_lock held
+ */
+static void release_conn(struct client_conn *cc) {
+    if (cc->threads > 0 || cc->open_fds > 0)	return;
+    conn_slots[cc->slot] = NULL;
+    conn_close(cc->conn);
+    while (cc->parked_head) {
+        struct parked_reply *p = cc->parked_head;
+        cc->parked_head = p->next;
+        free(p->frame);
+        free(p);
+    }
+    while (cc->cancelled) {
+        struct cancelled_req *c = cc->cancelled;
+        cc->cancelled = c->next;
+        free(c);
+    }
+    pthread_mutex_destroy(&cc->send_lock);
+    pthread_mutex_destroy(&cc->lock);
+    pthread_cond_destroy(&cc->replies);
+    free(cc);
+}
+
+/*
+ * Run when a thread which made calls exits: drop its buffers and its hold
+ * on its home connection, which stays open while fds opened over it do
  */
-char *connect_to_server(char* msg, int len) {
+static void thread_exit(void *arg) {
+    struct client_conn *cc = (struct client_conn *)arg;
+
+    pthread_mutex_lock(&slots_lock);
+    cc->threads--;
+    release_conn(cc);
+    pthread_mutex_unlock(&slots_lock);
+
+    msg_free(&marshallMsg);
+    free(connection_buf);
+    connection_buf = NULL;
+    connection_cap = 0;
+}
 
-    if (firstConnect == 1) {
-        firstConnect = 0;
-		
+static void make_home_key(void) {
+    pthread_key_create(&home_key, thread_exit);
+}
+
+/*
+ * Open a new connection to the server in a free slot
+ * Called with slots_lock held
+ * @return: the connection, NULL with errno set if none could be opened
+ */
+static struct client_conn *open_conn(void) {
+    int slot;
+    for (slot = 0; slot < CONN_SLOTS && conn_slots[slot] != NULL; slot++);
+    if (slot == CONN_SLOTS) {
+        errno = EMFILE;
+        return NULL;
+    }
+
+    if (serverip == NULL) {
         // Get environment variable indicating the ip address of the server
         serverip = getenv("server15440");
         if (serverip) printf("Got environment variable server15440: %s\n", serverip);
@@ -164,40 +421,980 @@ char *connect_to_server(char* msg, int len) {
             serverport = "15440";
         }
         port = (unsigned short)atoi(serverport);
+    }
 
-        // Create socket
-        sockfd = socket(AF_INET, SOCK_STREAM, 0);       // TCP/IP socket
-        if (sockfd < 0) {
-            err(1, 0);                        // in case of error
-            firstConnect = 1;
-            exit(255);
-        }
+    struct client_conn *cc = (struct client_conn *)calloc(1, sizeof(struct client_conn));
+    if (cc == NULL)	return NULL;
+
+    // actually connect to the server, over tcp unless transport15440 says otherwise
+    cc->conn = conn_connect(transport_from_env(), serverip, port);
+    if (cc->conn == NULL) {
+        free(cc);
+        return NULL;
+    }
+    cc->slot = slot;
+    pthread_mutex_init(&cc->send_lock, NULL);
+    pthread_mutex_init(&cc->lock, NULL);
+    // waits for replies time out on the monotonic clock, see call_deadline
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cc->replies, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // agree on the argument codec and compression before the first call
+    struct hello_reply session = {.session = 0};
+    int caps = say_hello(cc->conn, &session);
+    if (caps < 0) {
+        int saved = errno;
+        conn_close(cc->conn);
+        pthread_mutex_destroy(&cc->send_lock);
+        pthread_mutex_destroy(&cc->lock);
+        pthread_cond_destroy(&cc->replies);
+        free(cc);
+        errno = saved;
+        return NULL;
+    }
+    peer_caps = caps;
+    arg_codec = (peer_caps & CAP_VARINT) ? CODEC_VARINT : CODEC_FIXED;
+    cc->session = session.session;
+    cc->session_key = session.key;
+    conn_slots[slot] = cc;
+    return cc;
+}
+
+/*
+ * Resume the session of a connection whose server connection dropped,
+ * over a new one, so that the fds opened over it stay valid
+ * Requests sent before it dropped fail with ECONNRESET, whether or not
+ * the server ran them
+ * @return: 0 if the connection can be used again, -1 with errno set if
+ *    not, such as once the session expired
+ */
+static int resume_conn(struct client_conn *cc) {
+    pthread_mutex_lock(&cc->send_lock);
+    if (!__atomic_load_n(&cc->dead, __ATOMIC_ACQUIRE)) {
+        // another thread resumed it meanwhile
+        pthread_mutex_unlock(&cc->send_lock);
+        return 0;
+    }
+    if (cc->session == 0) {
+        pthread_mutex_unlock(&cc->send_lock);
+        errno = cc->error;
+        return -1;
+    }
+
+    struct hello_reply session = {.session = cc->session, .key = cc->session_key};
+    struct conn *conn = conn_connect(transport_from_env(), serverip, port);
+    if (conn != NULL && say_hello(conn, &session) < 0) {
+        conn_close(conn);
+        conn = NULL;
+    }
+    if (conn != NULL && !session.resumed) {
+        // the session is gone with the fds opened over it, do not try again
+        conn_close(conn);
+        conn = NULL;
+        cc->session = 0;
+        errno = cc->error;
+    }
+    if (conn == NULL) {
+        int saved = errno;
+        pthread_mutex_unlock(&cc->send_lock);
+        errno = saved;
+        return -1;
+    }
+    fprintf(stderr, "mylib: resumed session %llu\n", (unsigned long long)cc->session);
+
+    pthread_mutex_lock(&cc->lock);
+    // a receiver still reading the old connection is about to fail
+    while (cc->receiving)	pthread_cond_wait(&cc->replies, &cc->lock);
+    struct conn *old = cc->conn;
+    cc->conn = conn;
+    while (cc->parked_head) {
+        struct parked_reply *p = cc->parked_head;
+        cc->parked_head = p->next;
+        free(p->frame);
+        free(p);
+    }
+    cc->parked_tail = NULL;
+    while (cc->cancelled) {
+        struct cancelled_req *c = cc->cancelled;
+        cc->cancelled = c->next;
+        free(c);
+    }
+    if (++cc->last_req_id == 0)	cc->last_req_id = 1;
+    cc->first_id = cc->last_req_id;
+    cc->error = 0;
+    __atomic_store_n(&cc->dead, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&cc->replies);
+    pthread_mutex_unlock(&cc->lock);
+    pthread_mutex_unlock(&cc->send_lock);
+    conn_close(old);
+    return 0;
+}
 
-        // setup address structure to point to server
-        memset(&srv, 0, sizeof(srv));                   // clear it first
-        srv.sin_family = AF_INET;                       // IP family
-        srv.sin_addr.s_addr = inet_addr(serverip);      // IP address of server
-        srv.sin_port = htons(port);                     // server port
-        // actually connect to the server
-        rv = connect(sockfd, (struct sockaddr*)&srv, sizeof(struct sockaddr));
-        if (rv < 0) {
-            err(1, 0);
-            firstConnect = 1;
-            exit(255);
+/*
+ * Connection of the calling thread, opened on its first call
+ * Once every slot is taken, new threads share the open connections
+ * @return: the connection, NULL with errno set if none could be opened
+ */
+struct client_conn *home_connection(void) {
+    if (home_conn != NULL && !__atomic_load_n(&home_conn->dead, __ATOMIC_ACQUIRE))	return home_conn;
+    if (home_conn != NULL && resume_conn(home_conn) == 0)	return home_conn;
+
+    pthread_once(&home_key_once, make_home_key);
+    pthread_mutex_lock(&slots_lock);
+    if (home_conn != NULL) {
+        // the server of the old one went away
+        home_conn->threads--;
+        release_conn(home_conn);
+        home_conn = NULL;
+    }
+    struct client_conn *cc = open_conn();
+    if (cc == NULL && errno == EMFILE) {
+        static unsigned int next_shared;
+        int i;
+        for (i = 0; i < CONN_SLOTS && cc == NULL; i++) {
+            struct client_conn *c = conn_slots[next_shared++ % CONN_SLOTS];
+            if (c != NULL && !__atomic_load_n(&c->dead, __ATOMIC_ACQUIRE))	cc = c;
         }
     }
+    if (cc != NULL) {
+        cc->threads++;
+        home_conn = cc;
+        pthread_setspecific(home_key, cc);
+    }
+    pthread_mutex_unlock(&slots_lock);
+    return cc;
+}
+
+/*
+ * fd handed to the application for an fd of the server behind a connection
+ * @return: the lib fd, -1 if the server fd does not fit in CONN_FD_RANGE
+ */
+static int lib_fd(struct client_conn *cc, int64_t server_fd) {
+    if (server_fd >= CONN_FD_RANGE)	return -1;
+    return FD_OFFSET + cc->slot * CONN_FD_RANGE + (int)server_fd;
+}
+
+/*
+ * Connection an fd was opened over
+ * @param:
+ *    fd: lib fd, at least FD_OFFSET
+ *    wire_fd: set to the fd to send to its server, FD_OFFSET + server fd
+ * @return: the connection, NULL with errno EBADF if there is none
+ */
+struct client_conn *fd_connection(int fd, int *wire_fd) {
+    int slot = (fd - FD_OFFSET) / CONN_FD_RANGE;
+    struct client_conn *cc = NULL;
+
+    if (slot < CONN_SLOTS) {
+        pthread_mutex_lock(&slots_lock);
+        cc = conn_slots[slot];
+        pthread_mutex_unlock(&slots_lock);
+    }
+    if (cc == NULL) {
+        errno = EBADF;
+        return NULL;
+    }
+    *wire_fd = FD_OFFSET + (fd - FD_OFFSET) % CONN_FD_RANGE;
+    // if it cannot be resumed, the call fails with the error it died of
+    if (__atomic_load_n(&cc->dead, __ATOMIC_ACQUIRE))	resume_conn(cc);
+    return cc;
+}
+
+/*
+ * Count an fd opened over, or closed from, a connection
+ * A connection no thread calls home is closed with its last fd
+ */
+static void count_fd(struct client_conn *cc, int delta) {
+    pthread_mutex_lock(&slots_lock);
+    cc->open_fds += delta;
+    release_conn(cc);
+    pthread_mutex_unlock(&slots_lock);
+}
+
+/*
+ * Send a message to the server while the caller holds cc->send_lock
+ * The reply is not waited for, so several requests can be in flight at once
+ * @return: id of the request to wait for its reply with, 0 with errno set
+ *    if the message could not be built or sent
+ */
+uint32_t send_locked(struct client_conn *cc, struct msg_writer *msg) {
+    if (msg_finish(msg) == 0) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    pthread_mutex_lock(&cc->lock);
+    if (++cc->last_req_id == 0)	cc->last_req_id = 1;
+    uint32_t req_id = cc->last_req_id;
+    // ids wrap, requests lost to a resume are only told apart for a while
+    if (cc->first_id != 0 && req_id - cc->first_id > (1u << 30))	cc->first_id = 0;
+    pthread_mutex_unlock(&cc->lock);
 
     // send message to server
-    send_message(len, msg, sockfd);
-    
-    int rcv = receive_message(sockfd);
-    if (rcv == 0) {
-        orig_close(sockfd);
-    } else if (rcv < 0) {
-        err(1, 0);
+    msg_set_req_id(msg, req_id);
+    if (send_message(msg, cc->conn) < 0) {
+        // the stream is cut, the frame at most went out in part
+        int error = errno;
+        if (error == ETIMEDOUT)	count_miss();
+        pthread_mutex_lock(&cc->lock);
+        if (!cc->dead)	cc->error = error;
+        __atomic_store_n(&cc->dead, 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&cc->replies);
+        pthread_mutex_unlock(&cc->lock);
+        errno = error;
+        return 0;
+    }
+    return req_id;
+}
+
+/*
+ * Send marshalling message to server without waiting for the reply
+ * @param:
+ *    cc: connection to send over
+ *    msg: message to send to server, finished here
+ * @return: id of the request to wait for its reply with, 0 with errno set
+ *    if the message could not be built or sent
+ */
+uint32_t send_to_server(struct client_conn *cc, struct msg_writer *msg) {
+    if (cc == NULL)	return 0;
+    pthread_mutex_lock(&cc->send_lock);
+    uint32_t req_id = send_locked(cc, msg);
+    pthread_mutex_unlock(&cc->send_lock);
+    // a request the server never got whole is sent again once resumed,
+    // unless the call ran out of time sending it
+    if (req_id == 0 && errno != ETIMEDOUT && __atomic_load_n(&cc->dead, __ATOMIC_ACQUIRE) &&
+        resume_conn(cc) == 0) {
+        pthread_mutex_lock(&cc->send_lock);
+        req_id = send_locked(cc, msg);
+        pthread_mutex_unlock(&cc->send_lock);
+    }
+    return req_id;
+}
+
+/*
+ * Keep a copy of a reply received in connection_buf for its own waiter
+ * Called with cc->lock held
+ * @return: 0 on success, -1 if it could not be copied
+ */
+static int park_reply(struct client_conn *cc, size_t len) {
+    struct parked_reply *p = (struct parked_reply *)malloc(sizeof(*p));
+    char *frame = (char *)malloc(len + 1);
+    if (p == NULL || frame == NULL) {
+        free(p);
+        free(frame);
+        return -1;
+    }
+    memcpy(frame, connection_buf, len + 1);
+    p->req_id = frame_req_id(frame);
+    p->frame = frame;
+    p->next = NULL;
+    if (cc->parked_tail)	cc->parked_tail->next = p;
+    else	cc->parked_head = p;
+    cc->parked_tail = p;
+    return 0;
+}
+
+/*
+ * Move the oldest parked reply to req_id into connection_buf
+ * Called with cc->lock held
+ * @return: 1 if there was one, 0 otherwise, -1 if it could not be moved
+ */
+static int unpark_reply(struct client_conn *cc, uint32_t req_id) {
+    struct parked_reply *p, *prev = NULL;
+    for (p = cc->parked_head; p != NULL; prev = p, p = p->next) {
+        if (p->req_id == req_id)	break;
+    }
+    if (p == NULL)	return 0;
+
+    struct frame_header hdr;
+    decode_frame_header(p->frame, &hdr);
+    size_t len = FRAME_LEN_SIZE + hdr.frame_len;
+    if (reserve_connection_buf(len + 1) < 0)	return -1;
+    if (prev)	prev->next = p->next;
+    else	cc->parked_head = p->next;
+    if (cc->parked_tail == p)	cc->parked_tail = prev;
+    memcpy(connection_buf, p->frame, len + 1);
+    reply_payload = frame_payload(connection_buf, &hdr);
+    free(p->frame);
+    free(p);
+    return 1;
+}
+
+/*
+ * Send a message whose reply is dropped on arrival
+ * @return: id of the request, 0 with errno set on error
+ */
+static uint32_t send_forgotten(struct client_conn *cc, struct msg_writer *msg) {
+    struct cancelled_req *c = (struct cancelled_req *)malloc(sizeof(struct cancelled_req));
+    if (c == NULL || msg_finish(msg) == 0) {
+        free(c);
+        errno = ENOMEM;
+        return 0;
+    }
+
+    // the id is marked before the message goes, so the reply cannot come first
+    pthread_mutex_lock(&cc->send_lock);
+    pthread_mutex_lock(&cc->lock);
+    if (++cc->last_req_id == 0)	cc->last_req_id = 1;
+    uint32_t req_id = cc->last_req_id;
+    c->req_id = req_id;
+    c->next = cc->cancelled;
+    cc->cancelled = c;
+    pthread_mutex_unlock(&cc->lock);
+    msg_set_req_id(msg, req_id);
+    if (send_message(msg, cc->conn) < 0)	req_id = 0;
+    pthread_mutex_unlock(&cc->send_lock);
+    return req_id;
+}
+
+/*
+ * Drop the frame in connection_buf if it answers a request given up on
+ * Called with cc->lock held
+ * @param:
+ *    orphan_fd: set to the wire fd a late open returned, which is to be
+ *        closed, left alone otherwise
+ * @return: 1 if it was dropped, 0 if it is for a waiting request
+ */
+static int drop_late_reply(struct client_conn *cc, int *orphan_fd) {
+    uint32_t req_id = frame_req_id(connection_buf);
+    struct cancelled_req *c, **link;
+
+    for (link = &cc->cancelled; (c = *link) != NULL; link = &c->next) {
+        if (c->req_id == req_id)	break;
+    }
+    if (c == NULL)	return 0;
+    __atomic_fetch_add(&deadline_stats.late_replies, 1, __ATOMIC_RELAXED);
+    if (frame_flags(connection_buf) & FRAME_F_MORE)	return 1;
+
+    *link = c->next;
+    free(c);
+    if (frame_opcode(connection_buf) == OP_OPEN) {
+        int64_t ret_val = get_reply(connection_buf, NULL, NULL, NULL);
+        if (ret_val >= 0)	*orphan_fd = (int)ret_val + FD_OFFSET;
+    }
+    return 1;
+}
+
+/*
+ * Give up on a request past the deadline of its call
+ * What was parked for it is freed, what is still to come is dropped on
+ * arrival, and the server is asked to stop working on it
+ * Called with cc->lock held, which is released
+ * @return: NULL with errno ETIMEDOUT
+ */
+static char *miss_deadline(struct client_conn *cc, uint32_t req_id) {
+    struct parked_reply *p, **link = &cc->parked_head;
+    int answered = 0;
+
+    cc->parked_tail = NULL;
+    while ((p = *link) != NULL) {
+        if (p->req_id == req_id) {
+            answered |= !(frame_flags(p->frame) & FRAME_F_MORE);
+            *link = p->next;
+            free(p->frame);
+            free(p);
+        } else {
+            cc->parked_tail = p;
+            link = &p->next;
+        }
     }
 
-    return connection_buf + 4;
+    struct cancelled_req *c = NULL;
+    if (!answered && (c = (struct cancelled_req *)malloc(sizeof(struct cancelled_req))) != NULL) {
+        c->req_id = req_id;
+        c->next = cc->cancelled;
+        cc->cancelled = c;
+    }
+    pthread_mutex_unlock(&cc->lock);
+    count_miss();
+
+    if (!answered) {
+        struct cancel_req req = {.target = req_id};
+        struct msg_writer *msg = marshalling_method(OP_CANCEL);
+        encode_cancel_req(msg, &req);
+        send_to_server(cc, msg);
+    }
+    errno = ETIMEDOUT;
+    return NULL;
+}
+
+/*
+ * Wait for the next reply to a request, until the deadline of the call
+ * Whichever waiting thread finds nobody receiving reads frames until its
+ * own reply comes, parking those of the others and waking them
+ * @param:
+ *    cc: connection the request went over
+ *    req_id: id returned by send_to_server
+ *    dst: buffer of the caller the reply payload may be received into, may be NULL
+ *    dst_cap: size of dst
+ * @return: the reply frame returned by server, starting at its length prefix,
+ *    NULL with errno set if req_id is 0, the deadline passed (ETIMEDOUT)
+ *    or the connection failed
+ */
+char *receive_from_server(struct client_conn *cc, uint32_t req_id, char *dst, size_t dst_cap) {
+    int error = 0;
+    if (req_id == 0)	return NULL;
+
+    pthread_mutex_lock(&cc->lock);
+    while (1) {
+        int unparked = unpark_reply(cc, req_id);
+        if (unparked > 0)	break;
+        int lost = cc->first_id != 0 && (int32_t)(req_id - cc->first_id) < 0;
+        if (unparked < 0 || cc->dead || lost) {
+            error = unparked < 0 ? ENOMEM : cc->dead ? cc->error : ECONNRESET;
+            pthread_mutex_unlock(&cc->lock);
+            errno = error;
+            return NULL;
+        }
+        uint64_t now = call_deadline ? now_ns() : 0;
+        if (call_deadline && now >= call_deadline)	return miss_deadline(cc, req_id);
+        if (cc->receiving) {
+            if (call_deadline) {
+                struct timespec ts = {.tv_sec = call_deadline / 1000000000ull,
+                                      .tv_nsec = call_deadline % 1000000000ull};
+                pthread_cond_timedwait(&cc->replies, &cc->lock, &ts);
+            } else {
+                pthread_cond_wait(&cc->replies, &cc->lock);
+            }
+            continue;
+        }
+
+        cc->receiving = 1;
+        pthread_mutex_unlock(&cc->lock);
+        int ready = 1;
+        if (call_deadline)	ready = conn_wait_readable(cc->conn, (int)((call_deadline - now + 999999) / 1000000));
+        int rcv = ready > 0 ? receive_message(cc->conn, req_id, dst, dst_cap) : ready;
+        error = errno;
+        pthread_mutex_lock(&cc->lock);
+        cc->receiving = 0;
+        pthread_cond_broadcast(&cc->replies);
+
+        if (ready == 0)	continue; // the deadline is checked again
+        if (rcv <= 0) {
+            // the server is gone, or the stream cannot be followed any more;
+            // the next call of this thread connects again
+            cc->error = rcv == 0 ? ECONNRESET : (error ? error : EIO);
+            __atomic_store_n(&cc->dead, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (frame_req_id(connection_buf) == req_id)	break;
+
+        int orphan_fd = -1;
+        if (drop_late_reply(cc, &orphan_fd)) {
+            if (orphan_fd < 0)	continue;
+            // an open that completed after all, its fd must not leak
+            pthread_mutex_unlock(&cc->lock);
+            struct close_req close_req = {.fd = orphan_fd};
+            struct msg_writer *msg = marshalling_method(OP_CLOSE);
+            encode_close_req(msg, &close_req);
+            send_forgotten(cc, msg);
+            pthread_mutex_lock(&cc->lock);
+        } else if (park_reply(cc, rcv) < 0) {
+            // a reply lost for good leaves its waiter nothing to wait for
+            cc->error = ENOMEM;
+            __atomic_store_n(&cc->dead, 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&cc->lock);
+    return connection_buf;
+}
+
+/*
+ * Send marshalling message to server as well as receive its reply
+ * @param:
+ *    cc: connection to call over, NULL if none could be opened
+ *    msg: message to send to server, finished here
+ *    dst: buffer of the caller the reply payload may be received into, may be NULL
+ *    dst_cap: size of dst
+ * @return: the reply frame returned by server, starting at its length prefix,
+ *    or NULL with errno set if there was none
+ */
+char *connect_to_server_into(struct client_conn *cc, struct msg_writer *msg, char *dst, size_t dst_cap) {
+    if (cc == NULL)	return NULL;
+    return receive_from_server(cc, send_to_server(cc, msg), dst, dst_cap);
+}
+
+/*
+ * Call the server for a reply whose payload lands in connection_buf
+ */
+char *connect_to_server(struct client_conn *cc, struct msg_writer *msg) {
+    return connect_to_server_into(cc, msg, NULL, 0);
+}
+
+/*
+ * Wait for the reply, or stream of replies, to a read or pread
+ * @param:
+ *    cc: connection the request went over
+ *    req_id: id returned by send_to_server
+ *    buf: where the contents go
+ *    count: bytes asked for
+ * @return: bytes read, -errno if nothing could be read or if the stream
+ *    was cut short, as the server has read past what arrived by then
+ */
+static int64_t receive_read(struct client_conn *cc, uint32_t req_id, char *buf, size_t count) {
+    /*
+     * the reply carries
+     * EITHER
+     * number of bytes read, with the contents read as payload
+     * OR
+     * negative errno
+     * A read larger than MAXWRITELEN is answered with a stream of such
+     * replies, all but the last flagged FRAME_F_MORE, each landing in buf
+     * right after the previous one
+     */
+    char *content;
+    size_t content_len;
+    size_t done = 0;
+    int64_t error = 0;
+    int lost = 0; /* contents the server read did not make it into buf */
+    char *frame = receive_from_server(cc, req_id, buf, count);
+    while (1) {
+        int64_t byte_read = get_reply(frame, &content, &content_len, NULL);
+        char *dst = buf + done;
+
+        if (frame == NULL) {
+            /* the deadline passed or the connection failed */
+            lost = 1;
+        } else if (error < 0) {
+            /* the rest of the stream is drained, it cannot follow on in buf */
+            byte_read = 0;
+        } else if (byte_read >= 0 && (frame_flags(frame) & FRAME_F_LZ)) {
+            /* compressed contents expand straight into the caller's buffer */
+            byte_read = decompress_payload(content, content_len, dst, count - done);
+            if (byte_read < 0) {
+                byte_read = -EPROTO;
+                lost = 1;
+            }
+        } else if (byte_read >= 0) {
+            if ((size_t)byte_read > content_len)	byte_read = content_len;
+            if ((size_t)byte_read > count - done)	byte_read = count - done;
+            /* the contents are normally received in buf already */
+            if (content != dst)	memcpy(dst, content, byte_read);
+        }
+        if (byte_read < 0 && error == 0)	error = byte_read;
+        else if (byte_read > 0)	done += byte_read;
+
+        if (frame == NULL || !(frame_flags(frame) & FRAME_F_MORE))	break;
+        frame = receive_from_server(cc, req_id, error < 0 ? NULL : buf + done, error < 0 ? 0 : count - done);
+    }
+
+    /*
+     * like read(2), data already transferred wins over a later error of
+     * the server, which stopped reading there. Contents lost on the way
+     * fail the whole read: the server offset has moved past them, and a
+     * short read would make the next read skip them.
+     */
+    if (lost || (done == 0 && error < 0))	return error;
+    return done;
+}
+
+/*
+ * Striped reads
+ * With stripes15440=K above 1, a file opened read-only is read with
+ * positional reads of stripesize15440 bytes (STRIPE_DEFAULT_SIZE if unset),
+ * dealt round-robin over the connection of its fd and K-1 stripe
+ * connections, each served by a server process of its own. The reads of
+ * a window are all sent before any reply is waited for and the replies
+ * land in order in the caller's buffer. A small read only fetches what
+ * it asked for, unless it follows the previous one: then it fetches ahead
+ * into a readahead window the next reads are served from, twice as far
+ * as last time up to K stripes.
+ * The stripe connections open the file again by path, so they are checked
+ * to have opened the same file as the fd (same st_dev and st_ino); if the
+ * path was renamed or unlinked in between, the fd is read unstriped, with
+ * positional reads over its own connection.
+ * The offset of such a file is kept by mylib, the one of the server is
+ * only moved by lseek.
+ */
+#define STRIPE_MAX_CONNS 16 /* Largest K */
+#define STRIPE_DEFAULT_SIZE (256 << 10) /* Default bytes of a stripe */
+#define STRIPE_MIN_SIZE 4096 /* Smallest stripe */
+#define STRIPE_DEPTH 2 /* Stripes in flight on each connection */
+
+/* A file read in stripes */
+struct stripe_file {
+    int fd; /* lib fd */
+    char *path; /* path it was opened with, opened again over the stripe connections */
+    pthread_mutex_t lock; /* serializes the reads and seeks of the fd */
+    off_t pos; /* file offset */
+    off_t next_seq; /* offset a sequential read starts at, -1 before the first read */
+    size_t ra_next; /* bytes the last fetch of a small read asked for */
+    int ident; /* dev and ino of the file of the fd are known */
+    dev_t dev;
+    ino_t ino;
+    int plain; /* the stripe connections opened another file, not striped */
+    struct client_conn *scc[STRIPE_MAX_CONNS]; /* stripe connection it is open over, [0] unused */
+    int sfd[STRIPE_MAX_CONNS]; /* wire fd over scc */
+    char *ra; /* readahead window, NULL until needed */
+    off_t ra_off; /* file offset of ra */
+    size_t ra_len; /* valid bytes in ra */
+    struct stripe_file *next;
+};
+
+int stripe_conns = 1; /* K, striping is off with 1 */
+size_t stripe_size = STRIPE_DEFAULT_SIZE; /* bytes of a stripe */
+pthread_once_t stripe_once = PTHREAD_ONCE_INIT;
+struct client_conn *stripe_conn[STRIPE_MAX_CONNS]; /* stripe connections, [0] unused */
+struct stripe_file *stripe_files; /* open striped files */
+pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER; /* guards stripe_conn and stripe_files */
+
+static void stripe_config(void) {
+    char *k = getenv("stripes15440");
+    char *size = getenv("stripesize15440");
+
+    if (k) {
+        stripe_conns = atoi(k);
+        if (stripe_conns < 1)	stripe_conns = 1;
+        if (stripe_conns > STRIPE_MAX_CONNS)	stripe_conns = STRIPE_MAX_CONNS;
+    }
+    if (size) {
+        stripe_size = (size_t)atol(size);
+        if (stripe_size < STRIPE_MIN_SIZE)	stripe_size = STRIPE_MIN_SIZE;
+        if (stripe_size > MAXWRITELEN)	stripe_size = MAXWRITELEN;
+    }
+}
+
+/*
+ * Start striping the reads of a newly opened fd, if striping is on and
+ * the file was opened read-only
+ * Without memory the fd is simply not striped
+ */
+static void stripe_track(int fd, const char *path, int flags) {
+    pthread_once(&stripe_once, stripe_config);
+    if (stripe_conns <= 1 || (flags & O_ACCMODE) != O_RDONLY)	return;
+
+    struct stripe_file *sf = (struct stripe_file *)calloc(1, sizeof(struct stripe_file));
+    if (sf == NULL)	return;
+    if ((sf->path = strdup(path)) == NULL) {
+        free(sf);
+        return;
+    }
+    sf->fd = fd;
+    sf->next_seq = -1;
+    pthread_mutex_init(&sf->lock, NULL);
+    pthread_mutex_lock(&stripe_lock);
+    sf->next = stripe_files;
+    stripe_files = sf;
+    pthread_mutex_unlock(&stripe_lock);
+}
+
+/*
+ * @param:
+ *    unlink: also take it off the list, when the fd is closed
+ * @return: the striped file of an fd, NULL if its reads are not striped
+ */
+static struct stripe_file *stripe_find(int fd, int unlink) {
+    struct stripe_file *sf, **link;
+
+    if (stripe_conns <= 1)	return NULL;
+    pthread_mutex_lock(&stripe_lock);
+    for (link = &stripe_files; (sf = *link) != NULL; link = &sf->next) {
+        if (sf->fd == fd)	break;
+    }
+    if (sf != NULL && unlink)	*link = sf->next;
+    pthread_mutex_unlock(&stripe_lock);
+    return sf;
+}
+
+/*
+ * Stripe connection k, opened or replaced if its server went away
+ * Stripe connections are held like the home connection of a thread that
+ * never exits
+ * @return: the connection, NULL with errno set if none could be opened
+ */
+static struct client_conn *stripe_connection(int k) {
+    pthread_mutex_lock(&stripe_lock);
+    struct client_conn *cc = stripe_conn[k];
+    if (cc != NULL && __atomic_load_n(&cc->dead, __ATOMIC_ACQUIRE))	resume_conn(cc);
+    if (cc == NULL || __atomic_load_n(&cc->dead, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&slots_lock);
+        if (cc != NULL) {
+            cc->threads--;
+            release_conn(cc);
+        }
+        if ((cc = open_conn()) != NULL)	cc->threads++;
+        stripe_conn[k] = cc;
+        pthread_mutex_unlock(&slots_lock);
+    }
+    pthread_mutex_unlock(&stripe_lock);
+    return cc;
+}
+
+/*
+ * Send a close of an fd over a connection
+ * @return: id of the request, 0 with errno set on error
+ */
+static uint32_t send_close(struct client_conn *cc, int wire_fd) {
+    struct close_req req = {.fd = wire_fd};
+    struct msg_writer *msg = marshalling_method(OP_CLOSE);
+    encode_close_req(msg, &req);
+    return send_to_server(cc, msg);
+}
+
+/*
+ * Send an fstat of an fd over a connection, asking for its dev and ino
+ * @return: id of the request, 0 with errno set on error
+ */
+static uint32_t send_ident(struct client_conn *cc, int wire_fd) {
+    struct fstat_req req = {.fd = wire_fd, .mask = STAT_F_DEV | STAT_F_INO};
+    struct msg_writer *msg = marshalling_method(OP_FSTAT);
+    encode_fstat_req(msg, &req);
+    return send_to_server(cc, msg);
+}
+
+/*
+ * Wait for the reply to send_ident
+ * @param:
+ *    st: its st_dev and st_ino are filled in
+ * @return: 0 on success, -1 if the fd could not be stated
+ */
+static int receive_ident(struct client_conn *cc, uint32_t req_id, struct stat *st) {
+    char *content;
+    size_t content_len;
+    struct arg_reader rest;
+    int64_t ret_val = get_reply(receive_from_server(cc, req_id, NULL, 0), &content, &content_len, &rest);
+
+    if (ret_val < 0)	return -1;
+    uint32_t got = read_arg_u32(&rest);
+    if (rest.error || (got & (STAT_F_DEV | STAT_F_INO)) != (STAT_F_DEV | STAT_F_INO))	return -1;
+    return unpack_stat_fields(content, content_len, rest.codec, got, st);
+}
+
+/*
+ * Close the file over every stripe connection it is open over
+ */
+static void stripe_close(struct stripe_file *sf) {
+    uint32_t ids[STRIPE_MAX_CONNS] = {0};
+    int k;
+
+    for (k = 1; k < stripe_conns; k++) {
+        if (sf->scc[k] != NULL)	ids[k] = send_close(sf->scc[k], sf->sfd[k]);
+    }
+    for (k = 1; k < stripe_conns; k++) {
+        if (sf->scc[k] == NULL)	continue;
+        if (ids[k] != 0)	get_reply(receive_from_server(sf->scc[k], ids[k], NULL, 0), NULL, NULL, NULL);
+        count_fd(sf->scc[k], -1);
+        sf->scc[k] = NULL;
+    }
+}
+
+/*
+ * Open the file over every stripe connection it is not open over yet,
+ * all opens in flight at once, then check that they opened the file of
+ * the fd; if any did not or could not, close them all and read the fd
+ * unstriped
+ * Called with sf->lock held
+ * @param:
+ *    cc, wire_fd: connection and wire fd of the lib fd
+ * @return: 0 on success, -1 with errno set on error
+ */
+static int stripe_open(struct stripe_file *sf, struct client_conn *cc, int wire_fd) {
+    uint32_t ids[STRIPE_MAX_CONNS] = {0};
+    uint32_t idents[STRIPE_MAX_CONNS] = {0};
+    struct open_req req = {.flags = O_RDONLY};
+    struct stat st;
+    int k, error = 0, other = 0;
+
+    if (sf->plain)	return 0;
+    if (!sf->ident && (idents[0] = send_ident(cc, wire_fd)) == 0)	return -1;
+    for (k = 1; k < stripe_conns; k++) {
+        struct client_conn *cc = stripe_connection(k);
+        if (cc == NULL) {
+            error = errno;
+            continue;
+        }
+        if (sf->scc[k] == cc)	continue;
+        if (sf->scc[k] != NULL) {
+            // opened over a connection whose server went away
+            count_fd(sf->scc[k], -1);
+            sf->scc[k] = NULL;
+        }
+        struct msg_writer *msg = marshalling_method(OP_OPEN);
+        encode_open_req(msg, &req);
+        msg_put_bytes(msg, sf->path, strlen(sf->path));
+        if ((ids[k] = send_to_server(cc, msg)) == 0) {
+            error = errno;
+            continue;
+        }
+        sf->scc[k] = cc;
+        count_fd(cc, 1);
+    }
+
+    for (k = 1; k < stripe_conns; k++) {
+        if (ids[k] == 0)	continue;
+        int64_t ret_val = get_reply(receive_from_server(sf->scc[k], ids[k], NULL, 0), NULL, NULL, NULL);
+        if (ret_val < 0) {
+            // the path may be gone or changed since the fd was opened
+            count_fd(sf->scc[k], -1);
+            sf->scc[k] = NULL;
+            other = 1;
+        } else {
+            sf->sfd[k] = (int)ret_val + FD_OFFSET;
+            if ((idents[k] = send_ident(sf->scc[k], sf->sfd[k])) == 0)	other = 1;
+        }
+    }
+
+    if (idents[0] != 0) {
+        if (receive_ident(cc, idents[0], &st) < 0) {
+            other = 1;
+        } else {
+            sf->dev = st.st_dev;
+            sf->ino = st.st_ino;
+            sf->ident = 1;
+        }
+    }
+    for (k = 1; k < stripe_conns; k++) {
+        if (idents[k] == 0)	continue;
+        if (receive_ident(sf->scc[k], idents[k], &st) < 0 || !sf->ident
+            || st.st_dev != sf->dev || st.st_ino != sf->ino)	other = 1;
+    }
+    if (other) {
+        // renamed or unlinked since the fd was opened, or not known to be the same
+        stripe_close(sf);
+        sf->plain = 1;
+        return 0;
+    }
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Fetch len bytes at off into dst with positional reads striped over the
+ * connections, at most STRIPE_DEPTH stripes in flight on each
+ * Called with sf->lock held
+ * @param:
+ *    cc, wire_fd: connection and wire fd of the lib fd, which carry stripe 0
+ * @return: bytes fetched, short at the end of the file, -errno if none were
+ */
+static int64_t stripe_fetch(struct stripe_file *sf, struct client_conn *cc, int wire_fd,
+                            char *dst, off_t off, size_t len) {
+    uint32_t ids[STRIPE_MAX_CONNS * STRIPE_DEPTH];
+    int64_t errs[STRIPE_MAX_CONNS * STRIPE_DEPTH]; /* -errno of a stripe that could not be sent */
+    size_t n = (len + stripe_size - 1) / stripe_size;
+    size_t sent = 0, i;
+    int64_t done = 0, error = 0;
+    int eof = 0;
+    int stop = 0; /* no more stripes are asked for, past an end of file or an error */
+
+    if (stripe_open(sf, cc, wire_fd) < 0)	return -errno;
+    int conns = sf->plain ? 1 : stripe_conns;
+    int depth = conns * STRIPE_DEPTH;
+
+    for (i = 0; i < n; i++) {
+        // keep the window of requests full
+        for (; !stop && sent < n && sent < i + depth; sent++) {
+            int k = sent % conns;
+            struct pread_req req = {
+                .fd = k == 0 ? wire_fd : sf->sfd[k],
+                .count = sent + 1 < n ? stripe_size : len - sent * stripe_size,
+                .offset = off + (off_t)(sent * stripe_size),
+            };
+            struct msg_writer *msg = marshalling_method(OP_PREAD);
+            encode_pread_req(msg, &req);
+            ids[sent % depth] = send_to_server(k == 0 ? cc : sf->scc[k], msg);
+            if (ids[sent % depth] == 0) {
+                // kept before later calls overwrite errno
+                errs[sent % depth] = -errno;
+                stop = 1;
+            }
+        }
+        if (i >= sent)	break; // the stripes past an end were never asked for
+
+        int k = i % conns;
+        size_t want = i + 1 < n ? stripe_size : len - i * stripe_size;
+        uint32_t req_id = ids[i % depth];
+        int64_t got = req_id ? receive_read(k == 0 ? cc : sf->scc[k], req_id, dst + i * stripe_size, want)
+                             : errs[i % depth];
+
+        // every reply is collected, only those before a short one count
+        if (eof)	continue;
+        if (got < 0) {
+            error = got;
+            eof = stop = 1;
+            continue;
+        }
+        done += got;
+        if ((size_t)got < want)	eof = stop = 1;
+    }
+    if (done == 0 && error < 0)	return error;
+    return done;
+}
+
+/*
+ * read of a striped file at its offset
+ * @return: bytes read, -1 with errno set on error
+ */
+static ssize_t stripe_read(struct stripe_file *sf, struct client_conn *cc, int wire_fd,
+                           char *buf, size_t count) {
+    size_t window = stripe_size * stripe_conns;
+    size_t done = 0;
+    int64_t got = 0;
+
+    pthread_mutex_lock(&sf->lock);
+    int sequential = sf->pos == sf->next_seq;
+    // first what the readahead window holds
+    if (sf->ra_len > 0 && sf->pos >= sf->ra_off && sf->pos < sf->ra_off + (off_t)sf->ra_len) {
+        size_t have = sf->ra_off + sf->ra_len - sf->pos;
+        done = count < have ? count : have;
+        memcpy(buf, sf->ra + (sf->pos - sf->ra_off), done);
+    }
+
+    if (done < count && count - done >= window) {
+        // large enough to stripe straight into buf
+        got = stripe_fetch(sf, cc, wire_fd, buf + done, sf->pos + done, count - done);
+        if (got > 0)	done += got;
+    } else if (done < count && sequential) {
+        // a small sequential read, fetch ahead twice as far as last time
+        size_t ahead = sf->ra_next < window / 2 ? sf->ra_next * 2 : window;
+        if (ahead < count - done)	ahead = count - done;
+        if (sf->ra == NULL && (sf->ra = (char *)malloc(window)) == NULL) {
+            got = -ENOMEM;
+        } else {
+            sf->ra_off = sf->pos + done;
+            sf->ra_len = 0;
+            sf->ra_next = ahead;
+            got = stripe_fetch(sf, cc, wire_fd, sf->ra, sf->ra_off, ahead);
+            if (got > 0) {
+                size_t n = count - done < (size_t)got ? count - done : (size_t)got;
+                sf->ra_len = got;
+                memcpy(buf + done, sf->ra, n);
+                done += n;
+            }
+        }
+    } else if (done < count) {
+        // a small read elsewhere, only what was asked for
+        sf->ra_next = count - done;
+        got = stripe_fetch(sf, cc, wire_fd, buf + done, sf->pos + done, count - done);
+        if (got > 0)	done += got;
+    }
+
+    sf->pos += done;
+    sf->next_seq = sf->pos;
+    pthread_mutex_unlock(&sf->lock);
+
+    /* like read(2), data already transferred wins over a later error */
+    if (done == 0 && got < 0) {
+        errno = (int)-got;
+        return -1;
+    }
+    return done;
+}
+
+/*
+ * Stop striping an fd being closed and close it over the stripe connections
+ */
+static void stripe_untrack(struct stripe_file *sf) {
+    stripe_close(sf);
+    pthread_mutex_destroy(&sf->lock);
+    free(sf->ra);
+    free(sf->path);
+    free(sf);
 }
 
 // The following line declares a function pointer with the same prototype as the open function.  
@@ -224,34 +1421,42 @@ int open(const char *pathname, int flags, ...) {
     // we just print a message, then call through to the original open function (from libc)
     fprintf(stderr, "mylib: open called for path %s\n", pathname);
     
-    /* allocate 300 bytes for serialization */
-    char *argv = (char*)malloc(300 * sizeof(char));
-
-    /* parameters are separated from a '|' character */
-    strcpy(argv, int_to_str(flags));
-    strcat(argv, "|");
-    strcat(argv, mode_t_to_str(m));
-    strcat(argv, "|");
-    strcat(argv, pathname);
+    /* flags and mode are the arguments, pathname is the payload */
+    START_CALL(DEADLINE_META);
+    struct open_req req = {.flags = flags, .mode = m};
+    struct msg_writer *msg = marshalling_method(OP_OPEN);
+    encode_open_req(msg, &req);
+    msg_put_bytes(msg, pathname, strlen(pathname));
 	
-    char* msg = marshalling_method("open", argv, strlen(argv));
-    char *ret_val = connect_to_server(msg, strlen(msg));
-    ret_val = get_ret_content(ret_val);
+    struct client_conn *cc = home_connection();
+    int64_t ret_val = get_reply(connect_to_server(cc, msg), NULL, NULL, NULL);
     
-    /* if return value starts with a '-', which means an errno is returned */
-    if (*ret_val == '-') {
+    /* a negative return value carries the errno */
+    if (ret_val < 0) {
         /* set the returned errno and return -1 */
-        errno = -atoi(ret_val);
+        errno = (int)-ret_val;
         fprintf(stderr, "errno: %d\n", errno);
         return -1;
     }
-    fprintf(stderr, "open fd: %d\n", atoi(ret_val));
+    fprintf(stderr, "open fd: %d\n", (int)ret_val);
     
     /*
      * if success, return the file descriptor starting from the FD_OFFSET
      * The FD_OFFSET is to discriminate the library fd to fd acquired from the system itself
+     * and the connection it was opened over is folded in, see lib_fd
      */
-    return atoi(ret_val) + FD_OFFSET;
+    int fd = lib_fd(cc, ret_val);
+    if (fd < 0) {
+        struct close_req close_req = {.fd = (int)ret_val + FD_OFFSET};
+        msg = marshalling_method(OP_CLOSE);
+        encode_close_req(msg, &close_req);
+        get_reply(connect_to_server(cc, msg), NULL, NULL, NULL);
+        errno = EMFILE;
+        return -1;
+    }
+    count_fd(cc, 1);
+    stripe_track(fd, pathname, flags);
+    return fd;
 }
 
 /*
@@ -270,23 +1475,23 @@ int close(int fd) {
     if (fd < FD_OFFSET) {
         return orig_close(fd);
     }
-    char *argv;
-    
-    /* allocate 12 bytes for serialization */
-    argv = (char*)malloc(12 * sizeof(char));
-
-    strcpy(argv, int_to_str(fd));
+    START_CALL(DEADLINE_META);
+    int wire_fd;
+    struct client_conn *cc = fd_connection(fd, &wire_fd);
+    if (cc == NULL)	return -1;
+    struct stripe_file *sf = stripe_find(fd, 1);
+    if (sf != NULL)	stripe_untrack(sf);
 	
-    char* msg = marshalling_method("close", argv, strlen(argv));
-    char *ret_val = connect_to_server(msg, strlen(msg));
-    ret_val = get_ret_content(ret_val);
+    int64_t ret_val = get_reply(receive_from_server(cc, send_close(cc, wire_fd), NULL, 0), NULL, NULL, NULL);
+    /* like close(2), the fd is gone even if an error is reported */
+    count_fd(cc, -1);
     
-    if (*ret_val == '-') {
-        errno = -atoi(ret_val);
+    if (ret_val < 0) {
+        errno = (int)-ret_val;
         fprintf(stderr, "errno: %d\n", errno);
         return -1;
     }
-    return atoi(ret_val);
+    return (int)ret_val;
 }
 
 ssize_t (*orig_read)(int fd, void *buf, size_t count);
@@ -311,39 +1516,22 @@ ssize_t read(int fd, void *buf, size_t count) {
         return orig_read(fd, buf, count);
     }
     
-    /* allocate 30 bytes for serialization */
-    char *argv = (char *)malloc((30) * sizeof(char));
+    START_CALL(DEADLINE_DATA);
+    struct read_req req = {.count = count};
+    struct client_conn *cc = fd_connection(fd, &req.fd);
+    if (cc == NULL)	return -1;
+    struct stripe_file *sf = stripe_find(fd, 0);
+    if (sf != NULL)	return stripe_read(sf, cc, req.fd, (char *)buf, count);
 
-    strcpy(argv, int_to_str(fd));
-    strcat(argv, "|");
-    strcat(argv, size_t_to_str(count));
+    struct msg_writer *msg = marshalling_method(OP_READ);
+    encode_read_req(msg, &req);
 
-    char *msg = marshalling_method("read", argv, strlen(argv));
-    char *ret_val = connect_to_server(msg, strlen(msg));
-
-    /*
-     * the return message format is
-     * EITHER
-     * "number of bytes read | contents read"
-     * OR
-     * "the negative length of errno | errno"
-     */
-    char *number = ret_val;
-
-    while (*ret_val != '|') {
-        ret_val++;
-    }
-    *ret_val = '\0';
-    ret_val++;
-	
-    ssize_t byte_read = ato_ssize_t(number);
-    
-    if (*number == '-') {
-        errno = -atoi(ret_val);
+    int64_t byte_read = receive_read(cc, send_to_server(cc, msg), (char *)buf, count);
+    if (byte_read < 0) {
+        errno = (int)-byte_read;
         fprintf(stderr, "read errno: %d\n", errno);
         return -1;
     }
-    memcpy((char *)buf, ret_val, byte_read);
     return byte_read;
 }
 
@@ -369,42 +1557,55 @@ ssize_t write(int fd, void *buf, size_t count) {
         return orig_write(fd, buf, count);
     }
     
-    char *argv = (char *)malloc((count + 20) * sizeof(char));
     fprintf(stderr, "write count: %d\n", (int)count);
 
-    strcpy(argv, int_to_str(fd));
-    strcat(argv, "|");
-    strcat(argv, size_t_to_str(count));
-    strcat(argv, "|");
-
-    int tmpLen = strlen(argv);
-		
-    char *traverse = argv;
-    while (*traverse != '\0') traverse++;
-	
-    memcpy(traverse, (char *)buf, count);
-	
-    char *msg = marshalling_method("write",  argv, tmpLen + count);
-    char *ret_val = connect_to_server(msg, tmpLen + count + 6);
+    /*
+     * the data to write is the payload, compressed if the server agreed and it shrinks
+     * Data larger than MAXWRITELEN is streamed as back-to-back chunk frames,
+     * all but the last flagged FRAME_F_MORE, and only the last is answered
+     * The chunks go out back to back, so the server sees them in a row,
+     * each within the deadline of the call, so a stalled server cannot hold them
+     */
+    START_CALL(DEADLINE_DATA);
+    struct write_req req;
+    struct client_conn *cc = fd_connection(fd, &req.fd);
+    if (cc == NULL)	return -1;
+    uint32_t req_id;
+    size_t sent = 0;
+    pthread_mutex_lock(&cc->send_lock);
+    do {
+        size_t chunk = count - sent > MAXWRITELEN ? MAXWRITELEN : count - sent;
+        const char *data = (const char *)buf + sent;
+        struct msg_writer *msg = marshalling_method(OP_WRITE);
+        encode_write_req(msg, &req);
+        if (sent + chunk < count)	msg_add_flags(msg, FRAME_F_MORE);
+        if (!(peer_caps & CAP_COMPRESS) || !msg_put_compressed(msg, data, chunk)) {
+            msg_put_ref(msg, data, chunk);
+        }
+        if ((req_id = send_locked(cc, msg)) == 0) {
+            pthread_mutex_unlock(&cc->send_lock);
+            return -1;
+        }
+        sent += chunk;
+    } while (sent < count);
+    pthread_mutex_unlock(&cc->send_lock);
     
     /*
-     * the return message format is
+     * the reply carries
      * EITHER
-     * "number of bytes write"
+     * number of bytes write
      * OR
-     * "negative errno"
+     * negative errno
      */
-    
-    ret_val = get_ret_content(ret_val);
+    int64_t ret_val = get_reply(receive_from_server(cc, req_id, NULL, 0), NULL, NULL, NULL);
 
-    if (*ret_val == '-') {
-        errno = -atoi(ret_val);
+    if (ret_val < 0) {
+        errno = (int)-ret_val;
         fprintf(stderr, "errno: %d\n", errno);
         return -1;
     }
     
-    free(argv);
-    return ato_ssize_t(ret_val);
+    return (ssize_t)ret_val;
 }
 
 off_t (*orig_lseek)(int fd, off_t offset, int whence);
@@ -428,56 +1629,126 @@ off_t lseek(int fd, off_t offset, int whence) {
         return orig_lseek(fd, offset, whence);
     }
 	
-    char *argv = (char *)malloc(40 * sizeof(char));
+    START_CALL(DEADLINE_META);
+    struct lseek_req req = {.offset = offset, .whence = whence};
+    struct client_conn *cc = fd_connection(fd, &req.fd);
+    if (cc == NULL)	return -1;
 
-    strcpy(argv, int_to_str(fd));
-    strcat(argv, "|");
-    strcat(argv, off_t_to_str(offset));
-    strcat(argv, "|");
-    strcat(argv, int_to_str(whence));
+    /* the offset of a striped file is kept here, the server just checks it */
+    struct stripe_file *sf = stripe_find(fd, 0);
+    if (sf != NULL) {
+        pthread_mutex_lock(&sf->lock);
+        if (whence == SEEK_CUR) {
+            req.offset += sf->pos;
+            req.whence = SEEK_SET;
+        }
+    }
+    struct msg_writer *msg = marshalling_method(OP_LSEEK);
+    encode_lseek_req(msg, &req);
 	
-    char* msg = marshalling_method("lseek", argv, strlen(argv));
-    char *ret_val = connect_to_server(msg, strlen(msg));
-    ret_val = get_ret_content(ret_val);
-    if (*ret_val == '-') {
-        errno = -atoi(ret_val);
+    int64_t ret_val = get_reply(connect_to_server(cc, msg), NULL, NULL, NULL);
+    if (sf != NULL) {
+        if (ret_val >= 0) {
+            // a seek also drops what was read ahead, to see newer writes
+            sf->pos = ret_val;
+            sf->ra_len = 0;
+        }
+        pthread_mutex_unlock(&sf->lock);
+    }
+    if (ret_val < 0) {
+        errno = (int)-ret_val;
         fprintf(stderr, "errno: %d\n", errno);
         return -1;
     }
-    free(argv);
-    return ato_off_t(ret_val);
+    return (off_t)ret_val;
+}
+
+/*
+ * Send a stat of a remote path without waiting for the reply
+ * Many stats can be in flight, each collected with stat_fields_wait
+ * by the same thread, as they go over its own connection
+ * @param:
+ *    path: file path to get file stat info
+ *    mask: STAT_F_* bits of the fields wanted
+ * @return:
+ *    ticket to pass to stat_fields_wait, 0 if error
+ */
+unsigned int stat_fields_send(const char *path, unsigned int mask) {
+    START_CALL(DEADLINE_META);
+    struct stat_req req = {.mask = mask};
+    struct msg_writer *msg = marshalling_method(OP_STAT);
+    encode_stat_req(msg, &req);
+    msg_put_bytes(msg, path, strlen(path));
+
+    return send_to_server(home_connection(), msg);
+}
+
+/*
+ * Wait for the reply to a stat sent with stat_fields_send
+ * @param:
+ *    ticket: returned by stat_fields_send
+ *    stat_buf: filled with the fields received, the others are zeroed
+ * @return:
+ *    mask of the fields filled in, -1 if error
+ */
+int stat_fields_wait(unsigned int ticket, struct stat *stat_buf) {
+    START_CALL(DEADLINE_META);
+    char *frame = home_conn ? receive_from_server(home_conn, ticket, NULL, 0) : NULL;
+    char *content;
+    size_t content_len;
+    struct arg_reader rest;
+    int64_t ret_val = get_reply(frame, &content, &content_len, &rest);
+
+    if (ret_val >= 0) {
+        /* the mask of the fields sent follows the return value */
+        uint32_t got = read_arg_u32(&rest);
+        if (rest.error || unpack_stat_fields(content, content_len, rest.codec, got, stat_buf) < 0) {
+            ret_val = -EPROTO;
+        } else {
+            ret_val = got;
+        }
+    }
+    if (ret_val < 0) {
+        errno = (int)-ret_val;
+        fprintf(stderr, "errno: %d\n", errno);
+        return -1;
+    }
+    return (int)ret_val;
+}
+
+/*
+ * stat a remote path, fetching only some of the fields
+ * @param:
+ *    path: file path to get file stat info
+ *    mask: STAT_F_* bits of the fields wanted
+ *    stat_buf: filled with the fields received, the others are zeroed
+ * @return:
+ *    mask of the fields filled in, -1 if error
+ */
+int stat_fields(const char *path, unsigned int mask, struct stat *stat_buf) {
+    // one deadline for the send and the wait together
+    START_CALL(DEADLINE_META);
+    unsigned int ticket = stat_fields_send(path, mask);
+    if (ticket == 0)	return -1;
+    return stat_fields_wait(ticket, stat_buf);
 }
 
 /*
  * __xstat system call with data serialization and deserialization
+ * Only the path goes to the server, which returns every stat field
  * @param:
- *    ver: version number
+ *    ver: version number of the caller's struct stat
  *    path: file path to get file stat info
  *    stat_buf: stat_buf to store the file info
  * @return:
  *    0 if succeed, -1 if error
  */
 int __xstat(int ver, const char *path, struct stat *stat_buf) {
+    (void)ver; // the server fills in the struct stat of this build
     fprintf(stderr, "mylib: stat called for path: %s\n", path);
 
-    char *argv = (char *)malloc(1000 * sizeof(char));
-    strcpy(argv, int_to_str(ver));
-    strcat(argv, "|");
-    strcat(argv, path);
-    strcat(argv, "|");
-    strcat(argv, statptr_to_str(stat_buf));
-	
-    char* msg = marshalling_method("__xstat", argv, strlen(argv));
-    char *ret_val = connect_to_server(msg, strlen(msg));
-    ret_val = get_ret_content(ret_val);
-    
-    if (*ret_val == '-') {
-        errno = -atoi(ret_val);
-        fprintf(stderr, "errno: %d\n", errno);
-        return -1;
-    }
-    free(argv);
-    return atoi(ret_val);
+    if (stat_fields(path, STAT_F_ALL, stat_buf) < 0)	return -1;
+    return 0;
 }
 
 /*
@@ -489,21 +1760,19 @@ int __xstat(int ver, const char *path, struct stat *stat_buf) {
  */
 int unlink(const char *pathname) {
     fprintf(stderr, "mylib: unlink called for path: %s\n", pathname);
-    char *argv = (char *)malloc(1000 * sizeof(char));
-
-    strcpy(argv, pathname);
 	
-    char *msg = marshalling_method("unlink", argv, strlen(argv));
-    char *ret_val = connect_to_server(msg, strlen(msg));
-    ret_val = get_ret_content(ret_val);
+    START_CALL(DEADLINE_META);
+    struct msg_writer *msg = marshalling_method(OP_UNLINK);
+    msg_put_bytes(msg, pathname, strlen(pathname));
+
+    int64_t ret_val = get_reply(connect_to_server(home_connection(), msg), NULL, NULL, NULL);
     
-    if (*ret_val == '-') {
-        errno = -atoi(ret_val);
+    if (ret_val < 0) {
+        errno = (int)-ret_val;
         fprintf(stderr, "errno: %d\n", errno);
         return -1;
     }
-    free(argv);
-    return atoi(ret_val);
+    return (int)ret_val;
 }
 
 ssize_t (*orig_getdirentries)(int fd, char *buf, size_t nbytes, off_t *basep);
@@ -524,39 +1793,31 @@ ssize_t getdirentries(int fd, char *buf, size_t nbytes, off_t *basep) {
         return orig_getdirentries(fd, buf, nbytes, basep);
     }
     
-    char *argv = (char *)malloc(40 * sizeof(char));
+    START_CALL(DEADLINE_META);
+    struct getdirentries_req req = {.nbytes = nbytes, .base = *basep};
+    struct client_conn *cc = fd_connection(fd, &req.fd);
+    if (cc == NULL)	return -1;
+    struct msg_writer *msg = marshalling_method(OP_GETDIRENTRIES);
+    encode_getdirentries_req(msg, &req);
 
-    strcpy(argv, int_to_str(fd));
-    strcat(argv, "|");
-    strcat(argv, size_t_to_str(nbytes));
-    strcat(argv, "|");
-    strcat(argv, off_t_to_str(*basep));
-	
-    char* msg = marshalling_method("getdirentries", argv, strlen(argv));
-    char *ret_val = connect_to_server(msg, strlen(msg));
-    fprintf(stderr, "client: getdiren ret_val :%s\n", ret_val);
-
-    char *number = ret_val;
-    while (*number != '|') {
-        number++;
-    }
-    *number = '\0';
-    number++;
+    char *content;
+    size_t content_len;
+    struct arg_reader rest;
+    int64_t ret_num = get_reply(connect_to_server_into(cc, msg, buf, nbytes), &content, &content_len, &rest);
 
-    if (*number == '-') {
-        errno = -atoi(number);
+    if (ret_num < 0) {
+        errno = (int)-ret_num;
         fprintf(stderr, "errno: %d\n", errno);
         return -1;
     }
     
-    ssize_t ret_num = ato_ssize_t(ret_val);
-    int i;
-    for (i = 0; i < ret_num; i++) {
-        buf[i] = number[i];
-    }
+    /* the new base follows the return value in the reply arguments */
+    off_t base = (off_t)read_arg_i64(&rest);
+    if (!rest.error)	*basep = base;
+    if ((size_t)ret_num > content_len)	ret_num = content_len;
+    if (content != buf)	memcpy(buf, content, ret_num);
 
-    free(argv);
-    return ret_num;
+    return (ssize_t)ret_num;
 }
 
 /*
@@ -568,25 +1829,24 @@ ssize_t getdirentries(int fd, char *buf, size_t nbytes, off_t *basep) {
  */
 struct dirtreenode* getdirtree(const char *path) {
     fprintf(stderr, "mylib: getdirtree called for path: %s\n", path);
-
-    char *argv = (char *)malloc(1000 * sizeof(char));
-    strcpy(argv, path);
 	
-    char *msg = marshalling_method("getdirtree", argv, strlen(argv));
-    char *ret_val = connect_to_server(msg, strlen(msg));
-    ret_val = get_ret_content(ret_val);
-    if (*ret_val == '-') {
-        errno = -atoi(ret_val);
+    START_CALL(DEADLINE_META);
+    struct msg_writer *msg = marshalling_method(OP_GETDIRTREE);
+    msg_put_bytes(msg, path, strlen(path));
+
+    char *content;
+    size_t content_len;
+    int64_t ret_val = get_reply(connect_to_server(home_connection(), msg), &content, &content_len, NULL);
+    if (ret_val < 0) {
+        errno = (int)-ret_val;
         fprintf(stderr, "errno: %d\n", errno);
         return NULL;
     }
-    ret_dirtreenode = ato_dirtreenode(ret_val);
-    free(argv);
+    ret_dirtreenode = ato_dirtreenode(content, content_len);
+    if (ret_dirtreenode == NULL)	errno = EPROTO;
     return ret_dirtreenode;
 }
 
-void (*orig_freedirtree)(struct dirtreenode* dt);
-
 /*
  * freedirtree function with data serialization and deserialization
  * @param:
@@ -597,9 +1857,10 @@ void freedirtree(struct dirtreenode* dt) {
     fprintf(stderr, "mylib: freedirtree called\n");
     /*
      * No need to rpc this function, because server will call freedirtree after getdirtree
-     * Therefore, freedirtree from local is enough
+     * The tree from getdirtree lives in one block starting at its root,
+     * so a single free releases all of it
      */
-    orig_freedirtree(dt);
+    free(dt);
     return;
 }
 
@@ -611,28 +1872,56 @@ void _init(void) {
     orig_write = dlsym(RTLD_NEXT, "write");
     orig_lseek = dlsym(RTLD_NEXT, "lseek");
     orig_getdirentries = dlsym(RTLD_NEXT, "getdirentries");
-    orig_freedirtree = dlsym(RTLD_NEXT, "freedirtree");
 }
 
 /*
- * After the lib is unloading, close the sockfd
- * @return: the same return value of close(sockfd)
+ * After the lib is unloading, close the connections to the server
+ * @return: 0
  */
 int _fini(void) {
-    return orig_close(sockfd);
+    int i;
+    if (peer_caps & CAP_COMPRESS)	print_compress_stats("mylib");
+    if (deadline_stats.misses[DEADLINE_META] + deadline_stats.misses[DEADLINE_DATA] > 0) {
+        fprintf(stderr, "mylib: deadline misses: meta %llu of %llu, data %llu of %llu, late replies %llu\n",
+                (unsigned long long)deadline_stats.misses[DEADLINE_META],
+                (unsigned long long)deadline_stats.calls[DEADLINE_META],
+                (unsigned long long)deadline_stats.misses[DEADLINE_DATA],
+                (unsigned long long)deadline_stats.calls[DEADLINE_DATA],
+                (unsigned long long)deadline_stats.late_replies);
+    }
+    for (i = 0; i < CONN_SLOTS; i++) {
+        if (conn_slots[i] != NULL)	conn_close(conn_slots[i]->conn);
+    }
+    return 0;
 }
 
 /*
- * Get content from the return value
- * Return value is composed of:
- * length of the content | content
+ * Decode the reply frame returned from the server
+ * The payload is wherever receive_message put it, see reply_payload
+ * The first argument of every reply is the i64 return value,
+ * which is negative errno if the call failed on the server
  * @param: 
- *    ret_val: char array of the return value
+ *    frame: reply frame, starting at its length prefix, NULL with errno set if none was received
+ *    payload: set to ptr to the content of the reply, may be NULL
+ *    payload_len: set to the length of the content, may be NULL
+ *    rest: set to read the arguments following the return value, may be NULL
  * @return: 
- *    ptr to the content
+ *    return value of the call, -EPROTO if the reply is malformed
  */
-char *get_ret_content(char *ret_val) {
-    while (*ret_val != '|')	ret_val++;
-    ret_val++;
-    return ret_val;
-}
\ No newline at end of file
+int64_t get_reply(char *frame, char **payload, size_t *payload_len, struct arg_reader *rest) {
+    struct frame_header hdr;
+    struct arg_reader r;
+
+    if (frame == NULL)	return errno ? -errno : -EIO;
+    if (decode_frame_header(frame, &hdr) < 0) {
+        return -EPROTO;
+    }
+    arg_reader_init(&r, frame, &hdr);
+    int64_t ret = read_arg_i64(&r);
+    if (r.error)	return -EPROTO;
+
+    if (payload)	*payload = reply_payload;
+    if (payload_len)	*payload_len = frame_payload_len(&hdr);
+    if (rest)	*rest = r;
+    return ret;
+}
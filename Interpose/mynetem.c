@@ -0,0 +1,265 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * mynetem.c
+ * Implementation of the emulated link defined in mynetem.h
+ *
+ * The link is modelled like a router queue: a send starts once the link
+ * is free (or a stall is over), occupies it for len / rate, and is due
+ * delay +- jitter after that. Due times never go backwards, so jitter
+ * does not reorder the byte stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mynetem.h"
+
+/* Shape of the link, parsed once from netem15440 */
+struct netem_config {
+    int on;
+    uint64_t delay_ns;
+    uint64_t jitter_ns;
+    double rate_bps; /* bits per second, 0 for unlimited */
+    double stall_prob;
+    uint64_t stall_ns;
+};
+
+/* Bytes of one send waiting for their due time */
+struct netem_packet {
+    uint64_t due; /* CLOCK_MONOTONIC ns */
+    size_t len;
+    struct netem_packet *next;
+    char data[];
+};
+
+struct netem {
+    struct netem_config cfg;
+    netem_link link;
+    void *ctx;
+    pthread_mutex_t lock; /* guards the fields below */
+    pthread_cond_t ready; /* a packet was queued or the link is closing */
+    pthread_cond_t drained; /* a packet left the queue */
+    pthread_t thread;
+    int started;
+    int closing;
+    int error; /* errno of a failed send, later sends fail with it */
+    struct netem_packet *head, *tail;
+    size_t queued; /* bytes in the queue */
+    uint64_t link_free; /* when the link has sent what is queued */
+    uint64_t last_due; /* due time of the newest packet */
+    unsigned int seed;
+};
+
+static struct netem_config config;
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t ms_to_ns(const char *ms) {
+    double v = atof(ms);
+    return v > 0 ? (uint64_t)(v * 1e6) : 0;
+}
+
+/*
+ * Parse netem15440, see mynetem.h
+ * Unknown settings are reported and ignored
+ */
+static void read_config(void) {
+    char *env = getenv("netem15440");
+    char *copy, *item, *save;
+
+    if (env == NULL || *env == '\0' || (copy = strdup(env)) == NULL)	return;
+    for (item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(item, '=');
+        if (value == NULL) {
+            fprintf(stderr, "netem: ignoring '%s'\n", item);
+            continue;
+        }
+        *value++ = '\0';
+        if (strcmp(item, "delay") == 0) {
+            config.delay_ns = ms_to_ns(value);
+        } else if (strcmp(item, "jitter") == 0) {
+            config.jitter_ns = ms_to_ns(value);
+        } else if (strcmp(item, "rate") == 0) {
+            config.rate_bps = atof(value) * 1e6;
+        } else if (strcmp(item, "stall") == 0) {
+            char *ms = strchr(value, ':');
+            config.stall_prob = atof(value);
+            config.stall_ns = ms ? ms_to_ns(ms + 1) : 0;
+        } else {
+            fprintf(stderr, "netem: ignoring '%s'\n", item);
+            continue;
+        }
+        config.on = 1;
+    }
+    free(copy);
+    if (config.on) {
+        fprintf(stderr, "netem: delay %.3f ms, jitter %.3f ms, rate %.1f Mbit/s, stall %.4f for %.3f ms\n",
+                config.delay_ns / 1e6, config.jitter_ns / 1e6, config.rate_bps / 1e6,
+                config.stall_prob, config.stall_ns / 1e6);
+    }
+}
+
+/*
+ * Hand the queued packets to the transport as they come due
+ * When closing, what is left still goes out on time
+ */
+static void *netem_thread(void *arg) {
+    struct netem *em = (struct netem *)arg;
+
+    pthread_mutex_lock(&em->lock);
+    while (1) {
+        while (em->head == NULL && !em->closing)	pthread_cond_wait(&em->ready, &em->lock);
+        struct netem_packet *p = em->head;
+        if (p == NULL)	break;
+        int failed = em->error;
+        pthread_mutex_unlock(&em->lock);
+
+        uint64_t now = now_ns();
+        if (p->due > now) {
+            struct timespec ts = {.tv_sec = (p->due - now) / 1000000000ull,
+                                  .tv_nsec = (p->due - now) % 1000000000ull};
+            while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+        }
+        struct iovec iov = {.iov_base = p->data, .iov_len = p->len};
+        ssize_t rv = failed ? 0 : em->link(em->ctx, &iov, 1);
+        int error = rv < 0 ? (errno ? errno : EPIPE) : 0;
+
+        pthread_mutex_lock(&em->lock);
+        if (error && em->error == 0)	em->error = error;
+        em->head = p->next;
+        if (em->head == NULL)	em->tail = NULL;
+        em->queued -= p->len;
+        pthread_cond_broadcast(&em->drained);
+        free(p);
+    }
+    pthread_mutex_unlock(&em->lock);
+    return NULL;
+}
+
+/*
+ * Emulated link described by netem15440
+ * @return: new link, NULL if netem15440 is unset or invalid
+ */
+struct netem *netem_from_env(netem_link link, void *ctx) {
+    pthread_once(&config_once, read_config);
+    if (!config.on)	return NULL;
+
+    struct netem *em = (struct netem *)calloc(1, sizeof(struct netem));
+    if (em == NULL)	return NULL;
+    em->cfg = config;
+    em->link = link;
+    em->ctx = ctx;
+    em->seed = (unsigned int)(now_ns() ^ ((uint64_t)getpid() << 16) ^ (uintptr_t)em);
+    pthread_mutex_init(&em->lock, NULL);
+    pthread_cond_init(&em->ready, NULL);
+    // a send waits for room until the deadline of its call, on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&em->drained, &attr);
+    pthread_condattr_destroy(&attr);
+    return em;
+}
+
+/*
+ * Queue the bytes of several buffers to go out once due
+ * @param:
+ *    deadline: CLOCK_MONOTONIC ns to stop waiting for room at, 0 for none
+ * @return: number of bytes queued, -1 with errno set on error
+ */
+ssize_t netem_send(struct netem *em, struct iovec *iov, int iovcnt, uint64_t deadline) {
+    size_t len = 0, off = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)	len += iov[i].iov_len;
+    struct netem_packet *p = (struct netem_packet *)malloc(sizeof(struct netem_packet) + len);
+    if (p == NULL)	return -1;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(p->data + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    p->len = len;
+    p->next = NULL;
+
+    pthread_mutex_lock(&em->lock);
+    if (!em->started) {
+        // started here rather than with the link, so it runs in the process sending
+        if (pthread_create(&em->thread, NULL, netem_thread, em) != 0)	em->error = EAGAIN;
+        else	em->started = 1;
+    }
+    int timed_out = 0;
+    while (!em->error && !timed_out && em->queued > 0 && em->queued + len > NETEM_QUEUE_MAX) {
+        if (deadline) {
+            struct timespec ts = {.tv_sec = deadline / 1000000000ull, .tv_nsec = deadline % 1000000000ull};
+            timed_out = pthread_cond_timedwait(&em->drained, &em->lock, &ts) == ETIMEDOUT;
+        } else {
+            pthread_cond_wait(&em->drained, &em->lock);
+        }
+    }
+    if (em->error || timed_out) {
+        errno = em->error ? em->error : ETIMEDOUT;
+        pthread_mutex_unlock(&em->lock);
+        free(p);
+        return -1;
+    }
+
+    // the send waits for the link, then occupies it for its serialization time
+    const struct netem_config *cfg = &em->cfg;
+    uint64_t now = now_ns();
+    uint64_t start = em->link_free > now ? em->link_free : now;
+    if (cfg->stall_prob > 0 && rand_r(&em->seed) < cfg->stall_prob * ((double)RAND_MAX + 1)) {
+        start += cfg->stall_ns;
+    }
+    em->link_free = start + (cfg->rate_bps > 0 ? (uint64_t)(len * 8 * 1e9 / cfg->rate_bps) : 0);
+
+    int64_t jitter = 0;
+    if (cfg->jitter_ns > 0) {
+        jitter = (int64_t)(rand_r(&em->seed) / ((double)RAND_MAX + 1) * (2 * cfg->jitter_ns + 1))
+                 - (int64_t)cfg->jitter_ns;
+    }
+    int64_t delay = (int64_t)cfg->delay_ns + jitter;
+    p->due = em->link_free + (delay > 0 ? (uint64_t)delay : 0);
+    if (p->due < em->last_due)	p->due = em->last_due;
+    em->last_due = p->due;
+
+    if (em->tail)	em->tail->next = p;
+    else	em->head = p;
+    em->tail = p;
+    em->queued += len;
+    pthread_cond_signal(&em->ready);
+    pthread_mutex_unlock(&em->lock);
+    return len;
+}
+
+/* Send what is still queued, stop the thread and free the link */
+void netem_close(struct netem *em) {
+    if (em == NULL)	return;
+    pthread_mutex_lock(&em->lock);
+    em->closing = 1;
+    pthread_cond_signal(&em->ready);
+    pthread_mutex_unlock(&em->lock);
+    if (em->started)	pthread_join(em->thread, NULL);
+
+    while (em->head) {
+        // never started, as in the parent of a forked server
+        struct netem_packet *p = em->head;
+        em->head = p->next;
+        free(p);
+    }
+    pthread_mutex_destroy(&em->lock);
+    pthread_cond_destroy(&em->ready);
+    pthread_cond_destroy(&em->drained);
+    free(em);
+}
@@ -0,0 +1,63 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * mynetem.h
+ * Network emulation under the transports of mytransport.h, to reproduce
+ * WAN round trips between mylib and server on one host.
+ *
+ * It is turned on in either process with the environment variable
+ * netem15440, a comma separated list of
+ *     delay=MS        one-way delay of everything this side sends
+ *     jitter=MS       delay varies uniformly by up to this much either way
+ *     rate=MBIT       link bandwidth in Mbit/s, unlimited if unset
+ *     stall=P:MS      each send stalls the link for MS with probability P
+ * for example netem15440=delay=20,jitter=2,rate=100. Each side only
+ * shapes what it sends, so setting the same value on both gives a
+ * symmetric link with an RTT of twice the delay.
+ *
+ * A send is copied into a queue and returns at once; a thread of the
+ * connection hands it to the transport once it is due, so pipelined
+ * requests overlap their delays as on a real link. Sends leave in order,
+ * and block once NETEM_QUEUE_MAX bytes are queued, like a full socket,
+ * until the deadline of the send if it has one.
+ */
+
+#ifndef MYNETEM_H
+#define MYNETEM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define NETEM_QUEUE_MAX (4 << 20) /* Bytes queued before sends block */
+
+struct netem;
+
+/* Transport send a netem hands due bytes to */
+typedef ssize_t (*netem_link)(void *ctx, struct iovec *iov, int iovcnt);
+
+/*
+ * Emulated link described by netem15440
+ * The thread is only started by the first send, so a connection may be
+ * set up before fork and used in the child
+ * @param:
+ *    link: sends bytes over the real transport, from the netem thread
+ *    ctx: passed to link
+ * @return: new link, NULL if netem15440 is unset or invalid
+ */
+struct netem *netem_from_env(netem_link link, void *ctx);
+
+/*
+ * Queue the bytes of several buffers to go out once due, waiting for
+ * room in the queue until deadline (CLOCK_MONOTONIC ns, 0 for none)
+ * @return: number of bytes queued, -1 with errno set if an earlier send
+ *    failed, the thread could not be started or the deadline passed
+ */
+ssize_t netem_send(struct netem *em, struct iovec *iov, int iovcnt, uint64_t deadline);
+
+/* Send what is still queued, stop the thread and free the link */
+void netem_close(struct netem *em);
+
+#endif
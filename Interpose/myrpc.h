@@ -0,0 +1,212 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * myrpc.h
+ * Argument layouts of every rpc, shared by mylib and server.
+ *
+ * Each layout is a list of (type, name) fields written once below.
+ * RPC_MESSAGE expands a list at compile time into
+ *     struct <msg>                  one member per field
+ *     <msg>_fixed_len               size with the fixed-width codec
+ *     <msg>_max_len                 upper bound with any codec
+ *     encode_<msg>(writer, m)       append the fields to a msg_writer
+ *     pack_<msg>(p, codec, m)       write the fields to a plain buffer
+ *     decode_<msg>(reader, m)       read the fields back, -1 if truncated
+ * The generated functions are static inline and call the per-type
+ * helpers of myframe.h directly, so there is no runtime type dispatch.
+ * Adding an rpc or a field only takes a line in the lists below.
+ */
+
+#ifndef MYRPC_H
+#define MYRPC_H
+
+#include <string.h>
+#include <sys/stat.h>
+#include "myframe.h"
+
+/* Field types: C type, fixed-width size */
+typedef int32_t rpc_i32_t;
+typedef uint32_t rpc_u32_t;
+typedef int64_t rpc_i64_t;
+typedef uint64_t rpc_u64_t;
+typedef int rpc_fd_t; /* lib-created fd, see put_arg_fd */
+
+#define RPC_WIDTH_i32 4
+#define RPC_WIDTH_u32 4
+#define RPC_WIDTH_i64 8
+#define RPC_WIDTH_u64 8
+#define RPC_WIDTH_fd 4
+#define RPC_VARINT_MAX 10 /* Longest LEB128 encoding of a 64-bit value */
+
+/* Requests; a path or the data to write follows as the payload */
+#define RPC_OPEN_REQ(F)          F(i32, flags) F(u32, mode) /* payload: path */
+#define RPC_CLOSE_REQ(F)         F(fd, fd)
+#define RPC_READ_REQ(F)          F(fd, fd) F(u64, count)
+#define RPC_PREAD_REQ(F)         F(fd, fd) F(u64, count) F(i64, offset)
+#define RPC_WRITE_REQ(F)         F(fd, fd) /* payload: data */
+#define RPC_LSEEK_REQ(F)         F(fd, fd) F(i64, offset) F(i32, whence)
+#define RPC_STAT_REQ(F)          F(u32, mask) /* STAT_F_* wanted | payload: path */
+#define RPC_FSTAT_REQ(F)         F(fd, fd) F(u32, mask) /* STAT_F_* wanted */
+#define RPC_GETDIRENTRIES_REQ(F) F(fd, fd) F(u64, nbytes) F(i64, base)
+#define RPC_HELLO_REQ(F)         F(u32, caps) F(u64, session) F(u64, key) /* always fixed-width, session 0 for a new one */
+#define RPC_CANCEL_REQ(F)        F(u32, target) /* req_id to give up on */
+/* unlink and getdirtree only carry a path as payload */
+
+/* Replies; every reply starts with the return value or -errno */
+#define RPC_REPLY(F)               F(i64, ret)
+#define RPC_GETDIRENTRIES_REPLY(F) F(i64, ret) F(i64, base)
+#define RPC_STAT_REPLY(F)          F(i64, ret) F(u32, mask) /* payload: stat fields */
+#define RPC_HELLO_REPLY(F)         F(i64, ret) F(u64, session) F(u64, key) F(u32, resumed) /* ret: caps */
+
+#define RPC_FIELD_DECL(type, name) rpc_##type##_t name;
+#define RPC_FIELD_FIXED(type, name) + RPC_WIDTH_##type
+#define RPC_FIELD_MAX(type, name) + RPC_VARINT_MAX
+#define RPC_FIELD_PUT(type, name) msg_put_##type(w, m->name);
+#define RPC_FIELD_PACK(type, name) len += put_arg_##type(p + len, m->name, codec);
+#define RPC_FIELD_GET(type, name) m->name = read_arg_##type(r);
+
+#define RPC_MESSAGE(msg, FIELDS) \
+    struct msg { FIELDS(RPC_FIELD_DECL) }; \
+    enum { msg##_fixed_len = 0 FIELDS(RPC_FIELD_FIXED), \
+           msg##_max_len = 0 FIELDS(RPC_FIELD_MAX) }; \
+    _Static_assert(msg##_max_len <= ARGS_MAX_LEN, #msg " does not fit in ARGS_MAX_LEN"); \
+    static inline void encode_##msg(struct msg_writer *w, const struct msg *m) { \
+        FIELDS(RPC_FIELD_PUT) \
+    } \
+    static inline int pack_##msg(char *p, int codec, const struct msg *m) { \
+        int len = 0; \
+        FIELDS(RPC_FIELD_PACK) \
+        return len; \
+    } \
+    static inline int decode_##msg(struct arg_reader *r, struct msg *m) { \
+        FIELDS(RPC_FIELD_GET) \
+        return r->error ? -1 : 0; \
+    }
+
+RPC_MESSAGE(open_req, RPC_OPEN_REQ)
+RPC_MESSAGE(close_req, RPC_CLOSE_REQ)
+RPC_MESSAGE(read_req, RPC_READ_REQ)
+RPC_MESSAGE(pread_req, RPC_PREAD_REQ)
+RPC_MESSAGE(write_req, RPC_WRITE_REQ)
+RPC_MESSAGE(lseek_req, RPC_LSEEK_REQ)
+RPC_MESSAGE(stat_req, RPC_STAT_REQ)
+RPC_MESSAGE(fstat_req, RPC_FSTAT_REQ)
+RPC_MESSAGE(getdirentries_req, RPC_GETDIRENTRIES_REQ)
+RPC_MESSAGE(hello_req, RPC_HELLO_REQ)
+RPC_MESSAGE(cancel_req, RPC_CANCEL_REQ)
+RPC_MESSAGE(reply, RPC_REPLY)
+RPC_MESSAGE(getdirentries_reply, RPC_GETDIRENTRIES_REPLY)
+RPC_MESSAGE(stat_reply, RPC_STAT_REPLY)
+RPC_MESSAGE(hello_reply, RPC_HELLO_REPLY)
+
+/*
+ * Fields a stat call can ask for, statx-style
+ * The reply only carries the fields whose bit is set in its mask
+ */
+#define STAT_F_MODE    0x0001
+#define STAT_F_NLINK   0x0002
+#define STAT_F_UID     0x0004
+#define STAT_F_GID     0x0008
+#define STAT_F_SIZE    0x0010
+#define STAT_F_BLOCKS  0x0020
+#define STAT_F_BLKSIZE 0x0040
+#define STAT_F_ATIME   0x0080
+#define STAT_F_MTIME   0x0100
+#define STAT_F_CTIME   0x0200
+#define STAT_F_INO     0x0400
+#define STAT_F_DEV     0x0800
+#define STAT_F_RDEV    0x1000
+#define STAT_F_ALL     0x1fff
+
+/*
+ * Order and type of the stat fields in a reply payload
+ * A time takes two entries, seconds then nanoseconds, under one bit
+ */
+#define RPC_STAT_FIELDS(F) \
+    F(STAT_F_MODE, u32, st_mode) \
+    F(STAT_F_NLINK, u64, st_nlink) \
+    F(STAT_F_UID, u32, st_uid) \
+    F(STAT_F_GID, u32, st_gid) \
+    F(STAT_F_SIZE, i64, st_size) \
+    F(STAT_F_BLOCKS, i64, st_blocks) \
+    F(STAT_F_BLKSIZE, i64, st_blksize) \
+    F(STAT_F_ATIME, i64, st_atim.tv_sec) \
+    F(STAT_F_ATIME, u32, st_atim.tv_nsec) \
+    F(STAT_F_MTIME, i64, st_mtim.tv_sec) \
+    F(STAT_F_MTIME, u32, st_mtim.tv_nsec) \
+    F(STAT_F_CTIME, i64, st_ctim.tv_sec) \
+    F(STAT_F_CTIME, u32, st_ctim.tv_nsec) \
+    F(STAT_F_INO, u64, st_ino) \
+    F(STAT_F_DEV, u64, st_dev) \
+    F(STAT_F_RDEV, u64, st_rdev)
+
+#define RPC_STAT_FIELD_MAX(bit, type, member) + RPC_VARINT_MAX
+#define RPC_STAT_FIELD_PACK(bit, type, member) \
+    if (mask & (bit))	len += put_arg_##type(p + len, st->member, codec);
+#define RPC_STAT_FIELD_GET(bit, type, member) \
+    if (mask & (bit))	st->member = read_arg_##type(&r);
+
+enum { STAT_FIELDS_MAX_LEN = 0 RPC_STAT_FIELDS(RPC_STAT_FIELD_MAX) };
+
+/*
+ * Encode the fields of st selected by mask
+ * @param:
+ *    p: where to write, at least STAT_FIELDS_MAX_LEN bytes
+ *    codec: codec of the reply
+ * @return: number of bytes written
+ */
+static inline int pack_stat_fields(char *p, int codec, uint32_t mask, const struct stat *st) {
+    int len = 0;
+    RPC_STAT_FIELDS(RPC_STAT_FIELD_PACK)
+    return len;
+}
+
+/*
+ * Decode the fields selected by mask into st, the others are zeroed
+ * @return: 0 on success, -1 if the payload is truncated
+ */
+static inline int unpack_stat_fields(const char *p, size_t len, int codec,
+                                     uint32_t mask, struct stat *st) {
+    struct arg_reader r = {.p = p, .end = p + len, .codec = codec, .error = 0};
+    memset(st, 0, sizeof(*st));
+    RPC_STAT_FIELDS(RPC_STAT_FIELD_GET)
+    return r.error ? -1 : 0;
+}
+
+/*
+ * Exported by mylib: stat a remote path, fetching only the STAT_F_* fields
+ * in mask, such as STAT_F_SIZE | STAT_F_MTIME
+ * @return: mask of the fields filled in, -1 with errno set on error
+ */
+int stat_fields(const char *path, unsigned int mask, struct stat *stat_buf);
+
+/*
+ * Exported by mylib: stat_fields split in two, so that a tool stating many
+ * paths can send them all before waiting, paying one round trip in total
+ * stat_fields_send returns a ticket, 0 with errno set on error;
+ * stat_fields_wait takes it and returns like stat_fields.
+ * Tickets may be waited for in any order. Each half runs on its own
+ * metadeadline15440, whereas stat_fields runs both on one.
+ */
+unsigned int stat_fields_send(const char *path, unsigned int mask);
+int stat_fields_wait(unsigned int ticket, struct stat *stat_buf);
+
+/* Kinds of calls, each with its own deadline */
+#define DEADLINE_META 0 /* open, close, lseek, stat, unlink, getdirentries, getdirtree */
+#define DEADLINE_DATA 1 /* read, write */
+
+/* Deadline counters of mylib, indexed by DEADLINE_* */
+struct rpc_deadline_stats {
+    uint64_t calls[2]; /* calls made with a deadline */
+    uint64_t misses[2]; /* calls which failed with ETIMEDOUT */
+    uint64_t late_replies; /* frames dropped as their call had given up */
+};
+
+/*
+ * Exported by mylib: copy the deadline counters, see metadeadline15440
+ * and datadeadline15440
+ */
+void rpc_deadline_stats(struct rpc_deadline_stats *out);
+
+#endif
@@ -5,935 +5,186 @@
  * mystub.c
  * Implementaton of functions defined in mystub.h
  *
- * Define utility functions for mylib, the main capabilities are:
- *     1. Convert between integer type and char array
- *     2. Convert between stat struct and char array
- *     3. Convert between dirtreenode (a library data structure) struct and char array
+ * Define utility functions for mylib and server:
+ *     Convert between dirtreenode (a library data structure) struct and char array
  */
 
 #include "mystub.h"
+#include "myframe.h"
 
-#define MAXMSHLEN 2000 /* Maximum length of the marshall message */
-#define INTSIZE 13 /* Size of char representation of int */
-#define ULISIZE 26 /* Size of char representation of unsigned long */
-#define LONGSIZE 26 /* Size of char representation of long */
+#define DIRTREE_HDR 8 /* Size of node count and name bytes in front of an encoded tree */
+#define DIRTREE_NODE_HDR 6 /* Size of num_subdirs and name length in front of a node */
 
 /*
- * Convert from char array to int
- * @param: 
- *    str: char ptr to convert to
- * @return:
- *    int value of the str
- */
-int ato_int(const char *str) {
-    int len = strlen(str), i;
-    int res = 0;
-    int st = 0;
-    if (*str == '-')	st = 1;
-    for (i = st; i < len && str[i] != '|'; i++)
-        res = res * 10 + str[i] - '0';
-    if (st == 1)	res = -res;
-    return res;
-}
-
-/*
- * Convert from char array to size_t
- * @param:
- *    str: char ptr to convert to
- * @return:
- *    size_t value of the str
- */
-size_t ato_size_t(const char *str) {
-    int len = strlen(str), i;
-    size_t res = 0;
-    int st = 0;
-    if (*str == '-')	st = 1;
-    for (i = st; i < len && str[i] != '|'; i++)
-        res = res * 10 + str[i] - '0';
-    if (st == 1)	res = -res;
-    return res;
-}
-
-/*
- * Convert from char array to ssize_t
- * @param:
- *    str: char ptr to convert to
- * @return:
- *    ssize_t value of the str
- */
-ssize_t ato_ssize_t(const char *str) {
-    int len = strlen(str), i;
-    ssize_t res = 0;
-    int st = 0;
-    if (*str == '-')	st = 1;
-    for (i = st; i < len && str[i] != '|'; i++)
-        res = res * 10 + str[i] - '0';
-    if (st == 1)	res = -res;
-    return res;
-}
-
-/*
- * Convert from char array to mode_t
- * @param:
- *    str: char ptr to convert to
- * @return:
- *    mode_t value of the str
- */
-mode_t ato_mode_t(const char *str) {
-    int len = strlen(str), i;
-    mode_t res = 0;
-    int st = 0;
-    if (*str == '-')	st = 1;
-    for (i = st; i < len && str[i] != '|'; i++)
-        res = res * 10 + str[i] - '0';
-    if (st == 1)	res = -res;
-    return res;
-}
-
-/*
- * Convert from char array to off_t
- * @param:
- *    str: char ptr to convert to
- * @return:
- *    off_t value of the str
- */
-off_t ato_off_t(const char *str) {
-    int len = strlen(str), i;
-    off_t res = 0;
-    int st = 0;
-    if (*str == '-')	st = 1;
-    for (i = st; i < len && str[i] != '|'; i++)
-        res = res * 10 + str[i] - '0';
-    if (st == 1)	res = -res;
-    return res;
-}
-
-/*
- * Convert from char array to stat struct
- * each member is separated by a '\t' character
- * @param:
- *    str: char ptr to convert to
- * @return:
- *    stat struct ptr of the str
+ * Pools carved out of the single block that holds a decoded tree
  */
-struct stat *ato_stat(char *str_stat) {
-    struct stat* param = (struct stat*)malloc(sizeof(struct stat)); // parameters
-    memcpy(param, str_stat, sizeof(struct stat));
-
-    return param;
-}
+struct dirtree_arena {
+    struct dirtreenode *nodes;
+    uint32_t nodes_left;
+    struct dirtreenode **subdirs;
+    uint32_t subdirs_left;
+    char *names;
+    size_t names_left;
+};
 
 /*
- * Convert from char array to dirtreenode struct
+ * Decode one node and, recursively, its subdirectories into the arena
  * @param:
- *    str: char ptr to convert to
+ *    arena: pools to take the node, its name and its subdir array from
+ *    p: cursor into the encoded tree, advanced past the node
+ *    end: first byte past the encoded tree
  * @return:
- *    dirtreenode struct value of the str
+ *    the decoded node, NULL if the encoding is malformed
  */
-struct dirtreenode *ato_dirtreenode(char *str_dirtreenode) {
-    int i = 0;
-    struct dirtreenode *param; // parameters
-    char *traverse = str_dirtreenode;
-    int len = 0;
-    char *num_subdirs, *pivot = traverse;
-
-    param = (struct dirtreenode *)malloc(sizeof(struct dirtreenode));
-
-    while (i < 2) {
-        if (*traverse == '\t') {
-            i++;
-            if (i == 1) {
-                param->name = (char *)malloc((len + 1) * sizeof(char));
-                memcpy(param->name, pivot, len);
-                param->name[len] = '\0';
-            }
-            else {
-                num_subdirs = (char *)malloc((len + 1) * sizeof(char));
-                memcpy(num_subdirs, pivot, len);
-                num_subdirs[len] = '\0';
-            }
-            len = 0;
-            pivot = traverse + 1;
-        }
-        else {
-            len++;
-        }
-        traverse++;
+static struct dirtreenode *decode_dirtreenode(struct dirtree_arena *arena, const char **p, const char *end) {
+    if (end - *p < DIRTREE_NODE_HDR)	return NULL;
+    uint32_t num_subdirs = get_le32(*p);
+    uint16_t name_len = get_le16(*p + 4);
+    *p += DIRTREE_NODE_HDR;
+    if (end - *p < name_len || arena->nodes_left == 0 ||
+        arena->names_left < (size_t)name_len + 1 || arena->subdirs_left < num_subdirs) {
+        return NULL;
     }
-    traverse++;
 
-    param->num_subdirs = atoi(num_subdirs);
-    free(num_subdirs);
-    if (param->num_subdirs == 0)
-        param->subdirs = NULL;
-    else
-        param->subdirs = (struct dirtreenode **)malloc(param->num_subdirs * sizeof(struct dirtreenode *));
+    struct dirtreenode *param = arena->nodes++;
+    arena->nodes_left--;
+    param->name = arena->names;
+    memcpy(param->name, *p, name_len);
+    param->name[name_len] = '\0';
+    arena->names += name_len + 1;
+    arena->names_left -= name_len + 1;
+    *p += name_len;
 
-    /* Deal with sub directories */
-    /* Recursively convert subdir into char arrays with the same function */
-    int leftBrace = 1, rightBrace = 0;
-    len = 0;
-    pivot = traverse;
-    char *subDir;
-    int idx = 0;
-    while(leftBrace - rightBrace > 0) {
-        len++;
-        if (*traverse == '(') {
-            leftBrace++;
-        }
-        else if (*traverse == ')') {
-            rightBrace++;
-            if (rightBrace != 0 && leftBrace - rightBrace == 1) {
-                subDir = (char *)malloc((len + 1) * sizeof(char));
-                memcpy(subDir, pivot, len);
-                subDir[len] = '\0';
-                len = 0;
-                struct dirtreenode *node = ato_dirtreenode(subDir);
-                param->subdirs[idx++] = node;
-                free(subDir);
-                pivot = traverse + 1;
-            }
-        }
-        traverse++;
+    param->num_subdirs = (int)num_subdirs;
+    param->subdirs = NULL;
+    if (num_subdirs > 0) {
+        param->subdirs = arena->subdirs;
+        arena->subdirs += num_subdirs;
+        arena->subdirs_left -= num_subdirs;
     }
 
-    return param;
-}
-
-/*
- * Convert from char array to dev_t
- * @param:
- *    str: char ptr to convert to
- * @return:
- *    dev_t value of the str
- */
-dev_t ato_dev_t(const char *str) {
-    int len = strlen(str), i;
-    dev_t res = 0;
-    int st = 0;
-    if (*str == '-')	st = 1;
-    for (i = st; i < len && str[i] != '|'; i++)
-        res = res * 10 + str[i] - '0';
-    if (st == 1)	res = -res;
-    return res;
-}
-
-/*
- * Convert from char array to ino_t
- * @param:
- *    str: char ptr to convert to
- * @return:
- *    ino_t value of the str
- */
-ino_t ato_ino_t(const char *str) {
-    int len = strlen(str), i;
-    ino_t res = 0;
-    int st = 0;
-    if (*str == '-')	st = 1;
-    for (i = st; i < len && str[i] != '|'; i++)
-        res = res * 10 + str[i] - '0';
-    if (st == 1)	res = -res;
-    return res;
-}
-
-/*
- * Convert from char array to nlink_t
- * @param:
- *    str: char ptr to convert to
- * @return:
- *    nlink_t value of the str
- */
-nlink_t ato_nlink_t(const char *str) {
-    int len = strlen(str), i;
-    nlink_t res = 0;
-    int st = 0;
-    if (*str == '-')	st = 1;
-    for (i = st; i < len && str[i] != '|'; i++)
-        res = res * 10 + str[i] - '0';
-    if (st == 1)	res = -res;
-    return res;
-}
-
-/*
- * Convert from char array to uid_t
- * @param:
- *    str: char ptr to convert to
- * @return:
- *    uid_t value of the str
- */
-uid_t ato_uid_t(const char *str) {
-    int len = strlen(str), i;
-    uid_t res = 0;
-    int st = 0;
-    if (*str == '-')	st = 1;
-    for (i = st; i < len && str[i] != '|'; i++)
-        res = res * 10 + str[i] - '0';
-    if (st == 1)	res = -res;
-    return res;
-}
-
-/*
- * Convert from char array to gid_t
- * @param:
- *    str: char ptr to convert to
- * @return:
- *    gid_t value of the str
- */
-gid_t ato_gid_t(const char *str) {
-    int len = strlen(str), i;
-    gid_t res = 0;
-    int st = 0;
-    if (*str == '-')	st = 1;
-    for (i = st; i < len && str[i] != '|'; i++)
-        res = res * 10 + str[i] - '0';
-    if (st == 1)	res = -res;
-    return res;
-}
-
-/*
- * Convert from char array to blksize_t
- * @param:
- *    str: char ptr to convert to
- * @return:
- *    blksize_t value of the str
- */
-blksize_t ato_blksize_t(const char *str) {
-    int len = strlen(str), i;
-    blksize_t res = 0;
-    int st = 0;
-    if (*str == '-')	st = 1;
-    for (i = st; i < len && str[i] != '|'; i++)
-        res = res * 10 + str[i] - '0';
-    if (st == 1)	res = -res;
-    return res;
-}
-
-/*
- * Convert from char array to blkcnt_t
- * @param:
- *    str: char ptr to convert to
- * @return:
- *    blkcnt_t value of the str
- */
-blkcnt_t ato_blkcnt_t(const char *str) {
-    int len = strlen(str), i;
-    blkcnt_t res = 0;
-    int st = 0;
-    if (*str == '-')	st = 1;
-    for (i = st; i < len && str[i] != '|'; i++)
-        res = res * 10 + str[i] - '0';
-    if (st == 1)	res = -res;
-    return res;
-}
-
-/*
- * Convert from char array to time_t
- * @param:
- *    str: char ptr to convert to
- * @return:
- *    time_t value of the str
- */
-time_t ato_time_t(const char *str) {
-    int len = strlen(str), i;
-    time_t res = 0;
-    int st = 0;
-    if (*str == '-')	st = 1;
-    for (i = st; i < len && str[i] != '|'; i++)
-        res = res * 10 + str[i] - '0';
-    if (st == 1)	res = -res;
-    return res;
-}
-
-/*
- * Convert from int to char array
- * @param:
- *    str: int to convert to
- * @return:
- *    char arry of the conversion
- */
-char *int_to_str(int num) {
-
-    int type_size = INTSIZE;
-    char *str = (char *)malloc(type_size * sizeof(char));
-    str[type_size-1] = '\0';
-    int cnt = 0;
-    int negative = 0;
-
-    // if num is negative, first make it positive
-    if (num < 0) {
-        negative = 1;
-        num = -num;
+    /* Subdirectories follow their parent in pre-order */
+    uint32_t i;
+    for (i = 0; i < num_subdirs; i++) {
+        param->subdirs[i] = decode_dirtreenode(arena, p, end);
+        if (param->subdirs[i] == NULL)	return NULL;
     }
-    if (num == 0) {
-        str[0] = '0';
-        str[1] = '\0';
-        return str;
-    }
-    while (num) {
-        str[type_size-2-cnt] = num % 10 + '0';
-        num /= 10;
-        cnt++;
-    }
-    // add negative number sign byte
-    if (negative == 1) {
-        str[type_size-2-cnt] = '-';
-        cnt++;
-    }
-    int i;
-    for (i = 0; i <= cnt; i++) {
-        str[i] = str[type_size-1-cnt + i];
-    }
-    return str;
-}
-
-/*
- * Convert from size_t to char array
- * @param:
- *    str: size_t to convert to
- * @return:
- *    char arry of the conversion
- */
-char *size_t_to_str(size_t num) {
-
-    int type_size = ULISIZE;
-    char *str = (char *)malloc(type_size * sizeof(char));
-    str[type_size-1] = '\0';
-    int cnt = 0;
-
-    if (num == 0) {
-        str[0] = '0';
-        str[1] = '\0';
-        return str;
-    }
-    while (num) {
-        str[type_size-2-cnt] = num % 10 + '0';
-        num /= 10;
-        cnt++;
-    }
-    // add negative number sign byte
-    if (negative == 1) {
-        str[type_size-2-cnt] = '-';
-        cnt++;
-    }
-    int i;
-    for (i = 0; i <= cnt; i++) {
-        str[i] = str[type_size-1-cnt + i];
-    }
-    return str;
+    return param;
 }
 
 /*
- * Convert from ssize_t to char array
+ * Convert from the encoding produced by dirtreenode_to_buf to dirtreenode struct
+ * All nodes, pointer arrays and name strings are placed in one block
+ * sized from the counts at the front of the encoding. The root node is
+ * the start of that block, so free() on the root releases the whole tree.
  * @param:
- *    str: ssize_t to convert to
+ *    str: encoded tree
+ *    len: length of the encoding
  * @return:
- *    char arry of the conversion
+ *    dirtreenode struct of the root, NULL if the encoding is malformed
  */
-char *ssize_t_to_str(ssize_t num) {
+struct dirtreenode *ato_dirtreenode(const char *str, size_t len) {
+    if (len < DIRTREE_HDR)	return NULL;
+    uint32_t nodes = get_le32(str);
+    uint32_t names = get_le32(str + 4);
+    const char *p = str + DIRTREE_HDR;
+    const char *end = str + len;
 
-    int type_size = ULISIZE;
-    char *str = (char *)malloc(type_size * sizeof(char));
-    str[type_size-1] = '\0';
-    int cnt = 0;
-    int negative = 0;
-
-    // if num is negative, first make it positive
-    if (num < 0) {
-        negative = 1;
-        num = -num;
-    }
-    if (num == 0) {
-        str[0] = '0';
-        str[1] = '\0';
-        return str;
-    }
-    while (num) {
-        str[type_size-2-cnt] = num % 10 + '0';
-        num /= 10;
-        cnt++;
-    }
-    // add negative number sign byte
-    if (negative == 1) {
-        str[type_size-2-cnt] = '-';
-        cnt++;
+    /* every node takes at least a header and a NUL, reject counts the data cannot hold */
+    if (nodes == 0 || nodes > (len - DIRTREE_HDR) / DIRTREE_NODE_HDR ||
+        names < nodes || names - nodes > len - DIRTREE_HDR) {
+        return NULL;
     }
-    int i;
-    for (i = 0; i <= cnt; i++) {
-        str[i] = str[type_size-1-cnt + i];
-    }
-    return str;
-}
-
-/*
- * Convert from mode_t to char array
- * @param:
- *    str: mode_t to convert to
- * @return:
- *    char arry of the conversion
- */
-char *mode_t_to_str(mode_t num) {
 
-    int type_size = ULISIZE;
-    char *str = (char *)malloc(type_size * sizeof(char));
-    str[type_size-1] = '\0';
-    int cnt = 0;
-    int negative = 0;
+    size_t node_bytes = nodes * sizeof(struct dirtreenode);
+    size_t subdir_bytes = (nodes - 1) * sizeof(struct dirtreenode *);
+    char *block = (char *)malloc(node_bytes + subdir_bytes + names);
+    if (block == NULL)	return NULL;
 
-    // if num is negative, first make it positive
-    if (num < 0) {
-        negative = 1;
-        num = -num;
-    }
-    if (num == 0) {
-        str[0] = '0';
-        str[1] = '\0';
-        return str;
-    }
-    while (num) {
+    struct dirtree_arena arena;
+    arena.nodes = (struct dirtreenode *)block;
+    arena.nodes_left = nodes;
+    arena.subdirs = (struct dirtreenode **)(block + node_bytes);
+    arena.subdirs_left = nodes - 1;
+    arena.names = block + node_bytes + subdir_bytes;
+    arena.names_left = names;
 
-        str[type_size-2-cnt] = num % 10 + '0';
-        num /= 10;
-        cnt++;
-    }
-    // add negative number sign byte
-    if (negative == 1) {
-        str[type_size-2-cnt] = '-';
-        cnt++;
+    struct dirtreenode *root = decode_dirtreenode(&arena, &p, end);
+    if (root == NULL) {
+        free(block);
+        return NULL;
     }
-    int i;
-    for (i = 0; i <= cnt; i++) {
-        str[i] = str[type_size-1-cnt + i];
-    }
-    return str;
+    return root;
 }
 
 /*
- * Convert from off_t to char array
+ * Size the encoding of a subtree
  * @param:
- *    str: off_t to convert to
+ *    node: root of the subtree
+ *    nodes: incremented by the number of nodes in the subtree
+ *    names: incremented by the bytes needed to hold its NUL-terminated names
  * @return:
- *    char arry of the conversion
+ *    number of bytes the subtree takes once encoded
  */
-char *off_t_to_str(off_t num) {
-
-    int type_size = ULISIZE;
-    char *str = (char *)malloc(type_size * sizeof(char));
-    str[type_size-1] = '\0';
-    int cnt = 0;
-    int negative = 0;
-
-    // if num is negative, first make it positive
-    if (num < 0) {
-        negative = 1;
-        num = -num;
-    }
-    if (num == 0) {
-        str[0] = '0';
-        str[1] = '\0';
-        return str;
-    }
-    while (num) {
-        str[type_size-2-cnt] = num % 10 + '0';
-        num /= 10;
-        cnt++;
-    }
-    // add negative number sign byte
-    if (negative == 1) {
-        str[type_size-2-cnt] = '-';
-        cnt++;
-    }
+static size_t dirtreenode_size(struct dirtreenode *node, uint32_t *nodes, uint32_t *names) {
+    size_t name_len = strlen(node->name);
+    size_t size = DIRTREE_NODE_HDR + name_len;
     int i;
-    for (i = 0; i <= cnt; i++) {
-        str[i] = str[type_size-1-cnt + i];
-    }
-    return str;
-}
-
-char *char_to_str(char* str) {
-    return str;
-}
 
-char *voidptr_to_str(void *ptr) {
-    return (char *)ptr;
-}
-
-/*
- * Convert from stat struct to char array
- * @param:
- *    str: stat struct to convert to
- * @return:
- *    char arry of the conversion
- */
-char *statptr_to_str(struct stat *buf) {
-    char *str = (char *)malloc(MAXMSHLEN * sizeof(char));
-    memcpy(str, buf, sizeof(struct stat));
-    
-    return str;
-}
-
-/*
- * Convert from dirtreenode to char array
- * @param:
- *    str: dirtreenode to convert to
- * @return:
- *    char arry of the conversion
- */
-char *dirtreenode_to_str(struct dirtreenode* node) {
-    int i;
-    char *str = (char *)malloc(MAXMSHLEN * sizeof(char));
-    strcpy(str, node->name);
-    strcat(str, "\t");
-    char *num_subdirs_str = int_to_str(node->num_subdirs);
-    strcat(str, num_subdirs_str);
-    free(num_subdirs_str);
-    strcat(str, "\t(");
+    (*nodes)++;
+    *names += name_len + 1;
     for (i = 0; i < node->num_subdirs; i++) {
-        char *subtree_str = dirtreenode_to_str(node->subdirs[i]);
-        strcat(str, subtree_str);
-        free(subtree_str);
-    }
-    strcat(str, ")");
-    return str;
-}
-
-/*
- * Convert from dev_t to char array
- * @param:
- *    str: dev_t to convert to
- * @return:
- *    char arry of the conversion
- */
-char *dev_t_to_str(dev_t num) {
-
-    int type_size = ULISIZE;
-    char *str = (char *)malloc(type_size * sizeof(char));
-    str[type_size-1] = '\0';
-    int cnt = 0;
-    int negative = 0;
-
-    // if num is negative, first make it positive
-    if (num < 0) {
-        negative = 1;
-        num = -num;
-    }
-    if (num == 0) {
-        str[0] = '0';
-        str[1] = '\0';
-        return str;
+        size += dirtreenode_size(node->subdirs[i], nodes, names);
     }
-    while (num) {
-        str[type_size-2-cnt] = num % 10 + '0';
-        num /= 10;
-        cnt++;
-    }
-    // add negative number sign byte
-    if (negative == 1) {
-        str[type_size-2-cnt] = '-';
-        cnt++;
-    }
-    int i;
-    for (i = 0; i <= cnt; i++) {
-        str[i] = str[type_size-1-cnt + i];
-    }
-    return str;
+    return size;
 }
 
 /*
- * Convert from ino_t to char array
+ * Encode a subtree in pre-order
  * @param:
- *    str: ino_t to convert to
+ *    node: root of the subtree
+ *    p: where to write, the buffer is known to be large enough
+ *    nodes, names: counted as by dirtreenode_size
  * @return:
- *    char arry of the conversion
+ *    ptr past the last byte written
  */
-char *ino_t_to_str(ino_t num) {
-
-    int type_size = ULISIZE;
-    char *str = (char *)malloc(type_size * sizeof(char));
-    str[type_size-1] = '\0';
-    int cnt = 0;
-    int negative = 0;
-
-    // if num is negative, first make it positive
-    if (num < 0) {
-        negative = 1;
-        num = -num;
-    }
-    if (num == 0) {
-        str[0] = '0';
-        str[1] = '\0';
-        return str;
-    }
-    while (num) {
-        str[type_size-2-cnt] = num % 10 + '0';
-        num /= 10;
-        cnt++;
-    }
-    // add negative number sign byte
-    if (negative == 1) {
-        str[type_size-2-cnt] = '-';
-        cnt++;
-    }
+static char *encode_dirtreenode(struct dirtreenode *node, char *p, uint32_t *nodes, uint32_t *names) {
+    size_t name_len = strlen(node->name);
     int i;
-    for (i = 0; i <= cnt; i++) {
-        str[i] = str[type_size-1-cnt + i];
-    }
-    return str;
-}
 
-/*
- * Convert from nlink_t to char array
- * @param:
- *    str: nlink_t to convert to
- * @return:
- *    char arry of the conversion
- */
-char *nlink_t_to_str(nlink_t num) {
-
-    int type_size = ULISIZE;
-    char *str = (char *)malloc(type_size * sizeof(char));
-    str[type_size-1] = '\0';
-    int cnt = 0;
-    int negative = 0;
-    
-    // if num is negative, first make it positive
-    if (num < 0) {
-        negative = 1;
-        num = -num;
-    }
-    if (num == 0) {
-        str[0] = '0';
-        str[1] = '\0';
-        return str;
-    }
-    while (num) {
-        str[type_size-2-cnt] = num % 10 + '0';
-        num /= 10;
-        cnt++;
-    }
-    // add negative number sign byte
-    if (negative == 1) {
-        str[type_size-2-cnt] = '-';
-        cnt++;
-    }
-    int i;
-    for (i = 0; i <= cnt; i++) {
-        str[i] = str[type_size-1-cnt + i];
-    }
-    return str;
-}
-
-/*
- * Convert from uid_t to char array
- * @param:
- *    str: uid_t to convert to
- * @return:
- *    char arry of the conversion
- */
-char *uid_t_to_str(uid_t num) {
-
-    int type_size = ULISIZE;
-    char *str = (char *)malloc(type_size * sizeof(char));
-    str[type_size-1] = '\0';
-    int cnt = 0;
-    int negative = 0;
-
-    // if num is negative, first make it positive
-    if (num < 0) {
-        negative = 1;
-        num = -num;
-    }
-    if (num == 0) {
-        str[0] = '0';
-        str[1] = '\0';
-        return str;
-    }
-    while (num) {
-        str[type_size-2-cnt] = num % 10 + '0';
-        num /= 10;
-        cnt++;
-    }
-    // add negative number sign byte
-    if (negative == 1) {
-        str[type_size-2-cnt] = '-';
-        cnt++;
-    }
-    int i;
-    for (i = 0; i <= cnt; i++) {
-        str[i] = str[type_size-1-cnt + i];
-    }
-    return str;
-}
-
-/*
- * Convert from gid_t to char array
- * @param:
- *    str: gid_t to convert to
- * @return:
- *    char arry of the conversion
- */
-char *gid_t_to_str(gid_t num) {
-
-    int type_size = ULISIZE;
-    char *str = (char *)malloc(type_size * sizeof(char));
-    str[type_size-1] = '\0';
-    int cnt = 0;
-    int negative = 0;
-
-    // if num is negative, first make it positive
-    if (num < 0) {
-        negative = 1;
-        num = -num;
-    }
-    if (num == 0) {
-        str[0] = '0';
-        str[1] = '\0';
-        return str;
-    }
-    while (num) {
-        str[type_size-2-cnt] = num % 10 + '0';
-        num /= 10;
-        cnt++;
-    }
-    // add negative number sign byte
-    if (negative == 1) {
-        str[type_size-2-cnt] = '-';
-        cnt++;
-    }
-    int i;
-    for (i = 0; i <= cnt; i++) {
-        str[i] = str[type_size-1-cnt + i];
-    }
-    return str;
-}
-
-/*
- * Convert from blksize_t to char array
- * @param:
- *    str: blksize_t to convert to
- * @return:
- *    char arry of the conversion
- */
-char *blksize_t_to_str(blksize_t num) {
-
-    int type_size = ULISIZE;
-    char *str = (char *)malloc(type_size * sizeof(char));
-    str[type_size-1] = '\0';
-    int cnt = 0;
-    int negative = 0;
-
-    // if num is negative, first make it positive
-    if (num < 0) {
-        negative = 1;
-        num = -num;
-    }
-    if (num == 0) {
-        str[0] = '0';
-        str[1] = '\0';
-        return str;
-    }
-    while (num) {
-        str[type_size-2-cnt] = num % 10 + '0';
-        num /= 10;
-        cnt++;
-    }
-    // add negative number sign byte
-    if (negative == 1) {
-        str[type_size-2-cnt] = '-';
-        cnt++;
-    }
-    int i;
-    for (i = 0; i <= cnt; i++) {
-        str[i] = str[type_size-1-cnt + i];
+    (*nodes)++;
+    *names += name_len + 1;
+    put_le32(p, (uint32_t)node->num_subdirs);
+    put_le16(p + 4, (uint16_t)name_len);
+    memcpy(p + DIRTREE_NODE_HDR, node->name, name_len);
+    p += DIRTREE_NODE_HDR + name_len;
+    for (i = 0; i < node->num_subdirs; i++) {
+        p = encode_dirtreenode(node->subdirs[i], p, nodes, names);
     }
-    return str;
+    return p;
 }
 
 /*
- * Convert from blkcnt_t to char array
- * @param:
- *    str: blkcnt_t to convert to
  * @return:
- *    char arry of the conversion
+ *    length of the encoding of a tree
  */
-char *blkcnt_t_to_str(blkcnt_t num) {
-
-    int type_size = ULISIZE;
-    char *str = (char *)malloc(type_size * sizeof(char));
-    str[type_size-1] = '\0';
-    int cnt = 0;
-    int negative = 0;
-
-    // if num is negative, first make it positive
-    if (num < 0) {
-        negative = 1;
-        num = -num;
-    }
-    if (num == 0) {
-        str[0] = '0';
-        str[1] = '\0';
-        return str;
-    }
-    while (num) {
-        str[type_size-2-cnt] = num % 10 + '0';
-        num /= 10;
-        cnt++;
-    }
-    // add negative number sign byte
-    if (negative == 1) {
-        str[type_size-2-cnt] = '-';
-        cnt++;
-    }
-    int i;
-    for (i = 0; i <= cnt; i++) {
-        str[i] = str[type_size-1-cnt + i];
-    }
-    return str;
+size_t dirtreenode_str_len(struct dirtreenode *node) {
+    uint32_t nodes = 0, names = 0;
+    return DIRTREE_HDR + dirtreenode_size(node, &nodes, &names);
 }
 
 /*
- * Convert from time_t to char array
+ * Encode a tree into a buffer of the caller, sized with dirtreenode_str_len
+ * The tree is encoded in one pass as
+ *     u32 node count, u32 bytes of NUL-terminated names,
+ *     then for every node in pre-order: u32 num_subdirs, u16 name length, name
  * @param:
- *    str: time_t to convert to
- * @return:
- *    char arry of the conversion
+ *    buf: at least dirtreenode_str_len(node) bytes
  */
-char *time_t_to_str(time_t num) {
+void dirtreenode_to_buf(struct dirtreenode *node, char *buf) {
+    uint32_t nodes = 0, names = 0;
 
-    int type_size = ULISIZE;
-    char *str = (char *)malloc(type_size * sizeof(char));
-    str[type_size-1] = '\0';
-    int cnt = 0;
-    int negative = 0;
-
-    // if num is negative, first make it positive
-    if (num < 0) {
-        negative = 1;
-        num = -num;
-    }
-    if (num == 0) {
-        str[0] = '0';
-        str[1] = '\0';
-        return str;
-    }
-    while (num) {
-        str[type_size-2-cnt] = num % 10 + '0';
-        num /= 10;
-        cnt++;
-    }
-    // add negative number sign byte
-    if (negative == 1) {
-        str[type_size-2-cnt] = '-';
-        cnt++;
-    }
-    int i;
-    for (i = 0; i <= cnt; i++) {
-        str[i] = str[type_size-1-cnt + i];
-    }
-    return str;
+    encode_dirtreenode(node, buf + DIRTREE_HDR, &nodes, &names);
+    put_le32(buf, nodes);
+    put_le32(buf + 4, names);
 }
-
-void check_param_type(const char *subtoken, const char *type, const char* func_name) {
-    if (strcmp(subtoken, type) != 0) {
-        fprintf(stderr, "%s: parameter type should be %s\n", func_name, type);
-    }
-}
\ No newline at end of file
@@ -0,0 +1,616 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * mytransport.c
+ * Implementation of the transports defined in mytransport.h
+ *
+ * A shm ring is a byte stream: the producer advances head after copying
+ * bytes in, the consumer advances tail after copying them out, each side
+ * only ever writing its own counter. Both sides spin briefly when the ring
+ * is full or empty, then sleep on a futex word the other side bumps after
+ * every move. The sleep is bounded, so a peer which died without closing
+ * is noticed through its socket.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/futex.h>
+#include "mytransport.h"
+#include "myframe.h"
+#include "mynetem.h"
+
+#define SHM_MAGIC 0x31353434 /* Marks a region set up by mylib */
+#define SHM_SPIN 4096 /* Polls of the futex word before sleeping on it */
+#define SHM_SLEEP_NS 100000000 /* Longest sleep before checking the peer */
+
+/* One direction of a shm connection */
+struct shm_ring {
+    /* written by the producer */
+    uint64_t head __attribute__((aligned(64))); /* bytes produced so far */
+    uint32_t head_seq; /* futex word, bumped whenever head moves */
+    uint32_t head_waiters; /* consumers sleeping on head_seq */
+    uint32_t closed; /* set once the producer is gone */
+    /* written by the consumer */
+    uint64_t tail __attribute__((aligned(64))); /* bytes consumed so far */
+    uint32_t tail_seq; /* futex word, bumped whenever tail moves */
+    uint32_t tail_waiters; /* producers sleeping on tail_seq */
+    char data[SHM_RING_SIZE] __attribute__((aligned(64)));
+};
+
+/* Shared memory of a shm connection, created by mylib */
+struct shm_region {
+    uint32_t magic;
+    struct shm_ring ring[2]; /* [0] carries requests, [1] carries replies */
+};
+
+/*
+ * @return: TRANSPORT_* named by transport15440, TRANSPORT_TCP if unset
+ */
+int transport_from_env(void) {
+    char *name = getenv("transport15440");
+    if (name == NULL)	return TRANSPORT_TCP;
+    if (strcmp(name, "unix") == 0)	return TRANSPORT_UNIX;
+    if (strcmp(name, "shm") == 0)	return TRANSPORT_SHM;
+    if (strcmp(name, "tcp") != 0) {
+        fprintf(stderr, "Unknown transport15440 %s.  Using tcp\n", name);
+    }
+    return TRANSPORT_TCP;
+}
+
+/*
+ * @return: name of a transport, for messages
+ */
+const char *transport_name(int kind) {
+    switch (kind) {
+    case TRANSPORT_UNIX:	return "unix";
+    case TRANSPORT_SHM:	return "shm";
+    default:	return "tcp";
+    }
+}
+
+/*
+ * Fill in the address of the unix socket of the server
+ * socket15440 overrides the default path derived from the port
+ */
+static void unix_address(struct sockaddr_un *addr, unsigned short port) {
+    char *path = getenv("socket15440");
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path) {
+        strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+    } else {
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/server15440-%u.sock", port);
+    }
+}
+
+static ssize_t link_send_iov(void *ctx, struct iovec *iov, int iovcnt);
+
+static struct conn *new_conn(int kind, int fd) {
+    struct conn *c = (struct conn *)calloc(1, sizeof(struct conn));
+    if (c == NULL)	return NULL;
+    c->kind = kind;
+    c->fd = fd;
+    c->em = netem_from_env(link_send_iov, c);
+    return c;
+}
+
+/*
+ * Create the rings of a shm connection and hand them to the server
+ * @return: 0 on success, -1 on error
+ */
+static int shm_offer(struct conn *c) {
+    int memfd = memfd_create("rpc15440", MFD_CLOEXEC);
+    if (memfd < 0)	return -1;
+    if (ftruncate(memfd, sizeof(struct shm_region)) < 0) {
+        close(memfd);
+        return -1;
+    }
+    struct shm_region *shm = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, memfd, 0);
+    if (shm == MAP_FAILED) {
+        close(memfd);
+        return -1;
+    }
+    shm->magic = SHM_MAGIC; // the rest of a new memfd reads as zero
+
+    // one byte carrying the memfd
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    memset(control, 0, sizeof(control));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &memfd, sizeof(int));
+
+    ssize_t sd = sendmsg(c->fd, &mh, MSG_NOSIGNAL);
+    close(memfd); // the mapping stays
+    if (sd != 1) {
+        munmap(shm, sizeof(struct shm_region));
+        return -1;
+    }
+    c->shm = shm;
+    c->tx = &shm->ring[0];
+    c->rx = &shm->ring[1];
+    return 0;
+}
+
+/*
+ * Client: connect to the server
+ * @param:
+ *    kind: TRANSPORT_*
+ *    host: server ip address, only used by tcp
+ *    port: server port, also names the default socket path
+ * @return: new connection, NULL with errno set on error
+ */
+struct conn *conn_connect(int kind, const char *host, unsigned short port) {
+    int fd, rv;
+
+    if (kind == TRANSPORT_TCP) {
+        struct sockaddr_in srv;
+        fd = socket(AF_INET, SOCK_STREAM, 0);       // TCP/IP socket
+        if (fd < 0)	return NULL;
+
+        // setup address structure to point to server
+        memset(&srv, 0, sizeof(srv));
+        srv.sin_family = AF_INET;
+        srv.sin_addr.s_addr = inet_addr(host);
+        srv.sin_port = htons(port);
+        rv = connect(fd, (struct sockaddr *)&srv, sizeof(srv));
+
+        // requests are pipelined, so small frames must not wait for acks
+        int one = 1;
+        if (rv == 0)	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    } else {
+        struct sockaddr_un addr;
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)	return NULL;
+        unix_address(&addr, port);
+        rv = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+
+    struct conn *c = rv == 0 ? new_conn(kind, fd) : NULL;
+    if (c != NULL && kind == TRANSPORT_SHM && shm_offer(c) < 0) {
+        netem_close(c->em);
+        free(c);
+        c = NULL;
+    }
+    if (c == NULL) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    return c;
+}
+
+/*
+ * Server: listen for connections
+ * tcp listens on every address; unix and shm replace a stale socket file
+ * @return: listening socket, -1 on error
+ */
+int conn_listen(int kind, unsigned short port, int reuseport) {
+    int fd, rv;
+
+    if (kind == TRANSPORT_TCP) {
+        struct sockaddr_in srv;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)	return -1;
+        int one = 1;
+        // a restarted server binds again while connections of the last one linger in TIME_WAIT
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+            (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)) {
+            close(fd);
+            return -1;
+        }
+
+        // Setup address structure to indicate server port
+        memset(&srv, 0, sizeof(srv));
+        srv.sin_family = AF_INET;
+        srv.sin_addr.s_addr = htonl(INADDR_ANY);
+        srv.sin_port = htons(port);
+        rv = bind(fd, (struct sockaddr *)&srv, sizeof(srv));
+    } else {
+        struct sockaddr_un addr;
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)	return -1;
+        unix_address(&addr, port);
+        unlink(addr.sun_path);
+        rv = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    if (rv < 0 || listen(fd, 127) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Server: accept the next connection, without waiting for its handshake
+ * @return: new connection, NULL on error
+ */
+struct conn *conn_accept(int kind, int listenfd) {
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd < 0)	return NULL;
+    if (kind == TRANSPORT_TCP) {
+        // replies are pipelined, so small frames must not wait for acks
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    struct conn *c = new_conn(kind, fd);
+    if (c == NULL)	close(fd);
+    return c;
+}
+
+/*
+ * Server: map the rings a shm client sends, nothing to do for sockets
+ * @return: 0 on success, -1 on error
+ */
+int conn_handshake(struct conn *c) {
+    if (c->kind != TRANSPORT_SHM)	return 0;
+
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    ssize_t rv;
+    do {
+        rv = recvmsg(c->fd, &mh, MSG_CMSG_CLOEXEC);
+    } while (rv < 0 && errno == EINTR);
+    struct cmsghdr *cm = rv == 1 ? CMSG_FIRSTHDR(&mh) : NULL;
+    if (cm == NULL || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+        errno = EPROTO;
+        return -1;
+    }
+    int memfd;
+    memcpy(&memfd, CMSG_DATA(cm), sizeof(int));
+
+    // the client controls the region: only its size and magic are checked here,
+    // the ring indices it can rewrite at any time are checked on every access
+    struct stat st;
+    struct shm_region *shm = MAP_FAILED;
+    if (fstat(memfd, &st) == 0 && (size_t)st.st_size >= sizeof(struct shm_region)) {
+        shm = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    }
+    close(memfd);
+    if (shm == MAP_FAILED || shm->magic != SHM_MAGIC) {
+        if (shm != MAP_FAILED)	munmap(shm, sizeof(struct shm_region));
+        errno = EPROTO;
+        return -1;
+    }
+    c->shm = shm;
+    c->tx = &shm->ring[1];
+    c->rx = &shm->ring[0];
+    return 0;
+}
+
+/*
+ * @return: 1 unless the socket of the peer reports it hung up
+ */
+static int peer_alive(struct conn *c) {
+    struct pollfd pfd = {.fd = c->fd, .events = POLLIN | POLLRDHUP};
+    if (poll(&pfd, 1, 0) <= 0)	return 1;
+    return !(pfd.revents & (POLLHUP | POLLRDHUP | POLLERR));
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Wait for the other side to bump a futex word past seen
+ * Spins first, as the other side usually answers within microseconds,
+ * unless there is a single cpu, where spinning only delays the other side
+ * @param:
+ *    deadline: CLOCK_MONOTONIC ns the sleep is cut short at, 0 for none
+ * @return: 0 once woken or after a bounded sleep, -1 if the peer is gone
+ *    or the deadline passed (ETIMEDOUT)
+ */
+static int ring_wait(struct conn *c, uint32_t *word, uint32_t *waiters, uint32_t seen, uint64_t deadline) {
+    static int spin = -1;
+    int i;
+
+    if (spin < 0)	spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+    for (i = 0; i < spin; i++) {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen)	return 0;
+    }
+
+    uint64_t sleep = SHM_SLEEP_NS;
+    if (deadline) {
+        uint64_t now = monotonic_ns();
+        if (now >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (deadline - now < sleep)	sleep = deadline - now;
+    }
+    struct timespec ts = {.tv_sec = sleep / 1000000000ull, .tv_nsec = sleep % 1000000000ull};
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    long rv = syscall(SYS_futex, word, FUTEX_WAIT, seen, &ts, NULL, 0);
+    int saved = errno;
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    if (rv < 0 && saved == ETIMEDOUT && !peer_alive(c)) {
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Bump a futex word, waking the other side if it sleeps on it
+ */
+static void ring_wake(uint32_t *word, uint32_t *waiters) {
+    __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/*
+ * Check a snapshot of ring indices, which the other side can overwrite
+ * @return: 1 if head is at most SHM_RING_SIZE bytes ahead of tail
+ */
+static inline int ring_sane(uint64_t head, uint64_t tail) {
+    return head >= tail && head - tail <= SHM_RING_SIZE;
+}
+
+/*
+ * Copy a buffer into the ring this side produces into, waiting for room
+ * until deadline (CLOCK_MONOTONIC ns, 0 for none)
+ * @return: 0 on success, -1 if the peer is gone, corrupted the ring (EPROTO)
+ *    or the deadline passed (ETIMEDOUT)
+ */
+static int ring_put(struct conn *c, const char *src, size_t len, uint64_t deadline) {
+    struct shm_ring *r = c->tx;
+
+    while (len > 0) {
+        uint32_t seen = __atomic_load_n(&r->tail_seq, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (!ring_sane(head, tail)) {
+            errno = EPROTO;
+            return -1;
+        }
+        uint64_t room = SHM_RING_SIZE - (head - tail);
+        if (room == 0) {
+            if (__atomic_load_n(&c->rx->closed, __ATOMIC_ACQUIRE)) {
+                errno = EPIPE;
+                return -1;
+            }
+            if (ring_wait(c, &r->tail_seq, &r->tail_waiters, seen, deadline) < 0)	return -1;
+            continue;
+        }
+
+        size_t n = len < room ? len : room;
+        size_t at = head % SHM_RING_SIZE;
+        size_t first = n < SHM_RING_SIZE - at ? n : SHM_RING_SIZE - at;
+        memcpy(r->data + at, src, first);
+        memcpy(r->data, src + first, n - first);
+        __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+        ring_wake(&r->head_seq, &r->head_waiters);
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Copy bytes out of the ring this side consumes from, waiting for them
+ * @return: len, 0 if the peer closed before the first byte, -1 on error
+ */
+static ssize_t ring_get(struct conn *c, char *dst, size_t len) {
+    struct shm_ring *r = c->rx;
+    size_t got = 0;
+
+    while (got < len) {
+        uint32_t seen = __atomic_load_n(&r->head_seq, __ATOMIC_ACQUIRE);
+        uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (!ring_sane(head, tail)) {
+            errno = EPROTO;
+            return -1;
+        }
+        uint64_t avail = head - tail;
+        if (avail == 0) {
+            if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+                if (got == 0)	return 0;
+                errno = EPROTO;
+                return -1;
+            }
+            if (ring_wait(c, &r->head_seq, &r->head_waiters, seen, 0) < 0)	return -1;
+            continue;
+        }
+
+        size_t n = len - got < avail ? len - got : avail;
+        size_t at = tail % SHM_RING_SIZE;
+        size_t first = n < SHM_RING_SIZE - at ? n : SHM_RING_SIZE - at;
+        memcpy(dst + got, r->data + at, first);
+        memcpy(dst + got + first, r->data, n - first);
+        __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+        ring_wake(&r->tail_seq, &r->tail_waiters);
+        got += n;
+    }
+    return got;
+}
+
+/*
+ * Send the bytes of several buffers over the transport itself
+ * @param:
+ *    deadline: CLOCK_MONOTONIC ns to give up at, 0 for none
+ * @return: number of bytes sent, -1 if error occurred
+ */
+static ssize_t link_send(struct conn *c, struct iovec *iov, int iovcnt, uint64_t deadline) {
+    if (c->shm == NULL)	return send_iov(c->fd, iov, iovcnt, deadline);
+
+    ssize_t total = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        if (ring_put(c, (const char *)iov[i].iov_base, iov[i].iov_len, deadline) < 0)	return -1;
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/*
+ * Send what netem15440 let through once due, over the transport itself
+ */
+static ssize_t link_send_iov(void *ctx, struct iovec *iov, int iovcnt) {
+    return link_send((struct conn *)ctx, iov, iovcnt, 0);
+}
+
+/*
+ * Send the bytes of several buffers, in order, in full
+ * With netem15440 set they are only queued to go out once due
+ * @return: number of bytes sent, -1 if error occurred
+ */
+ssize_t conn_send_iov(struct conn *c, struct iovec *iov, int iovcnt) {
+    return conn_send_iov_until(c, iov, iovcnt, 0);
+}
+
+/*
+ * Send the bytes of several buffers, in order, in full, until a deadline
+ * @return: number of bytes sent, -1 if error occurred, with errno ETIMEDOUT
+ *    if the deadline passed, maybe after part of them went out
+ */
+ssize_t conn_send_iov_until(struct conn *c, struct iovec *iov, int iovcnt, uint64_t deadline) {
+    if (c->em != NULL)	return netem_send(c->em, iov, iovcnt, deadline);
+    return link_send(c, iov, iovcnt, deadline);
+}
+
+/*
+ * Wait until something can be received, for at most timeout_ms
+ * A socket is polled; a shm ring is waited on like ring_get does, with
+ * the sleep cut short by the timeout
+ * @return: 1 once there is something to receive, 0 on timeout, -1 on error
+ */
+int conn_wait_readable(struct conn *c, int timeout_ms) {
+    uint64_t end = monotonic_ns() + (uint64_t)timeout_ms * 1000000ull;
+
+    if (c->shm == NULL) {
+        struct pollfd pfd = {.fd = c->fd, .events = POLLIN};
+        while (1) {
+            int rv = poll(&pfd, 1, timeout_ms);
+            if (rv >= 0)	return rv > 0;
+            if (errno != EINTR)	return -1;
+            uint64_t now = monotonic_ns();
+            timeout_ms = now < end ? (int)((end - now + 999999) / 1000000) : 0;
+        }
+    }
+
+    struct shm_ring *r = c->rx;
+    while (1) {
+        uint32_t seen = __atomic_load_n(&r->head_seq, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail ||
+            __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))	return 1;
+        uint64_t now = monotonic_ns();
+        if (now >= end)	return 0;
+
+        uint64_t sleep = end - now < SHM_SLEEP_NS ? end - now : SHM_SLEEP_NS;
+        struct timespec ts = {.tv_sec = sleep / 1000000000ull, .tv_nsec = sleep % 1000000000ull};
+        __atomic_add_fetch(&r->head_waiters, 1, __ATOMIC_SEQ_CST);
+        long rv = syscall(SYS_futex, &r->head_seq, FUTEX_WAIT, seen, &ts, NULL, 0);
+        int saved = errno;
+        __atomic_sub_fetch(&r->head_waiters, 1, __ATOMIC_SEQ_CST);
+        // a dead peer is left for the receive to report
+        if (rv < 0 && saved == ETIMEDOUT && !peer_alive(c))	return 1;
+    }
+}
+
+/*
+ * Receive exactly len bytes
+ * @return: len, 0 if the peer closed before the first byte, -1 on error,
+ *    with errno EPROTO if the peer closed in the middle
+ */
+ssize_t conn_recv_exact(struct conn *c, void *buf, size_t len) {
+    if (c->shm == NULL)	return recv_exact(c->fd, buf, len);
+    return ring_get(c, (char *)buf, len);
+}
+
+/*
+ * Receive what has already arrived, up to len bytes, without waiting
+ * @return: bytes received, 0 if the peer closed, -1 with errno set on
+ *    error, EAGAIN if nothing has arrived
+ */
+ssize_t conn_recv_ready(struct conn *c, void *buf, size_t len) {
+    if (c->shm != NULL) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    while (1) {
+        ssize_t rv = recv(c->fd, buf, len, MSG_DONTWAIT);
+        if (rv >= 0 || errno != EINTR)	return rv;
+    }
+}
+
+/*
+ * Send what the socket takes of several buffers, without waiting
+ * With netem15440 set everything is queued on the emulated link, which
+ * only waits once it holds NETEM_QUEUE_MAX bytes, like a full socket
+ * @return: bytes sent, -1 with errno set on error, EAGAIN if the socket
+ *    took nothing
+ */
+ssize_t conn_send_ready(struct conn *c, struct iovec *iov, int iovcnt) {
+    if (c->shm != NULL) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (c->em != NULL)	return netem_send(c->em, iov, iovcnt, 0);
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = iovcnt;
+    while (1) {
+        ssize_t rv = sendmsg(c->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (rv >= 0 || errno != EINTR)	return rv;
+    }
+}
+
+/*
+ * Close a connection and free it
+ * A shm peer sees the ring closed once it has read what is left in it
+ */
+void conn_close(struct conn *c) {
+    if (c == NULL)	return;
+    netem_close(c->em);
+    if (c->shm != NULL) {
+        __atomic_store_n(&c->tx->closed, 1, __ATOMIC_RELEASE);
+        ring_wake(&c->tx->head_seq, &c->tx->head_waiters);
+        munmap(c->shm, sizeof(struct shm_region));
+    }
+    close(c->fd);
+    free(c);
+}
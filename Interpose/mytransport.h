@@ -0,0 +1,142 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * mytransport.h
+ * Byte-stream transports carrying the frames of myframe.h between mylib
+ * and server. send_message and receive_message only see a struct conn.
+ *
+ * The transport is chosen on both sides with the environment variable
+ * transport15440:
+ *     tcp     TCP to server15440:serverport15440 (default)
+ *     unix    AF_UNIX stream socket, for a server on the same host
+ *     shm     a pair of single-producer single-consumer rings in shared
+ *             memory, one per direction, with futex wakeups
+ * unix and shm listen on the path in socket15440, by default
+ * /tmp/server15440-<port>.sock. With shm the socket is only used to hand
+ * the shared memory to the server with SCM_RIGHTS and to notice a peer
+ * going away; frames are copied once, straight from the sender's buffers
+ * into the ring and from the ring into the receiver's buffers.
+ * Any transport can be slowed down to a WAN link with netem15440, see
+ * mynetem.h.
+ */
+
+#ifndef MYTRANSPORT_H
+#define MYTRANSPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Transports */
+#define TRANSPORT_TCP 0
+#define TRANSPORT_UNIX 1
+#define TRANSPORT_SHM 2
+
+#define SHM_RING_SIZE (4 << 20) /* Bytes of each shared memory ring */
+
+struct shm_ring;
+struct shm_region;
+struct netem;
+
+/* One connection between mylib and server */
+struct conn {
+    int kind; /* TRANSPORT_* */
+    int fd; /* the socket, only used for liveness with shm */
+    struct shm_region *shm; /* mapped rings, NULL unless shm */
+    struct shm_ring *tx; /* ring this side produces into */
+    struct shm_ring *rx; /* ring this side consumes from */
+    struct netem *em; /* emulated link this side sends over, NULL if off */
+};
+
+/*
+ * @return: TRANSPORT_* named by transport15440, TRANSPORT_TCP if unset
+ */
+int transport_from_env(void);
+
+/* Name of a transport, for messages */
+const char *transport_name(int kind);
+
+/*
+ * Client: connect to the server
+ * @param:
+ *    kind: TRANSPORT_*
+ *    host: server ip address, only used by tcp
+ *    port: server port, also names the default socket path
+ * @return: new connection, NULL with errno set on error
+ */
+struct conn *conn_connect(int kind, const char *host, unsigned short port);
+
+/*
+ * Server: listen for connections
+ * @param:
+ *    reuseport: over tcp, let listeners of other processes share the
+ *    port, the kernel spreading connections over them; unix sockets
+ *    cannot, a process shares its listener by forking instead
+ * @return: listening socket, -1 on error
+ */
+int conn_listen(int kind, unsigned short port, int reuseport);
+
+/*
+ * Server: accept the next connection, without waiting for its handshake
+ * @return: new connection, NULL on error
+ */
+struct conn *conn_accept(int kind, int listenfd);
+
+/*
+ * Server: finish setting up an accepted connection, such as mapping the
+ * rings a shm client sends
+ * @return: 0 on success, -1 on error
+ */
+int conn_handshake(struct conn *c);
+
+/*
+ * Send the bytes of several buffers, in order, in full
+ * @return: number of bytes sent, -1 if error occurred
+ */
+ssize_t conn_send_iov(struct conn *c, struct iovec *iov, int iovcnt);
+
+/*
+ * Send as conn_send_iov does, giving up at deadline
+ * @param:
+ *    deadline: CLOCK_MONOTONIC ns to give up at, 0 to wait as long as it takes
+ * @return: number of bytes sent, -1 if error occurred, with errno ETIMEDOUT
+ *    if the deadline passed, maybe after part of them went out
+ */
+ssize_t conn_send_iov_until(struct conn *c, struct iovec *iov, int iovcnt, uint64_t deadline);
+
+/*
+ * Wait until something can be received, for at most timeout_ms
+ * @return: 1 once bytes, or the end of the stream, are there to receive,
+ *    0 on timeout, -1 on error
+ */
+int conn_wait_readable(struct conn *c, int timeout_ms);
+
+/*
+ * Receive exactly len bytes
+ * @return: len, 0 if the peer closed before the first byte, -1 on error,
+ *    with errno EPROTO if the peer closed in the middle
+ */
+ssize_t conn_recv_exact(struct conn *c, void *buf, size_t len);
+
+/*
+ * Receive what has already arrived, up to len bytes, without waiting
+ * Only for sockets, which can be waited on with epoll; shm rings cannot
+ * @return: bytes received, 0 if the peer closed, -1 with errno set on
+ *    error, EAGAIN if nothing has arrived
+ */
+ssize_t conn_recv_ready(struct conn *c, void *buf, size_t len);
+
+/*
+ * Send what the socket takes of several buffers, without waiting
+ * Only for sockets, which can be waited on with epoll; shm rings cannot
+ * @return: bytes sent, -1 with errno set on error, EAGAIN if the socket
+ *    took nothing
+ */
+ssize_t conn_send_ready(struct conn *c, struct iovec *iov, int iovcnt);
+
+/* Close a connection and free it */
+void conn_close(struct conn *c);
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * myuring.c
+ * Implementation of the ring defined in myuring.h
+ *
+ * Without SQPOLL the kernel only takes submissions inside io_uring_enter,
+ * which is called under the submission lock, so a submission the kernel
+ * refused can still be taken back out of the queue.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "myuring.h"
+
+struct uring {
+    int fd;
+    unsigned int entries;
+    unsigned int features;
+    pthread_mutex_t lock; /* guards submissions */
+    pthread_mutex_t cq_lock; /* guards taking completions */
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, const void *arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Set up a ring
+ * @return: new ring, NULL with errno set on error
+ */
+struct uring *uring_open(unsigned int entries) {
+    struct io_uring_params p;
+    struct uring *r = (struct uring *)calloc(1, sizeof(struct uring));
+    if (r == NULL)	return NULL;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+    r->entries = p.sq_entries;
+    r->features = p.features;
+
+    // the rings are mapped as one when the kernel allows it
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && cq_len > sq_len)	sq_len = cq_len;
+    char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !single) {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = MAP_FAILED;
+    if (sq != MAP_FAILED && cq != MAP_FAILED) {
+        sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    }
+    if (sqes == MAP_FAILED) {
+        int saved = errno;
+        if (cq != MAP_FAILED && cq != sq)	munmap(cq, cq_len);
+        if (sq != MAP_FAILED)	munmap(sq, sq_len);
+        close(r->fd);
+        free(r);
+        errno = saved;
+        return NULL;
+    }
+
+    r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sqes = (struct io_uring_sqe *)sqes;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_mutex_init(&r->cq_lock, NULL);
+    return r;
+}
+
+unsigned int uring_entries(struct uring *r) {
+    return r->entries;
+}
+
+unsigned int uring_features(struct uring *r) {
+    return r->features;
+}
+
+/*
+ * Register an empty table of fixed files
+ * @return: 0 on success, -1 with errno set on error
+ */
+int uring_register_files(struct uring *r, unsigned int count) {
+    int *fds = (int *)malloc(count * sizeof(int));
+    unsigned int i;
+    if (fds == NULL)	return -1;
+    for (i = 0; i < count; i++)	fds[i] = -1;
+    int rv = uring_register(r->fd, IORING_REGISTER_FILES, fds, count);
+    free(fds);
+    return rv < 0 ? -1 : 0;
+}
+
+/*
+ * Set a slot of the fixed file table
+ * @return: 0 on success, -1 with errno set on error
+ */
+int uring_update_file(struct uring *r, unsigned int slot, int fd) {
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = slot;
+    up.fds = (uint64_t)(uintptr_t)&fd;
+    return uring_register(r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1) < 0 ? -1 : 0;
+}
+
+/*
+ * Register buffers for the fixed reads and writes
+ * @return: 0 on success, -1 with errno set on error
+ */
+int uring_register_buffers(struct uring *r, const struct iovec *iov, unsigned int n) {
+    return uring_register(r->fd, IORING_REGISTER_BUFFERS, iov, n) < 0 ? -1 : 0;
+}
+
+/*
+ * Submit one operation, copied from sqe
+ * @return: 0 on success, -1 with errno set if the ring did not take it
+ */
+int uring_submit(struct uring *r, const struct io_uring_sqe *sqe) {
+    int rv;
+
+    pthread_mutex_lock(&r->lock);
+    unsigned int tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries) {
+        pthread_mutex_unlock(&r->lock);
+        errno = EBUSY;
+        return -1;
+    }
+    unsigned int index = tail & *r->sq_mask;
+    r->sqes[index] = *sqe;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while ((rv = uring_enter(r->fd, 1, 0, 0)) < 0 && errno == EINTR);
+    if (rv < 1 && __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == tail) {
+        // not taken, so it is withdrawn rather than left for the next enter
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+        if (rv == 0)	errno = EAGAIN;
+        rv = -1;
+    } else {
+        rv = 0;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return rv;
+}
+
+/*
+ * Take up to max completions, without waiting
+ * @return: number of completions
+ */
+int uring_reap(struct uring *r, struct io_uring_cqe *cqes, int max) {
+    int n = 0;
+
+    pthread_mutex_lock(&r->cq_lock);
+    unsigned int head = *r->cq_head;
+    unsigned int tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && n < max) {
+        cqes[n++] = r->cqes[head & *r->cq_mask];
+        head++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&r->cq_lock);
+    return n;
+}
+
+/*
+ * Wait for completions and take up to max of them
+ * @return: number of completions, -1 with errno set on error
+ */
+int uring_wait(struct uring *r, struct io_uring_cqe *cqes, int max) {
+    while (1) {
+        int n = uring_reap(r, cqes, max);
+        if (n > 0)	return n;
+        if (uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)	return -1;
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * myuring.h
+ * A small io_uring for the server, set up with the raw system calls so
+ * that no library is needed.
+ *
+ * Any thread may submit or reap; submissions are serialized by the ring
+ * and entered one at a time. The caller keeps the number of operations
+ * in flight under the ring size, so completions are never dropped.
+ */
+
+#ifndef MYURING_H
+#define MYURING_H
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+struct uring;
+
+/*
+ * Set up a ring
+ * @param:
+ *    entries: submission queue size, rounded up to a power of 2
+ * @return: new ring, NULL with errno set on error
+ */
+struct uring *uring_open(unsigned int entries);
+
+/* Submission queue size of the ring, as set up */
+unsigned int uring_entries(struct uring *r);
+
+/* IORING_FEAT_* the kernel of the ring offers */
+unsigned int uring_features(struct uring *r);
+
+/*
+ * Register an empty table of fixed files
+ * @return: 0 on success, -1 with errno set on error
+ */
+int uring_register_files(struct uring *r, unsigned int count);
+
+/*
+ * Set a slot of the fixed file table
+ * @param:
+ *    fd: file to put in it, -1 to empty it
+ * @return: 0 on success, -1 with errno set on error
+ */
+int uring_update_file(struct uring *r, unsigned int slot, int fd);
+
+/*
+ * Register buffers for IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED
+ * @return: 0 on success, -1 with errno set on error
+ */
+int uring_register_buffers(struct uring *r, const struct iovec *iov, unsigned int n);
+
+/*
+ * Submit one operation, copied from sqe
+ * @return: 0 on success, -1 with errno set if the ring did not take it,
+ *    in which case it never completes
+ */
+int uring_submit(struct uring *r, const struct io_uring_sqe *sqe);
+
+/*
+ * Take up to max completions, without waiting
+ * @return: number of completions
+ */
+int uring_reap(struct uring *r, struct io_uring_cqe *cqes, int max);
+
+/*
+ * Wait for completions and take up to max of them
+ * @return: number of completions, -1 with errno set on error
+ */
+int uring_wait(struct uring *r, struct io_uring_cqe *cqes, int max);
+
+#endif
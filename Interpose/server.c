@@ -11,6 +11,8 @@
  * getdirtree, freedirtree
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
@@ -24,581 +26,2585 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/random.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
 #include "mystub.h"
+#include "myframe.h"
+#include "myrpc.h"
+#include "mycompress.h"
+#include "mytransport.h"
+#include "myuring.h"
+#include "myarena.h"
 #include <pthread.h>
 
-#define MAXMSGLEN 2000
-#define MAXFUNCSIZE 30
 #define MAXTHREADNUM 127
-#define MAXWRITELEN 1000020
-#define FD_OFFSET 100000
+#define MAXFRAMELEN (FRAME_HDR_SIZE + ARGS_MAX_LEN + MAXWRITELEN) /* Largest frame accepted from a client */
+
+#define REPLY_INLINE_LEN 256 /* Payloads up to this size are copied next to the header */
+#define REPLY_HEADROOM 64 /* Room left in front of a payload for the header built in place before it */
+#define SESSION_LANES 4 /* Queues the requests of one session are ordered in */
+#define SESSION_GRACE 30 /* Seconds a dropped session waits for its client, see grace15440 */
+#define MAXFDS 65536 /* Files open at once over all sessions, as many as a client tells apart */
+#define REACTOR_EVENTS 64 /* Events taken from epoll at once */
+#define REACTOR_BURST 32 /* Frames taken from one connection before serving the others */
+#define MAXPROCS 64 /* Server processes, see procs15440 */
+#define URING_ENTRIES 256 /* Operations in flight on the io_uring of a process, see uring15440 */
+#define URING_BUFS 16 /* Registered read buffers of RING_BUF_LEN bytes */
+#define RING_BUF_LEN (REPLY_HEADROOM + MAXWRITELEN) /* Room for a read and the header of its reply */
+#define CLIENT_JOBS 16 /* Finished jobs a connection keeps to receive into */
+#define CLIENT_JOBS_LEN (4 * MAXFRAMELEN) /* Bytes of frame buffers those may hold */
+#define CLIENT_OUT_LEN (4 * MAXFRAMELEN) /* Bytes of replies queued for a connection before streamed ones wait */
+#define CLIENT_BUSY_JOBS 64 /* Requests of a connection received and not answered before it is no longer read */
+#define CLIENT_BUSY_LEN (8 * MAXFRAMELEN) /* Bytes of frame buffers those may hold */
+
+struct session;
+struct client;
+struct rpc_reply;
+struct frame_header;
+
+/* Finishes a request once its file operation completed on the ring */
+typedef struct rpc_reply *(*op_complete)(char *frame, const struct frame_header *hdr, struct rpc_reply *out);
+
+/*
+ * Request waiting on a lane
+ * Once answered it goes back to its connection, which receives a later
+ * frame into the same buffer, see take_job
+ */
+struct lane_job {
+    char *frame;
+    size_t frame_cap; /* bytes frame holds */
+    struct client *client; /* connection it came over and is answered over, referenced */
+    struct lane_job *next;
+};
+
+/*
+ * Queue of requests of one session, run in order
+ * Requests on the same fd always go to the same lane, so they keep the
+ * order the client sent them in, while requests on other fds and on paths
+ * overtake them, such as a stat sent behind a slow read.
+ * A lane with jobs waits on the run queue for a worker, which runs its
+ * oldest job and puts it back at the end, so one lane never runs two jobs
+ * at once and a busy session does not starve the others.
+ */
+struct lane {
+    struct session *session;
+    pthread_mutex_t lock;
+    struct lane_job *head; /* oldest job */
+    struct lane_job *tail; /* newest job */
+    int pending; /* jobs queued or running */
+    int scheduled; /* on the run queue or running */
+    uint32_t running; /* req_id of the running job, 0 if none */
+    int cancelled; /* the running job was cancelled */
+    uint64_t stream_client; /* serial of the connection the write streamed to this lane came over */
+    int64_t stream_done; /* bytes written by that write */
+    int64_t stream_error; /* -errno that write failed with */
+    struct lane *next_ready; /* next lane on the run queue, or parked on the same client */
+    /* File operation of the running job, see submit_op */
+    struct lane_job *job; /* running job */
+    op_complete complete; /* finishes it, NULL unless its operation is in flight */
+    uint64_t op_start; /* when the operation was submitted, CLOCK_MONOTONIC ns */
+    int64_t op_res; /* its result, -errno on failure */
+    char *op_buf; /* buffer it reads into behind REPLY_HEADROOM bytes, NULL if none */
+    int op_buf_index; /* registered buffer op_buf is, -1 if malloc'd */
+    char *op_packed; /* scratch to compress what it read into, NULL not to */
+    size_t op_len; /* bytes it reads or writes */
+    struct statx op_statx; /* what a statx fills in */
+    /* Read streamed to a client that fell behind, carried on by read_resume */
+    int read_fd;
+    size_t read_count; /* bytes wanted */
+    off_t read_offset; /* where it started with pread, -1 if at the file offset */
+    size_t read_done; /* bytes sent so far */
+};
+
+/*
+ * Files and lanes of one client
+ * A client offering CAP_SESSION gets an id and a key to resume the
+ * session with. When its connection drops, the session waits grace15440
+ * seconds (SESSION_GRACE by default, 0 turns resumption off) for a new
+ * connection whose hello names it; a connection closed cleanly ends it.
+ * The files it opened are closed with it.
+ */
+struct session {
+    uint64_t id; /* 0 if it cannot be resumed */
+    uint64_t key;
+    int peer_caps; /* capabilities agreed in the hello exchange */
+    struct lane lanes[SESSION_LANES];
+    struct client *client; /* connection attached, NULL while waiting to be resumed */
+    time_t expires; /* while waiting, when it ends */
+    int refs; /* held by its connection, the table of resumable sessions, and each job */
+    int open_fds; /* files it opened and did not close */
+    struct session *next; /* in sessions */
+};
+
+/*
+ * Bytes of a reply the socket of its client did not take at once
+ */
+struct out_chunk {
+    struct out_chunk *next;
+    size_t len; /* bytes of data */
+    size_t sent; /* of them, already sent */
+    char data[];
+};
+
+/*
+ * Connection of a client
+ * The reactor receives its frames without waiting, see client_receive,
+ * except over shm, whose rings a thread of its own waits on. Replies are
+ * sent without waiting either: what the socket does not take is queued,
+ * and sent by the reactor once the socket has room, see client_flush.
+ * Over shm a full ring is waited on.
+ */
+struct client {
+    struct conn *conn;
+    uint64_t serial; /* tells connections apart, even at the same address */
+    struct session *session; /* referenced, NULL once it was taken over */
+    pthread_mutex_t send_lock; /* one reply on the socket at a time, guards the queue below */
+    struct out_chunk *out_head, *out_tail; /* replies the socket did not take yet, oldest first */
+    size_t out_len; /* bytes left to send of them */
+    struct lane *parked; /* lanes streaming to it, waiting for the queue to drain */
+    int closed; /* dropped, nothing more is sent */
+    pthread_mutex_t watch_lock; /* guards ep and watched */
+    int ep; /* epoll instance of the reactor receiving from it, -1 if none */
+    uint32_t watched; /* events it is registered for, 0 if not registered */
+    pthread_cond_t room; /* over shm, it is no longer full, see client_full */
+    int busy_jobs; /* jobs taken for its frames and not given back */
+    size_t busy_len; /* bytes of their frame buffers */
+    int refs; /* held by the reactor and each job */
+    int error; /* it failed rather than closed cleanly */
+    char prefix[FRAME_LEN_SIZE]; /* length prefix being received */
+    struct lane_job *job; /* job of the frame being received, NULL while its prefix is */
+    size_t frame_len; /* bytes of frame, prefix included */
+    size_t got; /* bytes of the prefix, or of the frame, received */
+    pthread_mutex_t jobs_lock; /* guards the finished jobs */
+    struct lane_job *free_jobs; /* finished jobs, at most CLIENT_JOBS */
+    int nfree_jobs;
+    size_t free_jobs_len; /* bytes of their frame buffers */
+};
+
+__thread struct lane *current_lane; /* lane of the calling worker, NULL in the reactor */
+
+/*
+ * Scratch memory of the job the calling worker runs, such as the buffer
+ * a read lands in, released once its reply is sent
+ * Nothing taken from it may outlive a job handed to the ring
+ */
+__thread struct arena scratch;
+
+/*
+ * Lanes with jobs waiting for a worker, run by workers15440 threads,
+ * one per cpu by default
+ */
+pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER; /* guards the run queue */
+pthread_cond_t run_ready = PTHREAD_COND_INITIALIZER; /* a lane was put on it */
+struct lane *run_head, *run_tail;
+
+struct session *fd_owner[MAXFDS]; /* session each open file belongs to, NULL if none */
+
+/*
+ * io_uring of this process, turned on with uring15440=1
+ * Handlers hand open, read, pread, write, stat and unlink to it rather
+ * than blocking their worker; a thread of its own reaps the completions
+ * and puts the lanes back on the run queue to finish their jobs.
+ * Every fd a session opens is also a fixed file of the same number, and
+ * reads land in registered buffers while there are free ones.
+ */
+struct uring *ring;
+int ring_files; /* slots of the fixed file table, 0 if none */
+char ring_fixed[MAXFDS]; /* fd is in its fixed file slot */
+char *ring_bufs; /* URING_BUFS registered buffers, NULL if none */
+pthread_mutex_t ring_bufs_lock = PTHREAD_MUTEX_INITIALIZER; /* guards the free buffers */
+int ring_free[URING_BUFS]; /* registered buffers not in use */
+int ring_nfree;
+int ring_inflight; /* operations submitted and not reaped */
+pthread_mutex_t ring_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ring_pending = PTHREAD_COND_INITIALIZER; /* an operation did not complete at once */
+int ring_max_inflight; /* most ever in flight */
+uint64_t ring_ops; /* operations completed */
+uint64_t ring_ns; /* time they took from submission to completion, summed */
+
+int session_grace = SESSION_GRACE;
+pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER; /* guards sessions and their client fields */
+struct session *sessions; /* resumable sessions */
+uint64_t last_id; /* id of the newest session, of the newest connection */
+
+/*
+ * Reply to one request, sent with a single sendmsg of up to two iovecs
+ * The length prefix, the frame header and the arguments are built right
+ * in front of the payload, in the REPLY_HEADROOM bytes a handler left
+ * there, see build_reply_in_place. Small payloads get such room in head;
+ * a larger payload without it is sent from where the handler left it,
+ * after the header built in head
+ */
+struct rpc_reply {
+    char head[REPLY_HEADROOM + REPLY_INLINE_LEN];
+    char *start; /* first byte of the message, in head or in the headroom of the payload */
+    size_t head_len; /* bytes from start, the payload built in place included */
+    const char *payload; /* payload not copied into head, may be NULL */
+    size_t payload_len;
+    void *release; /* buffer of the handler freed once the reply is sent, may be NULL */
+    int release_buf; /* registered buffer given back once the reply is sent, -1 if none */
+    int deferred; /* the request is finished once its file operation completed */
+    struct client *client; /* connection of the request, for handlers streaming several replies */
+};
+
+/*
+ * @return:
+ *    where a handler builds a payload of up to REPLY_INLINE_LEN bytes in
+ *    the head of its reply, for build_reply_in_place
+ */
+static inline char *reply_payload(struct rpc_reply *out) {
+    return out->head + REPLY_HEADROOM;
+}
+
+_Static_assert(STAT_FIELDS_MAX_LEN <= REPLY_INLINE_LEN, "stat fields are built in the head of the reply");
+_Static_assert(FRAME_LEN_SIZE + FRAME_HDR_SIZE + ARGS_MAX_LEN <= REPLY_HEADROOM, "headroom holds any header");
 
-char *execute_open(char* msg);
-char *execute_close(char* msg);
-char *execute_read(char* msg);
-char *execute_write(char* msg);
-char *execute_lseek(char* msg);
-char *execute_stat(char* msg);
-char *execute_unlink(char* msg);
-char *execute_getdirentries(char* msg);
-char *execute_getdirtree(char* msg);
+struct rpc_reply *execute_open(char *frame, const struct frame_header *hdr, struct rpc_reply *out);
+struct rpc_reply *execute_close(char *frame, const struct frame_header *hdr, struct rpc_reply *out);
+struct rpc_reply *execute_read(char *frame, const struct frame_header *hdr, struct rpc_reply *out);
+struct rpc_reply *execute_pread(char *frame, const struct frame_header *hdr, struct rpc_reply *out);
+struct rpc_reply *execute_write(char *frame, const struct frame_header *hdr, struct rpc_reply *out);
+struct rpc_reply *execute_lseek(char *frame, const struct frame_header *hdr, struct rpc_reply *out);
+struct rpc_reply *execute_stat(char *frame, const struct frame_header *hdr, struct rpc_reply *out);
+struct rpc_reply *execute_fstat(char *frame, const struct frame_header *hdr, struct rpc_reply *out);
+struct rpc_reply *execute_unlink(char *frame, const struct frame_header *hdr, struct rpc_reply *out);
+struct rpc_reply *execute_getdirentries(char *frame, const struct frame_header *hdr, struct rpc_reply *out);
+struct rpc_reply *execute_getdirtree(char *frame, const struct frame_header *hdr, struct rpc_reply *out);
 
-char *add_len(char *str, int count);
-char *add_neg_len(char *str, int count);
+struct rpc_reply *build_reply(const struct frame_header *req, int flags, const char *args, int args_len,
+                              const char *payload, size_t payload_len, struct rpc_reply *out);
+struct rpc_reply *build_reply_in_place(const struct frame_header *req, int flags, const char *args, int args_len,
+                                       char *payload, size_t payload_len, struct rpc_reply *out);
+struct rpc_reply *make_reply(const struct frame_header *req, int64_t ret,
+                             const char *payload, size_t payload_len, struct rpc_reply *out);
+struct rpc_reply *no_reply(struct rpc_reply *out);
+ssize_t send_message(struct rpc_reply *reply, struct client *client);
+static int park_lane(struct client *c, struct lane *lane);
+int request_cancelled(void);
+int session_fd(int wire_fd);
+int own_fd(int fd);
+int disown_fd(int wire_fd);
+struct rpc_reply *submit_op(struct io_uring_sqe *sqe, op_complete complete, struct rpc_reply *out);
+void prep_file_op(struct io_uring_sqe *sqe, int opcode, int fd, void *buf, size_t len, uint64_t offset);
+void prep_path_op(struct io_uring_sqe *sqe, int opcode, const char *path);
+int take_ring_buf(void);
+void put_ring_buf(int index);
+void print_ring_stats(void);
+static void complete_ops(struct io_uring_cqe *cqes, int n);
+static void make_ready(struct lane *lane);
+
+/* Server-side handler of one rpc */
+typedef struct rpc_reply *(*rpc_handler)(char *frame, const struct frame_header *hdr, struct rpc_reply *out);
+
+/*
+ * Handlers indexed by opcode
+ * Opcodes the server does not implement are left NULL, as are hello
+ * and cancel, which dispatch answers itself
+ */
+static const rpc_handler handlers[OP_MAX] = {
+    [OP_OPEN] = execute_open,
+    [OP_CLOSE] = execute_close,
+    [OP_READ] = execute_read,
+    [OP_WRITE] = execute_write,
+    [OP_LSEEK] = execute_lseek,
+    [OP_STAT] = execute_stat,
+    [OP_UNLINK] = execute_unlink,
+    [OP_GETDIRENTRIES] = execute_getdirentries,
+    [OP_GETDIRTREE] = execute_getdirtree,
+    [OP_PREAD] = execute_pread,
+    [OP_FSTAT] = execute_fstat,
+};
 
 /*
  * Server-side unmarshalling message
  * @param: 
- *    marshallMsg: marshalling message from mylib
+ *    frame: marshalling message from mylib, starting at its length prefix
+ *    out: reply to fill in
  * @return: 
  *    Marshalling message of return value after running syscalls on server
  */
-char *unmarshalling_method(char* marshallMsg) {
-    // Allocate memory for function name
-    char *func_name = (char *)malloc(MAXFUNCSIZE * sizeof(char));
-
-    /* Get the function name */
-    int func_start = 0;
-    int idx = 0;
-    while (marshallMsg[func_start] != '|') {
-        func_name[idx] = marshallMsg[func_start];
-        idx++; func_start++;
-    }
-    func_name[idx] = '\0';
-
-    if (strcmp(func_name, "open") == 0) {
-        free(func_name);
-        return execute_open(marshallMsg);
-    } else if (strcmp(func_name, "close") == 0) {
-        free(func_name);
-        return execute_close(marshallMsg);
-    } else if (strcmp(func_name, "read") == 0) {
-        free(func_name);
-        return execute_read(marshallMsg);
-    } else if (strcmp(func_name, "write") == 0) {
-        free(func_name);
-        return execute_write(marshallMsg);
-    } else if (strcmp(func_name, "lseek") == 0) {
-        free(func_name);
-        return execute_lseek(marshallMsg);
-    } else if (strcmp(func_name, "__xstat") == 0) {
-        free(func_name);
-        return execute_stat(marshallMsg);
-    } else if (strcmp(func_name, "unlink") == 0) {
-        free(func_name);
-        return execute_unlink(marshallMsg);
-    } else if (strcmp(func_name, "getdirentries") == 0) {
-        free(func_name);
-        return execute_getdirentries(marshallMsg);
-    } else if (strcmp(func_name, "getdirtree") == 0) {
-        free(func_name);
-        return execute_getdirtree(marshallMsg);
-    } else {
-        printf("function %s is not supported in RPC\n", func_name);
-    } // if the function name is not supported, return error string to mylib
-    char *error_msg = (char *)malloc(50 * sizeof(char));
-    strcpy(error_msg, "Function not supported");
-    
-    free(func_name);
+struct rpc_reply *unmarshalling_method(char *frame, struct rpc_reply *out) {
+    struct frame_header hdr;
+
+    if (decode_frame_header(frame, &hdr) < 0) {
+        return make_reply(&hdr, -EPROTO, NULL, 0, out);
+    }
+
+    if (hdr.opcode < OP_MAX && handlers[hdr.opcode] != NULL) {
+        return handlers[hdr.opcode](frame, &hdr, out);
+    }
+    // if the opcode is not supported, return error to mylib
+    printf("opcode %d is not supported in RPC\n", hdr.opcode);
     
-    return error_msg;
+    return make_reply(&hdr, -ENOSYS, NULL, 0, out);
+}
+
+/*
+ * Answer an open, the file now belonging to the session of the calling worker
+ * @param:
+ *    openfd: fd opened, -errno on failure
+ * @return:
+ *    out
+ */
+static struct rpc_reply *open_reply(const struct frame_header *hdr, int64_t openfd, struct rpc_reply *out) {
+    if (openfd >= 0 && own_fd(openfd) < 0) {
+        close(openfd);
+        openfd = -EMFILE;
+    }
+    return make_reply(hdr, openfd, NULL, 0, out); // return value: fd or -errno
+}
+
+static struct rpc_reply *open_done(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
+    (void)frame; // the reply is built from what the operation left in the lane
+    return open_reply(hdr, current_lane->op_res, out);
 }
 
 /*
  * Unmarshall and execute open syscall on server
- * Then marshall the return value and content in a char array
+ * Then marshall the return value and content in a reply frame
  * @return:
  *    fd or -errno
  */
-char *execute_open(char* msg) {
+struct rpc_reply *execute_open(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
     char *pathname;
     int flags;
     mode_t m; // parameters
 
-    int idx = 5;
-    flags = ato_int(&msg[idx]);
-    while (msg[idx] != '|')	idx++;
-    idx++;
-
-    m = ato_mode_t(&msg[idx]);
-    while (msg[idx] != '|')	idx++;
-    idx++;
+    struct open_req req;
+    struct arg_reader args;
+    arg_reader_init(&args, frame, hdr);
+    if (decode_open_req(&args, &req) < 0) {
+        return make_reply(hdr, -EINVAL, NULL, 0, out);
+    }
+    flags = req.flags;
+    m = (mode_t)req.mode;
 
-    // Then pathname
-    pathname = &msg[idx];
+    // Then pathname, which is NUL-terminated by receive_message
+    pathname = frame_payload(frame, hdr);
 
-    int openfd = open(pathname, flags, m);
-    char *ret_val;
-    if (openfd < 0) {
-        ret_val = int_to_str(-errno);
-    }
-    else {
-        ret_val = int_to_str(openfd);
+    if (ring != NULL) {
+        struct io_uring_sqe sqe;
+        prep_path_op(&sqe, IORING_OP_OPENAT, pathname);
+        sqe.len = m;
+        sqe.open_flags = flags;
+        if (submit_op(&sqe, open_done, out) != NULL)	return out;
     }
-    return add_len(ret_val, 30); // return value: fd or -errno
+    int openfd = open(pathname, flags, m);
+    return open_reply(hdr, openfd < 0 ? -errno : openfd, out);
 }
 
 /*
  * Unmarshall and execute close syscall on server
- * Then marshall the return value and content in a char array
+ * Then marshall the return value and content in a reply frame
  * @return:
  *    0 or -errno
  */
-char *execute_close(char* msg) {
-    int fd = atoi(&msg[6]); // parameters
-    fd -= FD_OFFSET;
+struct rpc_reply *execute_close(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
+    struct close_req req;
+    struct arg_reader args;
+    arg_reader_init(&args, frame, hdr);
+    if (decode_close_req(&args, &req) < 0) {
+        return make_reply(hdr, -EINVAL, NULL, 0, out);
+    }
+    int fd = disown_fd(req.fd); // parameters
 
     int closefd = close(fd);
-    char *ret_val;
+    int64_t ret_val;
     if (closefd < 0) {
-        ret_val = int_to_str(-errno);
+        ret_val = -errno;
     }
     else {
-        ret_val = int_to_str(closefd);
+        ret_val = closefd;
+    }
+    return make_reply(hdr, ret_val, NULL, 0, out); // return value: 0 or -errno
+}
+
+/*
+ * Build one reply of a streamed read, compressed if the client agreed
+ * to it and the chunk shrinks
+ * Both buffers have REPLY_HEADROOM bytes in front, so the chunk is sent
+ * from where it was read or compressed to
+ * @param:
+ *    req: header of the read request
+ *    flags: FRAME_F_MORE unless this is the last chunk
+ *    data, n: content of the chunk
+ *    packed: scratch of at least n bytes for the compressed chunk, NULL not to compress
+ *    out: reply to fill in
+ * @return:
+ *    out
+ */
+static struct rpc_reply *read_chunk_reply(const struct frame_header *req, int flags,
+                                          char *data, size_t n, char *packed,
+                                          struct rpc_reply *out) {
+    struct reply reply = {.ret = (int64_t)n};
+    char reply_args[reply_max_len];
+    int args_len = pack_reply(reply_args, frame_codec(req), &reply);
+
+    size_t packed_len = packed ? compress_payload(data, n, packed) : 0;
+    if (packed_len > 0) {
+        return build_reply_in_place(req, flags | FRAME_F_LZ, reply_args, args_len, packed, packed_len, out);
+    }
+    return build_reply_in_place(req, flags, reply_args, args_len, data, n, out);
+}
+
+/*
+ * Size of a buffer a read of count bytes lands in, see read_buffer
+ */
+static size_t read_buffer_len(size_t count, int compress) {
+    return (REPLY_HEADROOM + count) * (compress ? 2 : 1);
+}
+
+/*
+ * Carve a buffer of read_buffer_len bytes into where the content is read
+ * to and where it is compressed to, each behind the headroom of its reply
+ * @param:
+ *    packed: set to the room for the compressed content, NULL not to compress
+ * @return:
+ *    where the content is read to
+ */
+static char *read_buffer(char *buf, size_t count, int compress, char **packed) {
+    *packed = compress ? buf + REPLY_HEADROOM + count + REPLY_HEADROOM : NULL;
+    return buf + REPLY_HEADROOM;
+}
+
+/*
+ * Answer the last chunk of a streamed write and reset the stream
+ * The bytes written are reported if any were, like a short write,
+ * otherwise the error
+ * @return:
+ *    out
+ */
+static struct rpc_reply *finish_write(const struct frame_header *req, int64_t *done,
+                                      int64_t *error, struct rpc_reply *out) {
+    int64_t ret_val = (*done > 0 || *error == 0) ? *done : *error;
+    *done = 0;
+    *error = 0;
+    return make_reply(req, ret_val, NULL, 0, out); // return value: -errno OR bytes_written
+}
+
+static struct rpc_reply *read_resume(char *frame, const struct frame_header *hdr, struct rpc_reply *out);
+
+/*
+ * Stop streaming a read while its client is behind on the replies queued
+ * for it, and carry on with read_resume once it caught up
+ * @param:
+ *    done: bytes of the read sent so far
+ * @return:
+ *    out if the read waits, NULL if the client is not behind
+ */
+static struct rpc_reply *park_read(int fd, size_t count, off_t offset, size_t done, struct rpc_reply *out) {
+    struct lane *lane = current_lane;
+
+    // checked again under the lock of the client by park_lane
+    if (__atomic_load_n(&out->client->out_len, __ATOMIC_RELAXED) <= CLIENT_OUT_LEN)	return NULL;
+    pthread_mutex_lock(&lane->lock);
+    lane->read_fd = fd;
+    lane->read_count = count;
+    lane->read_offset = offset;
+    lane->read_done = done;
+    lane->complete = read_resume;
+    pthread_mutex_unlock(&lane->lock);
+    if (!park_lane(out->client, lane)) {
+        pthread_mutex_lock(&lane->lock);
+        lane->complete = NULL;
+        pthread_mutex_unlock(&lane->lock);
+        return NULL;
+    }
+    no_reply(out);
+    out->deferred = 1;
+    return out;
+}
+
+/*
+ * Read from a file and answer with its content, streamed in chunks
+ * @param:
+ *    hdr: header of the read request
+ *    fd: file to read
+ *    count: bytes wanted
+ *    offset: where to read with pread, -1 to read at the file offset
+ *    done: bytes of it already sent, 0 but when resumed
+ *    out: reply to fill in
+ * @return:
+ *    out
+ */
+static struct rpc_reply *read_reply(const struct frame_header *hdr, int fd, size_t count,
+                                    off_t offset, size_t done, struct rpc_reply *out) {
+    char *buf;
+
+    // A long read is streamed in chunks of at most MAXWRITELEN bytes,
+    // all read into the same buffer, with room for their compressed form
+    // and for the header of each in front
+    size_t cap = count < MAXWRITELEN ? count : MAXWRITELEN;
+    char *packed;
+    int compress = current_lane->session->peer_caps & CAP_COMPRESS;
+    buf = (char *)arena_alloc(&scratch, read_buffer_len(cap, compress));
+    if (buf == NULL) {
+        return make_reply(hdr, -ENOMEM, NULL, 0, out);
+    }
+    buf = read_buffer(buf, cap, compress, &packed);
+
+    while (1) {
+        size_t want = count - done < cap ? count - done : cap;
+        ssize_t byteread = offset < 0 ? read(fd, buf, want) : pread(fd, buf, want, offset + done);
+        if (byteread < 0) {
+            fprintf(stderr, "read errno: %d\n", errno);
+            return make_reply(hdr, -errno, NULL, 0, out);
+        }
+        done += byteread;
+        if ((size_t)byteread < want || done >= count) {
+            // the last chunk, sent from the scratch of the job
+            return read_chunk_reply(hdr, 0, buf, byteread, packed, out); // return value: bytes_read, content
+        }
+
+        if (request_cancelled()) {
+            // the client gave up on the rest, end the stream
+            return make_reply(hdr, -ECANCELED, NULL, 0, out);
+        }
+
+        struct rpc_reply chunk;
+        read_chunk_reply(hdr, FRAME_F_MORE, buf, byteread, packed, &chunk);
+        if (send_message(&chunk, out->client) < 0) {
+            return no_reply(out);
+        }
+        if (park_read(fd, count, offset, done, out) != NULL) {
+            return out;
+        }
+    }
+}
+
+/*
+ * Carry on with a read stopped by park_read
+ */
+static struct rpc_reply *read_resume(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
+    (void)frame; // where the read stopped was left in the lane
+    struct lane *lane = current_lane;
+    return read_reply(hdr, lane->read_fd, lane->read_count, lane->read_offset, lane->read_done, out);
+}
+
+/*
+ * Give back the buffer of the file operation of a lane
+ */
+static void release_op_buf(struct lane *lane) {
+    if (lane->op_buf_index >= 0)	put_ring_buf(lane->op_buf_index);
+    else	free(lane->op_buf);
+    lane->op_buf = NULL;
+    lane->op_buf_index = -1;
+}
+
+static struct rpc_reply *read_done(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
+    (void)frame; // the reply is built from what the operation left in the lane
+    struct lane *lane = current_lane;
+    if (lane->op_res < 0) {
+        release_op_buf(lane);
+        return make_reply(hdr, lane->op_res, NULL, 0, out);
     }
-    return add_len(ret_val, 30); // return value: 0 or -errno
+    read_chunk_reply(hdr, 0, lane->op_buf + REPLY_HEADROOM, lane->op_res, lane->op_packed, out);
+    // the buffer is given back once the reply is sent
+    if (lane->op_buf_index >= 0)	out->release_buf = lane->op_buf_index;
+    else	out->release = lane->op_buf;
+    lane->op_buf = NULL;
+    lane->op_buf_index = -1;
+    return out; // return value: bytes_read, content
+}
+
+/*
+ * Read from a file through the ring, answered by read_done in one frame
+ * @param:
+ *    count: at most MAXWRITELEN
+ *    offset: where to read, -1 to read at the file offset
+ * @return:
+ *    out, NULL to read without the ring
+ */
+static struct rpc_reply *submit_read(int fd, size_t count, off_t offset, struct rpc_reply *out) {
+    struct lane *lane = current_lane;
+    struct io_uring_sqe sqe;
+    int compress = lane->session->peer_caps & CAP_COMPRESS;
+
+    if (offset < 0 && !(uring_features(ring) & IORING_FEAT_RW_CUR_POS))	return NULL;
+    // registered buffers have no room for a compressed copy
+    lane->op_buf_index = compress ? -1 : take_ring_buf();
+    if (lane->op_buf_index >= 0) {
+        lane->op_buf = ring_bufs + (size_t)lane->op_buf_index * RING_BUF_LEN;
+        lane->op_packed = NULL;
+        prep_file_op(&sqe, IORING_OP_READ_FIXED, fd, lane->op_buf + REPLY_HEADROOM, count, (uint64_t)offset);
+        sqe.buf_index = lane->op_buf_index;
+    } else {
+        lane->op_buf = (char *)malloc(read_buffer_len(count, compress));
+        if (lane->op_buf == NULL)	return NULL;
+        char *data = read_buffer(lane->op_buf, count, compress, &lane->op_packed);
+        prep_file_op(&sqe, IORING_OP_READ, fd, data, count, (uint64_t)offset);
+    }
+    if (submit_op(&sqe, read_done, out) == NULL) {
+        release_op_buf(lane);
+        return NULL;
+    }
+    return out;
 }
 
 /*
  * Unmarshall and execute read syscall on server
- * Then marshall the return value and content in a char array
+ * Then marshall the return value and content in a reply frame
  * @return:
- *    bytes_read | content
+ *    bytes_read with content as payload OR -errno
  */
-char *execute_read(char* msg) {
-    int idx = 5;
-    int fd;
-    void* buf;
-    size_t count; // parameters
-
-    fd = ato_int(&msg[idx]);
-    fd -= FD_OFFSET;
-    while (msg[idx] != '|')	idx++;
-    idx++;
-
-    // Count first
-    count = ato_size_t(&msg[idx]);
-
-    buf = (char *)malloc((count + 10) * sizeof(char));
-
-    ssize_t byteread = read(fd, buf, count);
-    char *ret_val;
-    if (byteread < 0) {
-        ret_val = int_to_str(-errno);
-        fprintf(stderr, "read errno: %d\n", errno);
-        return add_neg_len(ret_val, 30);
-    }
-	
-    ret_val = (char *)malloc((byteread + 20) * sizeof(char));
-    char *len_str = ssize_t_to_str(byteread);
-    strcpy(ret_val, len_str);
-    free(len_str);
-    ((char *)buf)[byteread] = '\0';
-    strcat(ret_val, "|");
-    idx = 0;
-    while (ret_val[idx] != '|')	idx++;
-    idx++;
-    memcpy(ret_val + idx, (char *)buf, byteread);
-    
-    free((char*)buf);
-    
-    return ret_val; // return value: bytes_read|content
+struct rpc_reply *execute_read(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
+    struct read_req req;
+    struct arg_reader args;
+    arg_reader_init(&args, frame, hdr);
+    if (decode_read_req(&args, &req) < 0) {
+        return make_reply(hdr, -EINVAL, NULL, 0, out);
+    }
+    int fd = session_fd(req.fd);
+    if (ring != NULL && req.count > 0 && req.count <= MAXWRITELEN &&
+        submit_read(fd, (size_t)req.count, -1, out) != NULL) {
+        return out;
+    }
+    return read_reply(hdr, fd, (size_t)req.count, -1, 0, out);
+}
+
+/*
+ * Unmarshall and execute pread syscall on server, which leaves the
+ * file offset alone
+ * @return:
+ *    bytes_read with content as payload OR -errno
+ */
+struct rpc_reply *execute_pread(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
+    struct pread_req req;
+    struct arg_reader args;
+    arg_reader_init(&args, frame, hdr);
+    if (decode_pread_req(&args, &req) < 0 || req.offset < 0) {
+        return make_reply(hdr, -EINVAL, NULL, 0, out);
+    }
+    int fd = session_fd(req.fd);
+    if (ring != NULL && req.count > 0 && req.count <= MAXWRITELEN &&
+        submit_read(fd, (size_t)req.count, (off_t)req.offset, out) != NULL) {
+        return out;
+    }
+    return read_reply(hdr, fd, (size_t)req.count, (off_t)req.offset, 0, out);
+}
+
+/*
+ * Count a chunk of the write streamed to the lane of the calling worker
+ * @param:
+ *    written: bytes written, -errno on failure
+ *    count: bytes of the chunk
+ */
+static void count_written(int64_t written, size_t count) {
+    struct lane *lane = current_lane;
+    fprintf(stderr, "server write bytes: %d\n", (int)written);
+    if (written < 0) {
+        lane->stream_error = written;
+    }
+    else {
+        lane->stream_done += written;
+        if ((size_t)written < count) {
+            lane->stream_error = -EIO; // short write, later chunks would leave a hole
+        }
+    }
+}
+
+/*
+ * Answer a chunk of a streamed write, only the last chunk is answered
+ * @return:
+ *    out
+ */
+static struct rpc_reply *write_reply(const struct frame_header *hdr, struct rpc_reply *out) {
+    if (hdr->flags & FRAME_F_MORE) {
+        return no_reply(out);
+    }
+    return finish_write(hdr, &current_lane->stream_done, &current_lane->stream_error, out);
+}
+
+static struct rpc_reply *write_done(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
+    (void)frame; // the reply is built from what the operation left in the lane
+    count_written(current_lane->op_res, current_lane->op_len);
+    release_op_buf(current_lane);
+    return write_reply(hdr, out);
 }
 
 /*
  * Unmarshall and execute write syscall on server
- * Then marshall the return value and content in a char array
+ * Then marshall the return value and content in a reply frame
  * @return:
  *    bytes_written OR -errno
  */
-char *execute_write(char* msg) {
+struct rpc_reply *execute_write(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
+    // Progress of a write streamed over several frames, all run by one lane
+    int64_t *stream_error = &current_lane->stream_error;
+
     int fd = 0;
     char *buf;
     size_t count = 0; // parameters
-    int idx = 6;
-    fd = ato_int(&msg[idx]);
-    fd -= FD_OFFSET;
-    while (msg[idx] != '|')	idx++;
-    idx++;
-
-    // Count first
-    count = ato_size_t(&msg[idx]);
-    while (msg[idx] != '|')	idx++;
-    idx++;
-
-    // Start copying content to buf
-    // There may be \0 in the content, so use memcpy instead of strcpy
-    buf = (char *)malloc((count + 1) * sizeof(char));
-    memcpy(buf, msg + idx, count);
-
-    ssize_t write_bytes = write(fd, buf, count);
-    fprintf(stderr, "server write bytes: %d\n", (int)write_bytes);
-    char *ret_val;
-    if (write_bytes < 0) {
-        ret_val = int_to_str(-errno);
+
+    struct write_req req;
+    struct arg_reader args;
+    arg_reader_init(&args, frame, hdr);
+    if (decode_write_req(&args, &req) < 0) {
+        *stream_error = -EINVAL; // req is not filled in, the chunk is drained
     }
     else {
-        ret_val = ssize_t_to_str(write_bytes);
+        fd = session_fd(req.fd);
     }
 
-    free(buf);
-    
-    return add_len(ret_val, 30); // return value: -errno OR bytes_written
+    // The content is the payload, and its length is the count
+    // There may be \0 in the content, so it is never treated as a string
+    buf = frame_payload(frame, hdr);
+    count = frame_payload_len(hdr);
+
+    // Once a chunk failed, the rest of the stream is drained without writing
+    // A compressed content is expanded here, before it reaches the file
+    char *raw = NULL;
+    if (*stream_error == 0 && (hdr->flags & FRAME_F_LZ)) {
+        size_t raw_len = compressed_raw_len(buf, count);
+        ssize_t n = -1;
+        if (raw_len > 0 && raw_len <= MAXWRITELEN && (raw = (char *)arena_alloc(&scratch, raw_len)) != NULL) {
+            n = decompress_payload(buf, count, raw, raw_len);
+        }
+        if (n < 0) {
+            *stream_error = -EPROTO;
+        }
+        buf = raw;
+        count = n;
+    }
+
+    // a chunk expanded into the scratch of this worker is written here,
+    // the scratch does not outlive the job
+    if (*stream_error == 0 && raw == NULL && ring != NULL && (uring_features(ring) & IORING_FEAT_RW_CUR_POS)) {
+        struct io_uring_sqe sqe;
+        prep_file_op(&sqe, IORING_OP_WRITE, fd, buf, count, (uint64_t)-1);
+        current_lane->op_len = count;
+        if (submit_op(&sqe, write_done, out) != NULL)	return out;
+    }
+    if (*stream_error == 0) {
+        ssize_t write_bytes = write(fd, buf, count);
+        count_written(write_bytes < 0 ? -errno : write_bytes, count);
+    }
+    return write_reply(hdr, out);
 }
 
 /*
  * Unmarshall and execute lseek syscall on server
- * Then marshall the return value and content in a char array
+ * Then marshall the return value and content in a reply frame
  * @return:
  *    offset OR -errno
  */
-char *execute_lseek(char* msg) {
+struct rpc_reply *execute_lseek(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
     int fd;
     off_t offset;
     int whence; // parameters
 
-    int idx = 6;
-    fd = ato_int(&msg[idx]);
-    fd -= FD_OFFSET;
-    while (msg[idx] != '|')	idx++;
-    idx++;
-
-    offset = ato_off_t(&msg[idx]);
-    while (msg[idx] != '|')	idx++;
-    idx++;
-
-    whence = ato_int(&msg[idx]);
+    struct lseek_req req;
+    struct arg_reader args;
+    arg_reader_init(&args, frame, hdr);
+    if (decode_lseek_req(&args, &req) < 0) {
+        return make_reply(hdr, -EINVAL, NULL, 0, out);
+    }
+    fd = session_fd(req.fd);
+    offset = (off_t)req.offset;
+    whence = req.whence;
 
     off_t ret_offset = lseek(fd, offset, whence);
-    char *ret_val;
+    int64_t ret_val;
     if (ret_offset < 0) {
-        ret_val = int_to_str(-errno);
+        ret_val = -errno;
     }
     else {
-        ret_val = off_t_to_str(ret_offset);
+        ret_val = ret_offset;
+    }
+    return make_reply(hdr, ret_val, NULL, 0, out); // return value: offset or -errno
+}
+
+static struct rpc_reply *stat_reply(const struct frame_header *hdr, uint32_t mask, const struct stat *buf,
+                                    struct rpc_reply *out);
+
+static struct rpc_reply *stat_done(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
+    const struct statx *stx = &current_lane->op_statx;
+    struct stat_req req;
+    struct arg_reader args;
+    struct stat buf;
+
+    if (current_lane->op_res < 0) {
+        return make_reply(hdr, current_lane->op_res, NULL, 0, out); // return value: -errno
     }
-    return add_len(ret_val, 30); // return value: offset or -errno
+    arg_reader_init(&args, frame, hdr);
+    decode_stat_req(&args, &req);
+
+    memset(&buf, 0, sizeof(buf));
+    buf.st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    buf.st_ino = stx->stx_ino;
+    buf.st_mode = stx->stx_mode;
+    buf.st_nlink = stx->stx_nlink;
+    buf.st_uid = stx->stx_uid;
+    buf.st_gid = stx->stx_gid;
+    buf.st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    buf.st_size = stx->stx_size;
+    buf.st_blksize = stx->stx_blksize;
+    buf.st_blocks = stx->stx_blocks;
+    buf.st_atim.tv_sec = stx->stx_atime.tv_sec;
+    buf.st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    buf.st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    buf.st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    buf.st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    buf.st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+    return stat_reply(hdr, req.mask, &buf, out);
 }
 
 /*
- * Unmarshall and execute __xstat syscall on server
- * Then marshall the return value and content in a char array
+ * Unmarshall and execute stat on server
+ * Then marshall the return value and the requested fields in a reply frame
+ * Only the fields selected by the request mask are sent back, and the
+ * reply mask tells the client which ones it got
  * @return:
- *    0 OR -errno
+ *    0 with the stat fields as payload OR -errno
  */
-char *execute_stat(char* msg) {
-    int ver;
+struct rpc_reply *execute_stat(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
     char *path;
-    struct stat *buf;
+    struct stat buf;
 
-    int idx = 8;
-    ver = ato_int(&msg[idx]);
-    while (msg[idx] != '|')	idx++;
-    idx++;
+    struct stat_req req;
+    struct arg_reader args;
+    arg_reader_init(&args, frame, hdr);
+    if (decode_stat_req(&args, &req) < 0) {
+        return make_reply(hdr, -EINVAL, NULL, 0, out);
+    }
+    path = frame_payload(frame, hdr);
 
-    path = (char *)malloc(700 * sizeof(char));
-    int path_idx = 0;
-    while (msg[idx] != '|')	{
-        path[path_idx] = msg[idx];
-        idx++; path_idx++;
+    if (ring != NULL) {
+        struct io_uring_sqe sqe;
+        prep_path_op(&sqe, IORING_OP_STATX, path);
+        sqe.len = STATX_BASIC_STATS;
+        sqe.off = (uintptr_t)&current_lane->op_statx;
+        if (submit_op(&sqe, stat_done, out) != NULL)	return out;
     }
-    path[path_idx] = '\0';
-    idx++;
+    if (stat(path, &buf) < 0) {
+        return make_reply(hdr, -errno, NULL, 0, out); // return value: -errno
+    }
+    return stat_reply(hdr, req.mask, &buf, out);
+}
 
-    buf = ato_stat(&msg[idx]);
+/*
+ * fstat of an fd of the session, answered like a stat
+ * @return:
+ *    out
+ */
+struct rpc_reply *execute_fstat(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
+    struct stat buf;
 
-    int stat_ret = __xstat(ver, path, buf);
-    char *ret_val;
-    if (stat_ret < 0) {
-        ret_val = int_to_str(-errno);
+    struct fstat_req req;
+    struct arg_reader args;
+    arg_reader_init(&args, frame, hdr);
+    if (decode_fstat_req(&args, &req) < 0) {
+        return make_reply(hdr, -EINVAL, NULL, 0, out);
     }
-    else {
-        ret_val = int_to_str(stat_ret);
+    if (fstat(session_fd(req.fd), &buf) < 0) {
+        return make_reply(hdr, -errno, NULL, 0, out); // return value: -errno
     }
-    
-    free(path);
-    
-    return add_len(ret_val, 30); // return value: 0 or -errno
+    return stat_reply(hdr, req.mask, &buf, out);
+}
+
+/*
+ * Answer a stat with the fields of buf the request asked for
+ * @return:
+ *    out
+ */
+static struct rpc_reply *stat_reply(const struct frame_header *hdr, uint32_t mask, const struct stat *buf,
+                                    struct rpc_reply *out) {
+    struct stat_reply reply = {.ret = 0, .mask = mask & STAT_F_ALL};
+    char reply_args[stat_reply_max_len];
+    char *fields = reply_payload(out);
+    int codec = frame_codec(hdr);
+    int args_len = pack_stat_reply(reply_args, codec, &reply);
+    int fields_len = pack_stat_fields(fields, codec, reply.mask, buf);
+
+    return build_reply_in_place(hdr, 0, reply_args, args_len, fields, fields_len, out); // return value: 0, mask, fields
+}
+
+static struct rpc_reply *unlink_done(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
+    (void)frame; // the reply is built from what the operation left in the lane
+    return make_reply(hdr, current_lane->op_res, NULL, 0, out); // return value: 0 or -errno
 }
 
 /*
  * Unmarshall and execute unlink syscall on server
- * Then marshall the return value and content in a char array
+ * Then marshall the return value and content in a reply frame
  * @return:
  *    0 OR -errno
  */
-char *execute_unlink(char* msg) {
-    char *pathname = &msg[7];
+struct rpc_reply *execute_unlink(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
+    char *pathname = frame_payload(frame, hdr);
 
+    if (ring != NULL) {
+        struct io_uring_sqe sqe;
+        prep_path_op(&sqe, IORING_OP_UNLINKAT, pathname);
+        if (submit_op(&sqe, unlink_done, out) != NULL)	return out;
+    }
     int unlink_ret = unlink(pathname);
-    char *ret_val;
+    int64_t ret_val;
     if (unlink_ret < 0) {
-        ret_val = int_to_str(-errno);
+        ret_val = -errno;
     }
     else {
-        ret_val = int_to_str(unlink_ret);
+        ret_val = unlink_ret;
     }
-    return add_len(ret_val, 30); // return value: 0 or -errno
+    return make_reply(hdr, ret_val, NULL, 0, out); // return value: 0 or -errno
 }
 
 /*
  * Unmarshall and execute getdirentries syscall on server
- * Then marshall the return value and content in a char array
+ * Then marshall the return value and content in a reply frame
  * @return:
- *    bytes_transferred|contents OR -errno
+ *    bytes_transferred, new base with contents as payload OR -errno
  */
-char *execute_getdirentries(char* msg) {
+struct rpc_reply *execute_getdirentries(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
     int fd;
     char *buf;
     size_t nbytes;
     off_t *basep; // parameters
 
-    int idx = 14;
-    fd = ato_int(&msg[idx]);
-    fd -= FD_OFFSET;
-    while (msg[idx] != '|')	idx++;
-    idx++;
-
-    nbytes = ato_size_t(&msg[idx]);
-    while (msg[idx] != '|')	idx++;
-    idx++;
-
-    off_t offset = ato_off_t(&msg[idx]);
+    struct getdirentries_req req;
+    struct arg_reader args;
+    arg_reader_init(&args, frame, hdr);
+    if (decode_getdirentries_req(&args, &req) < 0) {
+        return make_reply(hdr, -EINVAL, NULL, 0, out);
+    }
+    fd = session_fd(req.fd);
+    nbytes = (size_t)req.nbytes;
+    if (nbytes > MAXWRITELEN) {
+        nbytes = MAXWRITELEN; // a short read of the directory, the client asks for the rest
+    }
+    off_t offset = (off_t)req.base;
     basep = &offset;
-    // Start copying content to buf
-    // There may be \0 in the content, so we copy them 1 by 1
-    buf = (char *)malloc((nbytes + 1) * sizeof(char));
+    // the entries are read behind the headroom of the reply
+    buf = (char *)arena_alloc(&scratch, REPLY_HEADROOM + nbytes);
+    if (buf == NULL) {
+        return make_reply(hdr, -ENOMEM, NULL, 0, out);
+    }
+    buf += REPLY_HEADROOM;
 
     ssize_t ret_val = getdirentries(fd, buf, nbytes, basep);
 
     if (ret_val < 0) {
-        char *ret_str = int_to_str(-errno);
         fprintf(stderr, "getdirentries: server errno: %d\n", (int)errno);
-        return add_len(ret_str, 30);
+        return make_reply(hdr, -errno, NULL, 0, out);
     }
 
-    char *ret = (char *)malloc((nbytes + 30) * sizeof(char));
-    char *len_str = ssize_t_to_str(ret_val);
-    strcpy(ret, len_str); // get bytes transferred
-    free(len_str);
-    strcat(ret, "|");
-    
-    char *traverse = ret;
-    while (*traverse != '|')	traverse++;
-    traverse++;
-    
-    int i = 0;
-    for (i = 0; i < ret_val; i++) {
-        traverse[i] = buf[i];
-    }
-    traverse[i] = '\0';
-    free(buf);
-    return ret; // return value: -errno OR bytes_transferrer|contents
+    // The new base follows the return value, so the client can update *basep
+    struct getdirentries_reply reply = {.ret = ret_val, .base = *basep};
+    char reply_args[getdirentries_reply_max_len];
+    int args_len = pack_getdirentries_reply(reply_args, frame_codec(hdr), &reply);
+
+    return build_reply_in_place(hdr, 0, reply_args, args_len, buf, ret_val, out); // return value: -errno OR bytes_transferred, base, contents
 }
 
 /*
  * Unmarshall and execute getdirtree function on server
- * Then marshall the return value and content in a char array
+ * Then marshall the return value and content in a reply frame
  * @return:
- *    len_of_return|contents OR -errno
+ *    len_of_return with contents as payload OR -errno
  */
-char *execute_getdirtree(char* msg) {
-    char *path = &msg[11]; // parameter
+struct rpc_reply *execute_getdirtree(char *frame, const struct frame_header *hdr, struct rpc_reply *out) {
+    char *path = frame_payload(frame, hdr); // parameter
 
     struct dirtreenode *ret_dirtreenode = getdirtree(path);
     if (ret_dirtreenode == NULL) {
-        return add_len(int_to_str(-errno), 30);
-    }
-    char *ret_val = dirtreenode_to_str(ret_dirtreenode);
-    int len = strlen(ret_val);
-    char *ret = int_to_str(len);
-    char *new_space = (char *)malloc(1000 * sizeof(char));
-    strcpy(new_space, ret);
-    strcat(new_space, "|");
-    free(ret);
+        return make_reply(hdr, -errno, NULL, 0, out);
+    }
+    size_t len = dirtreenode_str_len(ret_dirtreenode);
+    char *ret_val = (char *)arena_alloc(&scratch, REPLY_HEADROOM + len);
+    if (ret_val == NULL) {
+        freedirtree(ret_dirtreenode);
+        return make_reply(hdr, -ENOMEM, NULL, 0, out);
+    }
+    ret_val += REPLY_HEADROOM;
+    dirtreenode_to_buf(ret_dirtreenode, ret_val);
     freedirtree(ret_dirtreenode);
-    char *final_val = strcat(new_space, ret_val);
-    free(ret_val);
-    return final_val;// return value: -errno OR len_of_return|contents
+
+    struct reply reply = {.ret = (int64_t)len};
+    char reply_args[reply_max_len];
+    int args_len = pack_reply(reply_args, frame_codec(hdr), &reply);
+    return build_reply_in_place(hdr, 0, reply_args, args_len, ret_val, len, out); // return value: -errno OR len_of_return, contents
 }
 
 /*
- * Wrapper of sending message.
- * I insert 4 byte of int to denote how many bytes behind to transfer
- * Keep sending until all bytes are sent
- * @return: number of bytes sent, or -1 if error occurred
- */
-int send_message(int len, char *msg, int sockfd) {
-    // send message to server
-    char *msgLen = (char *)malloc((4 + len) * sizeof(char));//int_to_str(len);
-    memcpy(msgLen, &len, 4);
-    memcpy(msgLen + 4, msg, len);
-    int byte_send = 0;
-    len += 4;
-    
-    while (byte_send < len) {
-        int sd = send(sockfd, msgLen + byte_send, len - byte_send, 0);
-        byte_send += sd;
-    }
-    free(msgLen);
-    return byte_send;
+ * fd of the session of the calling worker, as its client sent it
+ * @param:
+ *    wire_fd: FD_OFFSET + fd
+ * @return:
+ *    the fd, -1 if the session did not open it, which system calls
+ *    fail with EBADF
+ */
+int session_fd(int wire_fd) {
+    int fd = wire_fd - FD_OFFSET;
+    if (fd < 0 || fd >= MAXFDS)	return -1;
+    if (__atomic_load_n(&fd_owner[fd], __ATOMIC_ACQUIRE) != current_lane->session)	return -1;
+    return fd;
 }
 
 /*
- * Wrapper of receiving message.
- * Receive the first 4 byte of int to denote how many bytes behind to be received
- * Keep receiving until all bytes have been received
- * @return: number of bytes received, or -1 if error occurred
+ * Record a file opened by the session of the calling worker
+ * @return:
+ *    0 on success, -1 if it is past the fds a client tells apart
  */
-int  receive_message(int sockfd, char *connection_buf, int mallocLen) {
-    int recv_byte = 0;
-    memset(connection_buf, 0, mallocLen);
-    
-    int len;
-    int first_time = 1;
-    
-    while (1) {
-        int rv = recv(sockfd, connection_buf + recv_byte, mallocLen, 0);
-        if (rv < 0) err(1, 0);
-        if (rv == 0)	return 0;
-        recv_byte += rv;
-        if (first_time == 1) {
-            first_time = 0;
-            memcpy(&len, connection_buf, 4);
-        }
-        if (len + 4 <= recv_byte)	 break;
-    }
-    connection_buf[recv_byte] = 0;
-    return recv_byte;
+int own_fd(int fd) {
+    if (fd >= MAXFDS)	return -1;
+    __atomic_add_fetch(&current_lane->session->open_fds, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&fd_owner[fd], current_lane->session, __ATOMIC_RELEASE);
+    // without a fixed slot, the ring is given the fd itself
+    if (fd < ring_files && uring_update_file(ring, fd, fd) == 0)	ring_fixed[fd] = 1;
+    return 0;
 }
 
-int main(int argc, char **argv) {
-    char *serverport;
-    unsigned short port;
-    int sockfd, rv;
-    struct sockaddr_in srv, cli;
-    socklen_t sa_size;
-
-    // Get environment variable indicating the port of the server
-    serverport = getenv("serverport15440");
-    if (serverport)	port = (unsigned short)atoi(serverport);
-    else	port = 15440;
-
-    // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)	err(1, 0);
-
-    // Setup address structure to indicate server port
-    memset(&srv, 0, sizeof(srv));
-    srv.sin_family = AF_INET;
-    srv.sin_addr.s_addr = htonl(INADDR_ANY);
-    srv.sin_port = htons(port);
-
-    // bind to port
-    rv = bind(sockfd, (struct sockaddr *)&srv, sizeof(struct sockaddr));
-    if (rv < 0)	err(1, 0);
-
-    // start listening for connections
-    rv = listen(sockfd, 127);
-    if (rv < 0)	err(1, 0);
-
-    if (signal(SIGCHLD, SIG_IGN) == SIG_ERR) {
-        perror(0);
-        exit(1);
-    }
-    
-    while (1) {
-        // wait for next client, get session socket
-        sa_size = sizeof(struct sockaddr_in);
-        int sessfd = accept(sockfd, (struct sockaddr *)&cli, &sa_size);
-        if (sessfd < 0)	err(1, 0);
-        
-        // get messages and send replies to this client,
-        // until it goes a way
-        pid_t pid = fork();
-        if (pid == 0) { // child process
-            close(sockfd);
-            while (1) {
-                
-                char *buf = (char *)malloc(MAXWRITELEN * sizeof(char));
-                int crv = receive_message(sessfd, buf, MAXWRITELEN);
-                if (crv == 0) {
-                    free(buf);
-                    close(sessfd);
-                    return 0;
-                }
-                if (crv < 0) {
-                    err(1, 0);
-                }
-                
-                // Unmarshalling the message, and execute it
-                char *ret_val = unmarshalling_method(buf + 4);
-                int len = 0, lenlen = 0;
-                char *start = ret_val;
-                if (*start == '-') {
-                    start++; // deal with read
-                    lenlen++;
-                }
-                while (*start != '|') {
-                    len = len * 10 + *start - '0';
-                    start++;
-                    lenlen++;
-                }
-                start++;
-                
-                send_message(len + lenlen + 1, ret_val, sessfd);
-                
-                free(buf);
-                free(ret_val);
-            }
-        }else {
-            close(sessfd);
-        }
-        
+/*
+ * Forget the session a file belongs to, before it is closed
+ */
+static void forget_fd(int fd) {
+    __atomic_store_n(&fd_owner[fd], NULL, __ATOMIC_RELEASE);
+    if (ring_fixed[fd]) {
+        // the slot holds the file open
+        uring_update_file(ring, fd, -1);
+        ring_fixed[fd] = 0;
     }
-    
-    close(sockfd);
-    
-    return 0;
 }
 
 /*
- * Add length infomation to a string by append length in front of a char array
- * then separate them with a '|'
- * @param:
- *    str: char array to append length info
- *    count: number of characters to allocate the new char array
+ * Give up a file of the session of the calling worker, before closing it
+ * so that another session opening the same number keeps its entry
  * @return:
- *    Ptr to the new char array, len|return content OR errno
+ *    the fd, -1 if the session did not open it
  */
-char *add_len(char *str, int count) {
-    int len = strlen(str);
-    char *ret = (char *)malloc(count * sizeof(char));
-    char *len_str = int_to_str(len);
-    strcpy(ret, len_str);
-    free(len_str);
-    strcat(ret, "|");
-    char *ret_val = strcat(ret, str);
-    free(str);
-    return ret_val;
+int disown_fd(int wire_fd) {
+    int fd = session_fd(wire_fd);
+    if (fd < 0)	return -1;
+    forget_fd(fd);
+    __atomic_sub_fetch(&current_lane->session->open_fds, 1, __ATOMIC_RELAXED);
+    return fd;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
 /*
- * Add negative length infomation to a string by append length in front of a char array
- * then separate them with a '|'
- * This function is used in read syscall to distinguish read content and error number
- * @param:
- *    str: char array to append length info
- *    count: number of characters to allocate the new char array
- * @return:
- *    Ptr to the new char array, -len|errno
- */
-char *add_neg_len(char *str, int count) {
-    int len = strlen(str);
-    char *ret = (char *)malloc(count * sizeof(char));
-    char *len_str = int_to_str(-len);
-    strcpy(ret, len_str);
-    free(len_str);
-    strcat(ret, "|");
-    return strcat(ret, str);
+ * Take a free registered buffer
+ * @return:
+ *    its index, -1 if there is none
+ */
+int take_ring_buf(void) {
+    int index = -1;
+    pthread_mutex_lock(&ring_bufs_lock);
+    if (ring_nfree > 0)	index = ring_free[--ring_nfree];
+    pthread_mutex_unlock(&ring_bufs_lock);
+    return index;
+}
+
+/*
+ * Give back a registered buffer
+ * @param:
+ *    index: of the buffer, -1 for none
+ */
+void put_ring_buf(int index) {
+    if (index < 0)	return;
+    pthread_mutex_lock(&ring_bufs_lock);
+    ring_free[ring_nfree++] = index;
+    pthread_mutex_unlock(&ring_bufs_lock);
+}
+
+/*
+ * Prepare an operation on a file, by its fixed slot if it has one
+ * @param:
+ *    offset: where in the file, (uint64_t)-1 for the file offset
+ */
+void prep_file_op(struct io_uring_sqe *sqe, int opcode, int fd, void *buf, size_t len, uint64_t offset) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    if (fd >= 0 && fd < ring_files && ring_fixed[fd])	sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->off = offset;
+}
+
+/*
+ * Prepare an operation on a path, relative to the server directory
+ */
+void prep_path_op(struct io_uring_sqe *sqe, int opcode, const char *path) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)path;
+}
+
+/*
+ * Hand the file operation of the calling worker's job to the ring
+ * The worker goes on with other lanes; once the operation completed,
+ * a worker finishes the job with complete, the lane staying off the run
+ * queue until then so its other jobs keep their order
+ * @param:
+ *    sqe: the operation, prepared
+ *    complete: finishes the job from current_lane->op_res
+ *    out: reply of the job
+ * @return:
+ *    out, NULL if the ring is full, for the caller to do the operation itself
+ */
+struct rpc_reply *submit_op(struct io_uring_sqe *sqe, op_complete complete, struct rpc_reply *out) {
+    struct lane *lane = current_lane;
+
+    // completions never outnumber what the ring holds
+    int depth = __atomic_add_fetch(&ring_inflight, 1, __ATOMIC_RELAXED);
+    if (depth > (int)uring_entries(ring)) {
+        __atomic_sub_fetch(&ring_inflight, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    pthread_mutex_lock(&lane->lock);
+    lane->complete = complete;
+    lane->op_start = now_ns();
+    pthread_mutex_unlock(&lane->lock);
+
+    sqe->user_data = (uintptr_t)lane;
+    if (uring_submit(ring, sqe) < 0) {
+        __atomic_sub_fetch(&ring_inflight, 1, __ATOMIC_RELAXED);
+        lane->complete = NULL;
+        return NULL;
+    }
+    int most = __atomic_load_n(&ring_max_inflight, __ATOMIC_RELAXED);
+    while (depth > most && !__atomic_compare_exchange_n(&ring_max_inflight, &most, depth, 0,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    no_reply(out);
+    out->deferred = 1;
+
+    // an operation served from the page cache has often completed already;
+    // reaping it here spares waking the reaping thread
+    struct io_uring_cqe cqes[16];
+    int n = uring_reap(ring, cqes, 16);
+    if (n > 0)	complete_ops(cqes, n);
+    if (__atomic_load_n(&ring_inflight, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&ring_wait_lock);
+        pthread_cond_signal(&ring_pending);
+        pthread_mutex_unlock(&ring_wait_lock);
+    }
+    return out;
+}
+
+/*
+ * Put the lanes of completed operations back on the run queue
+ */
+static void complete_ops(struct io_uring_cqe *cqes, int n) {
+    uint64_t now = now_ns();
+    int i;
+
+    for (i = 0; i < n; i++) {
+        struct lane *lane = (struct lane *)(uintptr_t)cqes[i].user_data;
+        pthread_mutex_lock(&lane->lock);
+        lane->op_res = cqes[i].res;
+        __atomic_add_fetch(&ring_ns, now - lane->op_start, __ATOMIC_RELAXED);
+        make_ready(lane);
+        pthread_mutex_unlock(&lane->lock);
+    }
+    __atomic_add_fetch(&ring_ops, n, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&ring_inflight, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Reap the completions of the ring, forever
+ * It only waits on the ring while operations are in flight, so that
+ * the ones a worker reaps itself do not wake it
+ */
+void *ring_main(void *arg) {
+    struct io_uring_cqe cqes[64];
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&ring_wait_lock);
+        while (__atomic_load_n(&ring_inflight, __ATOMIC_RELAXED) == 0) {
+            pthread_cond_wait(&ring_pending, &ring_wait_lock);
+        }
+        pthread_mutex_unlock(&ring_wait_lock);
+        int n = uring_wait(ring, cqes, 64);
+        if (n < 0)	err(1, "io_uring");
+        complete_ops(cqes, n);
+    }
+}
+
+/*
+ * Print how the ring of this process fared
+ * Completion latency runs from submission to reaping
+ */
+void print_ring_stats(void) {
+    uint64_t ops = __atomic_load_n(&ring_ops, __ATOMIC_RELAXED);
+    uint64_t ns = __atomic_load_n(&ring_ns, __ATOMIC_RELAXED);
+    fprintf(stderr, "server: io_uring %llu ops, mean completion %.1f us, %d in flight, %d at most\n",
+            (unsigned long long)ops, ops ? ns / 1e3 / ops : 0.0,
+            __atomic_load_n(&ring_inflight, __ATOMIC_RELAXED), ring_max_inflight);
+}
+
+/*
+ * Set up the io_uring of this process, with fixed files and registered
+ * buffers when the kernel allows them, and the thread reaping it
+ * Requests run without it if it cannot be set up
+ */
+void start_ring(void) {
+    struct rlimit rl;
+    int i;
+
+    if ((ring = uring_open(URING_ENTRIES)) == NULL) {
+        perror("server: io_uring");
+        return;
+    }
+    int files = MAXFDS;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)files)	files = (int)rl.rlim_cur;
+    if (uring_register_files(ring, files) == 0)	ring_files = files;
+    else	perror("server: io_uring fixed files");
+
+    ring_bufs = mmap(NULL, (size_t)URING_BUFS * RING_BUF_LEN, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct iovec iov[URING_BUFS];
+    for (i = 0; ring_bufs != MAP_FAILED && i < URING_BUFS; i++) {
+        iov[i].iov_base = ring_bufs + (size_t)i * RING_BUF_LEN;
+        iov[i].iov_len = RING_BUF_LEN;
+    }
+    if (ring_bufs == MAP_FAILED || uring_register_buffers(ring, iov, URING_BUFS) < 0) {
+        perror("server: io_uring buffers");
+        if (ring_bufs != MAP_FAILED)	munmap(ring_bufs, (size_t)URING_BUFS * RING_BUF_LEN);
+        ring_bufs = NULL;
+    } else {
+        for (i = 0; i < URING_BUFS; i++)	ring_free[i] = i;
+        ring_nfree = URING_BUFS;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, ring_main, NULL) != 0)	err(1, 0);
+    pthread_detach(thread);
+}
+
+static void hold_session(struct session *sess) {
+    __atomic_add_fetch(&sess->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Let go of a session, the last hold closes its files and frees it
+ */
+static void release_session(struct session *sess) {
+    int i;
+    if (__atomic_sub_fetch(&sess->refs, 1, __ATOMIC_ACQ_REL) > 0)	return;
+
+    for (i = 0; i < MAXFDS && sess->open_fds > 0; i++) {
+        if (fd_owner[i] == sess) {
+            forget_fd(i);
+            close(i);
+            sess->open_fds--;
+        }
+    }
+    for (i = 0; i < SESSION_LANES; i++) {
+        pthread_mutex_destroy(&sess->lanes[i].lock);
+    }
+    free(sess);
+}
+
+/*
+ * Session a new connection starts with, held by it
+ * @return:
+ *    the session, NULL if out of memory
+ */
+static struct session *new_session(void) {
+    struct session *sess = (struct session *)calloc(1, sizeof(struct session));
+    int i;
+    if (sess == NULL)	return NULL;
+    for (i = 0; i < SESSION_LANES; i++) {
+        sess->lanes[i].session = sess;
+        sess->lanes[i].op_buf_index = -1;
+        pthread_mutex_init(&sess->lanes[i].lock, NULL);
+    }
+    sess->refs = 1;
+    return sess;
+}
+
+/*
+ * Client of a new connection, held by the caller
+ * @return:
+ *    the client, NULL if out of memory
+ */
+static struct client *new_client(struct conn *conn) {
+    struct client *c = (struct client *)calloc(1, sizeof(struct client));
+    if (c == NULL)	return NULL;
+    if ((c->session = new_session()) == NULL) {
+        free(c);
+        return NULL;
+    }
+    c->session->client = c;
+    c->conn = conn;
+    c->serial = __atomic_add_fetch(&last_id, 1, __ATOMIC_RELAXED);
+    pthread_mutex_init(&c->send_lock, NULL);
+    pthread_mutex_init(&c->watch_lock, NULL);
+    pthread_cond_init(&c->room, NULL);
+    pthread_mutex_init(&c->jobs_lock, NULL);
+    c->ep = -1;
+    c->refs = 1;
+    return c;
+}
+
+static void hold_client(struct client *c) {
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Let go of a client, the last hold closes its connection and frees it
+ */
+static void release_client(struct client *c) {
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) > 0)	return;
+    conn_close(c->conn);
+    pthread_mutex_destroy(&c->send_lock);
+    pthread_mutex_destroy(&c->watch_lock);
+    pthread_cond_destroy(&c->room);
+    pthread_mutex_destroy(&c->jobs_lock);
+    while (c->out_head != NULL) {
+        struct out_chunk *o = c->out_head;
+        c->out_head = o->next;
+        free(o);
+    }
+    if (c->job != NULL) {
+        free(c->job->frame);
+        free(c->job);
+    }
+    while (c->free_jobs != NULL) {
+        struct lane_job *job = c->free_jobs;
+        c->free_jobs = job->next;
+        free(job->frame);
+        free(job);
+    }
+    free(c);
+}
+
+/*
+ * @return:
+ *    1 if a client has so many requests unanswered, or so many bytes of
+ *    replies it did not take yet, that it is not received from until
+ *    they drain
+ */
+static int client_full(struct client *c) {
+    return __atomic_load_n(&c->busy_jobs, __ATOMIC_RELAXED) >= CLIENT_BUSY_JOBS ||
+           __atomic_load_n(&c->busy_len, __ATOMIC_RELAXED) >= CLIENT_BUSY_LEN ||
+           __atomic_load_n(&c->out_len, __ATOMIC_RELAXED) > CLIENT_OUT_LEN;
+}
+
+/*
+ * Register a client with the epoll instance of the reactor, for what
+ * there is to do with its socket: receive unless it is full, and send
+ * the replies queued while the socket was. A client with nothing to do
+ * is taken off, so that a hangup is not reported over and over until
+ * it has room again
+ * Over shm, wakes its thread if it has room
+ * @return: 0 on success, -1 if it could not be registered
+ */
+static int watch_client(struct client *c) {
+    int rv = 0;
+
+    pthread_mutex_lock(&c->watch_lock);
+    uint32_t events = 0;
+    if (!client_full(c)) {
+        events |= EPOLLIN;
+        pthread_cond_signal(&c->room);
+    }
+    if (__atomic_load_n(&c->out_len, __ATOMIC_RELAXED) > 0)	events |= EPOLLOUT;
+    if (c->ep >= 0 && events != c->watched) {
+        struct epoll_event ev = {.events = events, .data.ptr = c};
+        if (events == 0)	rv = epoll_ctl(c->ep, EPOLL_CTL_DEL, c->conn->fd, NULL);
+        else	rv = epoll_ctl(c->ep, c->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->conn->fd, &ev);
+        if (rv == 0)	c->watched = events;
+    }
+    pthread_mutex_unlock(&c->watch_lock);
+    return rv;
+}
+
+/*
+ * @return:
+ *    1 if a buffer of cap bytes suits a frame of len bytes better than
+ *    one of best bytes: it holds the frame with less to spare, or neither
+ *    holds it and it is larger
+ */
+static int fits_better(size_t cap, size_t best, size_t len) {
+    if (cap >= len)	return best < len || cap < best;
+    return best < len && cap > best;
+}
+
+/*
+ * Job to receive a frame of a client into
+ * A finished job of the client is reused, the smallest whose buffer
+ * holds the frame, otherwise the largest, grown to hold it
+ * @param:
+ *    len: bytes of the frame, prefix included
+ * @return:
+ *    the job, NULL if out of memory
+ */
+static struct lane_job *take_job(struct client *c, size_t len) {
+    struct lane_job *job, **link, **best = NULL;
+
+    pthread_mutex_lock(&c->jobs_lock);
+    for (link = &c->free_jobs; *link != NULL; link = &(*link)->next) {
+        if (best == NULL || fits_better((*link)->frame_cap, (*best)->frame_cap, len))	best = link;
+    }
+    job = NULL;
+    if (best != NULL) {
+        job = *best;
+        *best = job->next;
+        c->nfree_jobs--;
+        c->free_jobs_len -= job->frame_cap;
+    }
+    pthread_mutex_unlock(&c->jobs_lock);
+
+    if (job == NULL && (job = (struct lane_job *)calloc(1, sizeof(struct lane_job))) == NULL)	return NULL;
+    if (job->frame_cap < len) {
+        // nothing of the old frame is kept, so it is not copied
+        free(job->frame);
+        job->frame_cap = 0;
+        if ((job->frame = (char *)malloc(len)) == NULL) {
+            free(job);
+            return NULL;
+        }
+        job->frame_cap = len;
+    }
+    job->client = c;
+    job->next = NULL;
+    __atomic_add_fetch(&c->busy_jobs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->busy_len, job->frame_cap, __ATOMIC_RELAXED);
+    return job;
+}
+
+/*
+ * Give a finished job back to the client it came from, for a later frame
+ * Called before letting go of the client
+ */
+static void put_job(struct lane_job *job) {
+    struct client *c = job->client;
+
+    __atomic_sub_fetch(&c->busy_jobs, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&c->busy_len, job->frame_cap, __ATOMIC_RELAXED);
+    // receiving from the client again if that made room
+    watch_client(c);
+
+    pthread_mutex_lock(&c->jobs_lock);
+    if (c->nfree_jobs < CLIENT_JOBS && c->free_jobs_len + job->frame_cap <= CLIENT_JOBS_LEN) {
+        job->next = c->free_jobs;
+        c->free_jobs = job;
+        c->nfree_jobs++;
+        c->free_jobs_len += job->frame_cap;
+        job = NULL;
+    }
+    pthread_mutex_unlock(&c->jobs_lock);
+
+    if (job != NULL) {
+        free(job->frame);
+        free(job);
+    }
+}
+
+/*
+ * Make a session resumable, with a new id and key
+ * @return:
+ *    0 on success, -1 if no key could be drawn
+ */
+static int start_session(struct session *sess) {
+    uint64_t key;
+    if (getrandom(&key, sizeof(key), 0) != sizeof(key) || key == 0)	return -1;
+
+    pthread_mutex_lock(&sessions_lock);
+    sess->id = __atomic_add_fetch(&last_id, 1, __ATOMIC_RELAXED);
+    sess->key = key;
+    sess->next = sessions;
+    sessions = sess;
+    hold_session(sess); // held by the table
+    pthread_mutex_unlock(&sessions_lock);
+    return 0;
+}
+
+/*
+ * Take a session out of the table of resumable ones
+ * Called with sessions_lock held
+ * @return:
+ *    1 if it was there, and its hold is to be released
+ */
+static int unlist_session(struct session *sess) {
+    struct session **link;
+    for (link = &sessions; *link != NULL; link = &(*link)->next) {
+        if (*link == sess) {
+            *link = sess->next;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Attach a connection to the session its hello resumes, in place of the
+ * one it started with
+ * A connection the session still has is shut down, its client gave up on it
+ * @return:
+ *    1 if the session was resumed, 0 if there is no such session
+ */
+static int resume_session(struct client *c, uint64_t id, uint64_t key) {
+    struct session *sess, *fresh = c->session;
+
+    pthread_mutex_lock(&sessions_lock);
+    for (sess = sessions; sess != NULL && sess->id != id; sess = sess->next);
+    if (sess == NULL || sess->key != key || sess == fresh) {
+        pthread_mutex_unlock(&sessions_lock);
+        return 0;
+    }
+    if (sess->client != NULL) {
+        // the hold of the old connection passes to the new one
+        sess->client->session = NULL;
+        shutdown(sess->client->conn->fd, SHUT_RDWR);
+    } else {
+        hold_session(sess);
+    }
+    sess->client = c;
+    c->session = sess;
+    fresh->client = NULL;
+    int listed = unlist_session(fresh);
+    pthread_mutex_unlock(&sessions_lock);
+
+    if (listed)	release_session(fresh);
+    release_session(fresh);
+    return 1;
+}
+
+/*
+ * Let a connection go from its session
+ * A resumable session whose connection failed waits to be resumed,
+ * any other one ends once its jobs are done
+ */
+static void detach_session(struct client *c) {
+    int listed = 0;
+
+    pthread_mutex_lock(&sessions_lock);
+    struct session *sess = c->session;
+    c->session = NULL;
+    if (sess != NULL) {
+        sess->client = NULL;
+        if (sess->id != 0 && c->error) {
+            sess->expires = time(NULL) + session_grace;
+        } else {
+            listed = unlist_session(sess);
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    if (sess == NULL)	return;
+    if (listed)	release_session(sess);
+    release_session(sess);
+}
+
+/*
+ * End the sessions whose grace period is over
+ * @return:
+ *    1 if some are still waiting to be resumed
+ */
+static int expire_sessions(void) {
+    struct session *expired = NULL, **link = &sessions;
+    time_t now = time(NULL);
+    int waiting = 0;
+
+    pthread_mutex_lock(&sessions_lock);
+    while (*link != NULL) {
+        struct session *sess = *link;
+        if (sess->client == NULL && sess->expires <= now) {
+            *link = sess->next;
+            sess->next = expired;
+            expired = sess;
+            continue;
+        }
+        waiting |= sess->client == NULL;
+        link = &sess->next;
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    while (expired != NULL) {
+        struct session *sess = expired;
+        expired = sess->next;
+        release_session(sess);
+    }
+    return waiting;
+}
+
+/*
+ * Answer the hello of a session, see answer_hello
+ * @param:
+ *    resumed: 1 if the hello resumed the session
+ * @return:
+ *    out
+ */
+static struct rpc_reply *hello_reply(const struct frame_header *hdr, struct session *sess,
+                                     int resumed, struct rpc_reply *out) {
+    struct hello_reply reply = {.ret = sess->peer_caps, .resumed = resumed};
+    if (sess->id != 0) {
+        reply.session = sess->id;
+        reply.key = sess->key;
+    }
+    char args[hello_reply_max_len];
+    int args_len = pack_hello_reply(args, frame_codec(hdr), &reply);
+    return build_reply(hdr, 0, args, args_len, NULL, 0, out);
+}
+
+/*
+ * Answer the capability exchange a client starts when it connects
+ * Hello always uses fixed-width arguments so that any peer can parse it
+ * A hello naming a session resumes it; otherwise a client offering
+ * CAP_SESSION gets a resumable session, unless it is over shm
+ * @param:
+ *    c: client, whose hello comes before anything else
+ *    frame: the hello
+ */
+void answer_hello(struct client *c, char *frame) {
+    struct frame_header hdr;
+    struct hello_req req;
+    struct arg_reader args;
+    struct rpc_reply reply;
+
+    if (decode_frame_header(frame, &hdr) < 0)	return;
+    arg_reader_init(&args, frame, &hdr);
+    if (decode_hello_req(&args, &req) < 0) {
+        memset(&req, 0, sizeof(req));
+    }
+    int caps = req.caps & (CAP_VARINT | CAP_COMPRESS | CAP_SESSION);
+    if (c->conn->kind == TRANSPORT_SHM || session_grace <= 0)	caps &= ~CAP_SESSION;
+
+    int resumed = (caps & CAP_SESSION) && req.session != 0 && resume_session(c, req.session, req.key);
+    struct session *sess = c->session;
+    sess->peer_caps = caps;
+    if ((caps & CAP_SESSION) && sess->id == 0 && start_session(sess) < 0) {
+        sess->peer_caps &= ~CAP_SESSION;
+    }
+    send_message(hello_reply(&hdr, sess, resumed, &reply), c);
+    if (resumed)	fprintf(stderr, "server: session %llu resumed\n", (unsigned long long)sess->id);
+}
+
+/*
+ * Queue what the socket of a client did not take of a reply
+ * Called with client->send_lock held
+ * @param:
+ *    sent: bytes of the iovecs already sent
+ * @return: 0 on success, -1 if out of memory
+ */
+static int queue_output(struct client *client, const struct iovec *iov, int iovcnt, size_t sent) {
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)	len += iov[i].iov_len;
+    struct out_chunk *o = (struct out_chunk *)malloc(sizeof(struct out_chunk) + len - sent);
+    if (o == NULL)	return -1;
+    o->next = NULL;
+    o->len = len - sent;
+    o->sent = 0;
+
+    char *p = o->data;
+    for (i = 0; i < iovcnt; i++) {
+        size_t skip = sent < iov[i].iov_len ? sent : iov[i].iov_len;
+        memcpy(p, (char *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+        p += iov[i].iov_len - skip;
+        sent -= skip;
+    }
+    if (client->out_tail)	client->out_tail->next = o;
+    else	client->out_head = o;
+    client->out_tail = o;
+    __atomic_store_n(&client->out_len, client->out_len + o->len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Wrapper of sending message.
+ * The message, which starts with the 4 byte little-endian length, goes
+ * out as one iovec when it was built in place, otherwise its header and
+ * the payload go out as two, so the payload is never copied
+ * unless the socket cannot take it at once. Nothing waits for a socket:
+ * what it does not take is copied to the queue of the client, behind
+ * which later replies line up
+ * Safe to call from any worker and from the reactor
+ * @return: number of bytes sent or queued, or -1 if error occurred
+ */
+ssize_t send_message(struct rpc_reply *reply, struct client *client) {
+    struct iovec iov[2];
+    int iovcnt = 1;
+    ssize_t sent = 0;
+
+    iov[0].iov_base = reply->start;
+    iov[0].iov_len = reply->head_len;
+    if (reply->payload_len > 0) {
+        iov[1].iov_base = (void *)reply->payload;
+        iov[1].iov_len = reply->payload_len;
+        iovcnt = 2;
+    }
+    size_t len = reply->head_len + reply->payload_len;
+
+    // workers reply concurrently, a frame must not be cut by another
+    pthread_mutex_lock(&client->send_lock);
+    if (client->conn->kind == TRANSPORT_SHM) {
+        sent = conn_send_iov(client->conn, iov, iovcnt);
+        pthread_mutex_unlock(&client->send_lock);
+        return sent;
+    }
+    if (client->closed) {
+        errno = EPIPE;
+        sent = -1;
+    } else if (client->out_head == NULL) {
+        sent = conn_send_ready(client->conn, iov, iovcnt);
+        if (sent < 0 && errno == EAGAIN)	sent = 0;
+    }
+    if (sent >= 0 && (size_t)sent < len) {
+        if (queue_output(client, iov, iovcnt, (size_t)sent) < 0)	sent = -1;
+        else	watch_client(client);
+    }
+    pthread_mutex_unlock(&client->send_lock);
+    return sent < 0 ? -1 : (ssize_t)len;
+}
+
+/*
+ * Put lanes parked on a client back on the run queue
+ * @param:
+ *    lane: first of them, linked by next_ready
+ */
+static void resume_lanes(struct lane *lane) {
+    while (lane != NULL) {
+        struct lane *next = lane->next_ready;
+        pthread_mutex_lock(&lane->lock);
+        make_ready(lane);
+        pthread_mutex_unlock(&lane->lock);
+        lane = next;
+    }
+}
+
+/*
+ * Park a lane while its client is behind on the replies queued for it,
+ * until client_flush sent half of them
+ * Called by the worker running the lane, before it takes its next job,
+ * or while streaming a reply with the rest of it set in lane->complete
+ * @return: 1 if parked, 0 if the client is not behind
+ */
+static int park_lane(struct client *c, struct lane *lane) {
+    int parked = 0;
+
+    pthread_mutex_lock(&c->send_lock);
+    if (!c->closed && c->out_len > CLIENT_OUT_LEN) {
+        lane->next_ready = c->parked;
+        c->parked = lane;
+        parked = 1;
+    }
+    pthread_mutex_unlock(&c->send_lock);
+    return parked;
+}
+
+/*
+ * Send the replies queued for a client, as far as its socket takes them
+ * without waiting
+ * @return: 0 while the connection is open, -1 once it failed
+ */
+int client_flush(struct client *c) {
+    struct lane *ready = NULL;
+    int rv = 0;
+
+    pthread_mutex_lock(&c->send_lock);
+    while (c->out_head != NULL) {
+        struct out_chunk *o = c->out_head;
+        struct iovec iov = {.iov_base = o->data + o->sent, .iov_len = o->len - o->sent};
+        ssize_t n = conn_send_ready(c->conn, &iov, 1);
+        if (n < 0) {
+            if (errno != EAGAIN)	rv = -1;
+            break;
+        }
+        o->sent += n;
+        __atomic_store_n(&c->out_len, c->out_len - n, __ATOMIC_RELAXED);
+        if (o->sent < o->len)	break;
+        c->out_head = o->next;
+        if (c->out_head == NULL)	c->out_tail = NULL;
+        free(o);
+    }
+    if (c->out_len <= CLIENT_OUT_LEN / 2) {
+        ready = c->parked;
+        c->parked = NULL;
+    }
+    watch_client(c);
+    pthread_mutex_unlock(&c->send_lock);
+
+    resume_lanes(ready);
+    return rv;
+}
+
+/*
+ * Wrapper of receiving message, waiting for it
+ * Only used over shm, see client_receive for sockets
+ * The 4 byte little-endian length is received first, then the rest into
+ * a job of the client large enough for the frame, see take_job
+ * The frame is NUL-terminated so that path payloads can be used as strings
+ * @param:
+ *    c: client to receive from
+ *    job: set to the job of the frame, given back with put_job
+ * @return: number of bytes received, 0 if the client closed, or -1 if error occurred
+ */
+int receive_message(struct client *c, struct lane_job **job) {
+    char prefix[FRAME_LEN_SIZE];
+
+    *job = NULL;
+    int rv = conn_recv_exact(c->conn, prefix, FRAME_LEN_SIZE);
+    if (rv <= 0)	return rv;
+
+    uint32_t len = get_le32(prefix);
+    if (len < FRAME_HDR_SIZE || len > MAXFRAMELEN) {
+        errno = EPROTO;
+        return -1;
+    }
+    struct lane_job *j = take_job(c, FRAME_LEN_SIZE + len + 1);
+    if (j == NULL)	return -1;
+    memcpy(j->frame, prefix, FRAME_LEN_SIZE);
+    if (conn_recv_exact(c->conn, j->frame + FRAME_LEN_SIZE, len) <= 0) {
+        put_job(j);
+        return -1;
+    }
+    j->frame[FRAME_LEN_SIZE + len] = 0;
+    *job = j;
+    return FRAME_LEN_SIZE + len;
+}
+
+/*
+ * Put a lane with jobs on the run queue
+ * Called with lane->lock held
+ */
+static void make_ready(struct lane *lane) {
+    pthread_mutex_lock(&run_lock);
+    lane->next_ready = NULL;
+    if (run_tail)	run_tail->next_ready = lane;
+    else	run_head = lane;
+    run_tail = lane;
+    pthread_cond_signal(&run_ready);
+    pthread_mutex_unlock(&run_lock);
+}
+
+/*
+ * Run the oldest job of a lane taken off the run queue, then put the
+ * lane back at the end if it has more
+ */
+static void run_lane(struct lane *lane) {
+    struct session *sess = lane->session;
+    struct lane_job *job;
+
+    pthread_mutex_lock(&lane->lock);
+    op_complete complete = lane->complete;
+    if (complete != NULL) {
+        // the file operation of the running job completed
+        job = lane->job;
+        lane->complete = NULL;
+    } else {
+        job = lane->head;
+        if (job == NULL) {
+            // its jobs were cancelled
+            lane->scheduled = 0;
+            pthread_mutex_unlock(&lane->lock);
+            return;
+        }
+        // a client behind on its replies gets no more until it caught up
+        if (__atomic_load_n(&job->client->out_len, __ATOMIC_RELAXED) > CLIENT_OUT_LEN &&
+            park_lane(job->client, lane)) {
+            pthread_mutex_unlock(&lane->lock);
+            return;
+        }
+        lane->head = job->next;
+        if (lane->head == NULL)	lane->tail = NULL;
+        lane->job = job;
+        lane->running = frame_req_id(job->frame);
+        lane->cancelled = 0;
+        if (lane->stream_client != job->client->serial) {
+            // a write streamed over a connection since dropped is never finished
+            lane->stream_client = job->client->serial;
+            lane->stream_done = 0;
+            lane->stream_error = 0;
+        }
+    }
+    pthread_mutex_unlock(&lane->lock);
+
+    // Unmarshalling the message, and execute it
+    struct rpc_reply reply;
+    reply.client = job->client;
+    reply.deferred = 0;
+    current_lane = lane;
+    if (complete != NULL) {
+        struct frame_header hdr;
+        decode_frame_header(job->frame, &hdr);
+        complete(job->frame, &hdr, &reply);
+    } else {
+        unmarshalling_method(job->frame, &reply);
+    }
+    current_lane = NULL;
+    if (reply.deferred) {
+        arena_reset(&scratch);
+        return; // the lane is back on the run queue once the operation completed
+    }
+    if (reply.head_len > 0) {
+        send_message(&reply, job->client);
+    }
+    arena_reset(&scratch);
+    free(reply.release);
+    put_ring_buf(reply.release_buf);
+
+    pthread_mutex_lock(&lane->lock);
+    lane->job = NULL;
+    lane->pending--;
+    lane->running = 0;
+    if (lane->head != NULL)	make_ready(lane);
+    else	lane->scheduled = 0;
+    pthread_mutex_unlock(&lane->lock);
+
+    struct client *c = job->client;
+    put_job(job);
+    release_client(c);
+    release_session(sess);
+}
+
+/*
+ * Run lanes off the run queue, forever
+ */
+void *worker_main(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&run_lock);
+        while (run_head == NULL)	pthread_cond_wait(&run_ready, &run_lock);
+        struct lane *lane = run_head;
+        run_head = lane->next_ready;
+        if (run_head == NULL)	run_tail = NULL;
+        pthread_mutex_unlock(&run_lock);
+
+        run_lane(lane);
+    }
+}
+
+/*
+ * Pick the lane of a request
+ * A request on an fd goes to the lane of that fd, any other request
+ * to the least busy lane
+ * @return:
+ *    index of the lane
+ */
+int lane_of(struct session *sess, char *frame) {
+    struct frame_header hdr;
+    struct arg_reader args;
+
+    if (decode_frame_header(frame, &hdr) == 0) {
+        switch (hdr.opcode) {
+        case OP_CLOSE:
+        case OP_READ:
+        case OP_PREAD:
+        case OP_WRITE:
+        case OP_LSEEK:
+        case OP_GETDIRENTRIES:
+        case OP_FSTAT:
+            // the fd is the first argument of all of these
+            arg_reader_init(&args, frame, &hdr);
+            int fd = read_arg_fd(&args);
+            return (unsigned int)fd % SESSION_LANES;
+        default:
+            break;
+        }
+    }
+
+    int i, best = 0, best_pending;
+    for (i = 0; i < SESSION_LANES; i++) {
+        pthread_mutex_lock(&sess->lanes[i].lock);
+        int pending = sess->lanes[i].pending;
+        pthread_mutex_unlock(&sess->lanes[i].lock);
+        if (i == 0 || pending < best_pending) {
+            best = i;
+            best_pending = pending;
+        }
+    }
+    return best;
+}
+
+/*
+ * @return:
+ *    1 if the client cancelled the request the calling worker runs
+ */
+int request_cancelled(void) {
+    if (current_lane == NULL)	return 0;
+    pthread_mutex_lock(&current_lane->lock);
+    int cancelled = current_lane->cancelled;
+    pthread_mutex_unlock(&current_lane->lock);
+    return cancelled;
+}
+
+/*
+ * Give up on a request the client no longer waits for
+ * A queued request is answered -ECANCELED without running, except for
+ * a write, which may be a chunk of a stream; a running one is flagged
+ * for handlers that check request_cancelled
+ * @param:
+ *    c: client that sent it
+ *    cancel: job of the OP_CANCEL request, given back here
+ */
+void cancel_request(struct client *c, struct lane_job *cancel) {
+    struct session *sess = c->session;
+    char *frame = cancel->frame;
+    struct frame_header hdr;
+    struct cancel_req req;
+    struct arg_reader args;
+    int i;
+
+    if (sess == NULL || decode_frame_header(frame, &hdr) < 0)	goto out;
+    arg_reader_init(&args, frame, &hdr);
+    if (decode_cancel_req(&args, &req) < 0 || req.target == 0)	goto out;
+
+    for (i = 0; i < SESSION_LANES; i++) {
+        struct lane *lane = &sess->lanes[i];
+        struct lane_job *job, *prev = NULL;
+
+        pthread_mutex_lock(&lane->lock);
+        if (lane->running == req.target)	lane->cancelled = 1;
+        for (job = lane->head; job != NULL; prev = job, job = job->next) {
+            if (frame_req_id(job->frame) == req.target)	break;
+        }
+        struct frame_header job_hdr;
+        if (job != NULL && (decode_frame_header(job->frame, &job_hdr) < 0 || job_hdr.opcode == OP_WRITE)) {
+            job = NULL;
+        }
+        if (job != NULL) {
+            if (prev)	prev->next = job->next;
+            else	lane->head = job->next;
+            if (lane->tail == job)	lane->tail = prev;
+            lane->pending--;
+        }
+        pthread_mutex_unlock(&lane->lock);
+
+        if (job != NULL) {
+            struct rpc_reply reply;
+            make_reply(&job_hdr, -ECANCELED, NULL, 0, &reply);
+            send_message(&reply, job->client);
+            struct client *owner = job->client;
+            put_job(job);
+            release_client(owner);
+            release_session(sess);
+            break;
+        }
+    }
+out:
+    put_job(cancel);
+}
+
+/*
+ * Queue a received request on its lane
+ * @param:
+ *    c: client it came from
+ *    job: job of the request, given back once answered
+ */
+void queue_request(struct client *c, struct lane_job *job) {
+    struct session *sess = c->session;
+    if (sess == NULL) {
+        // taken over by a newer connection
+        put_job(job);
+        return;
+    }
+    hold_client(c);
+    hold_session(sess);
+
+    struct lane *lane = &sess->lanes[lane_of(sess, job->frame)];
+    pthread_mutex_lock(&lane->lock);
+    if (lane->tail)	lane->tail->next = job;
+    else	lane->head = job;
+    lane->tail = job;
+    lane->pending++;
+    if (!lane->scheduled) {
+        lane->scheduled = 1;
+        make_ready(lane);
+    }
+    pthread_mutex_unlock(&lane->lock);
+}
+
+/*
+ * Act on a frame received from a client
+ * Hello and cancel are answered at once, other requests queued
+ * @param:
+ *    job: job of the frame, given back once answered
+ */
+void dispatch(struct client *c, struct lane_job *job) {
+    switch (frame_opcode(job->frame)) {
+    case OP_HELLO:
+        answer_hello(c, job->frame);
+        put_job(job);
+        break;
+    case OP_CANCEL:
+        cancel_request(c, job);
+        break;
+    default:
+        queue_request(c, job);
+        break;
+    }
+}
+
+/*
+ * Receive what a client sent so far, without waiting, and dispatch the
+ * whole frames
+ * At most REACTOR_BURST frames are taken, the rest on the next round.
+ * A full client is no longer received from, see watch_client
+ * @return:
+ *    0 while the connection is open, -1 once it closed or failed
+ */
+int client_receive(struct client *c) {
+    int frames = 0;
+
+    while (frames < REACTOR_BURST) {
+        if (client_full(c)) {
+            watch_client(c);
+            return 0;
+        }
+        char *dst = c->job ? c->job->frame + c->got : c->prefix + c->got;
+        size_t want = (c->job ? c->frame_len : FRAME_LEN_SIZE) - c->got;
+        ssize_t n = conn_recv_ready(c->conn, dst, want);
+        if (n < 0 && errno == EAGAIN)	return 0;
+        if (n <= 0) {
+            // closing in the middle of a frame is a failure too
+            c->error = n < 0 || c->got > 0 || c->job != NULL;
+            return -1;
+        }
+        c->got += n;
+
+        if (c->job == NULL) {
+            if (c->got < FRAME_LEN_SIZE)	continue;
+            uint32_t len = get_le32(c->prefix);
+            if (len < FRAME_HDR_SIZE || len > MAXFRAMELEN ||
+                (c->job = take_job(c, FRAME_LEN_SIZE + len + 1)) == NULL) {
+                c->error = 1;
+                return -1;
+            }
+            memcpy(c->job->frame, c->prefix, FRAME_LEN_SIZE);
+            c->frame_len = FRAME_LEN_SIZE + len;
+            continue;
+        }
+        if (c->got < c->frame_len)	continue;
+
+        // NUL-terminated so that path payloads can be used as strings
+        struct lane_job *job = c->job;
+        job->frame[c->frame_len] = 0;
+        c->job = NULL;
+        c->got = 0;
+        dispatch(c, job);
+        frames++;
+    }
+    return 0;
+}
+
+/*
+ * Stop serving a client
+ * Lanes parked on it are put back on the run queue, to find their
+ * sends failing and finish their jobs
+ */
+void drop_client(struct client *c) {
+    pthread_mutex_lock(&c->send_lock);
+    c->closed = 1;
+    struct lane *parked = c->parked;
+    c->parked = NULL;
+    pthread_mutex_unlock(&c->send_lock);
+    resume_lanes(parked);
+
+    pthread_mutex_lock(&c->watch_lock);
+    if (c->watched)	epoll_ctl(c->ep, EPOLL_CTL_DEL, c->conn->fd, NULL);
+    c->ep = -1;
+    c->watched = 0;
+    pthread_mutex_unlock(&c->watch_lock);
+    detach_session(c);
+    release_client(c);
+}
+
+/*
+ * Serve a shm client, whose rings cannot be waited on with epoll
+ * @param:
+ *    arg: the client
+ */
+void *shm_client_main(void *arg) {
+    struct client *c = (struct client *)arg;
+    struct lane_job *job;
+
+    int crv = conn_handshake(c->conn);
+    while (crv >= 0) {
+        // a full client is not received from until it has room
+        pthread_mutex_lock(&c->watch_lock);
+        while (client_full(c))	pthread_cond_wait(&c->room, &c->watch_lock);
+        pthread_mutex_unlock(&c->watch_lock);
+
+        if ((crv = receive_message(c, &job)) <= 0)	break;
+        dispatch(c, job);
+    }
+    c->error = crv < 0;
+    drop_client(c);
+    return NULL;
+}
+
+/*
+ * Take the connections waiting on the listening socket
+ */
+void accept_clients(int ep, int transport, int listenfd) {
+    while (1) {
+        struct conn *conn = conn_accept(transport, listenfd);
+        if (conn == NULL) {
+            if (errno == EINTR || errno == ECONNABORTED)	continue;
+            if (errno != EAGAIN)	perror("server: accept");
+            return;
+        }
+        struct client *c = new_client(conn);
+        if (c == NULL) {
+            conn_close(conn);
+            continue;
+        }
+
+        if (transport == TRANSPORT_SHM) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, shm_client_main, c) != 0)	drop_client(c);
+            else	pthread_detach(thread);
+            continue;
+        }
+        c->ep = ep;
+        if (watch_client(c) < 0)	drop_client(c);
+    }
+}
+
+/*
+ * Receive from every connection as frames arrive and hand the requests
+ * to the workers, and send the replies sockets did not take at once as
+ * they drain, forever
+ * @param:
+ *    transport: TRANSPORT_*
+ *    listenfd: listening socket
+ */
+void run_reactor(int transport, int listenfd) {
+    struct epoll_event events[REACTOR_EVENTS];
+    int waiting = 0;
+    int i;
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0)	err(1, 0);
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    // a listener shared by several processes wakes only one of them
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL};
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, listenfd, &ev) < 0)	err(1, 0);
+
+    while (1) {
+        // sessions waiting to be resumed are checked on every second
+        int n = epoll_wait(ep, events, REACTOR_EVENTS, waiting ? 1000 : -1);
+        if (n < 0 && errno != EINTR)	err(1, 0);
+        for (i = 0; i < n; i++) {
+            struct client *c = (struct client *)events[i].data.ptr;
+            uint32_t ready = events[i].events;
+            if (c == NULL)	accept_clients(ep, transport, listenfd);
+            else if (((ready & ~EPOLLOUT) && client_receive(c) < 0) ||
+                     ((ready & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && client_flush(c) < 0))	drop_client(c);
+        }
+        waiting = expire_sessions();
+    }
+}
+
+/*
+ * Start the workers
+ * @param:
+ *    n: how many
+ */
+void start_workers(int n) {
+    int i;
+    for (i = 0; i < n; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, NULL) != 0)	err(1, 0);
+        pthread_detach(thread);
+    }
+}
+
+/*
+ * Pin the calling process to one of the cpus it may run on
+ * @param:
+ *    index: picks the cpu, the same one for the same index
+ */
+void pin_process(int index) {
+    cpu_set_t allowed, one;
+    int cpu, seen = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) == 0)	return;
+    index %= CPU_COUNT(&allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && seen++ == index)	break;
+    }
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    if (sched_setaffinity(0, sizeof(one), &one) < 0)	perror("server: pin");
+}
+
+/*
+ * Wait for the signal ending this process, print its counters once, then
+ * let the signal end it as it would have
+ * @param:
+ *    arg: the signals to wait for, blocked in every thread
+ */
+void *stats_main(void *arg) {
+    sigset_t *stop = (sigset_t *)arg;
+    int sig;
+
+    if (sigwait(stop, &sig) != 0)	return NULL;
+    print_compress_stats("server");
+    if (ring != NULL)	print_ring_stats();
+    signal(sig, SIG_DFL);
+    pthread_sigmask(SIG_UNBLOCK, stop, NULL);
+    raise(sig);
+    return NULL;
+}
+
+/*
+ * Serve connections in this process, forever
+ * SIGTERM and SIGINT are taken by a thread of their own, blocked before
+ * any other thread starts so every thread inherits the mask
+ */
+void serve(int transport, int listenfd, int nworkers) {
+    static sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stats_main, &stop) != 0)	err(1, 0);
+    pthread_detach(thread);
+
+    char *uring = getenv("uring15440");
+    if (uring && atoi(uring) == 1)	start_ring();
+    start_workers(nworkers);
+    run_reactor(transport, listenfd);
+}
+
+/*
+ * Start a server process, which ends with its parent
+ * @param:
+ *    index: of the process, picks its listener and cpu
+ *    pin: pin it to a cpu of its own
+ *    listeners: listening socket of each process
+ * @return:
+ *    pid of the process
+ */
+pid_t start_process(int index, int pin, int transport, int *listeners, int procs, int nworkers) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    int i;
+    if (pid != 0)	return pid;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent)	_exit(0);
+    for (i = 0; i < procs; i++) {
+        if (listeners[i] != listeners[index])	close(listeners[i]);
+    }
+    if (pin)	pin_process(index);
+    serve(transport, listeners[index], nworkers);
+    _exit(0);
+}
+
+/*
+ * Keep procs server processes running, starting a new one in place of
+ * any that dies, forever
+ * The listeners stay open here, so connections waiting on the listener
+ * of a dead process are taken by the next one. A process exiting with
+ * an error at once ends the server, one crashing at once is restarted
+ * a second later.
+ */
+void run_processes(int procs, int pin, int transport, int *listeners, int nworkers) {
+    pid_t pids[MAXPROCS];
+    time_t started[MAXPROCS];
+    int i;
+
+    for (i = 0; i < procs; i++) {
+        pids[i] = start_process(i, pin, transport, listeners, procs, nworkers);
+        started[i] = time(NULL);
+        if (pids[i] < 0)	err(1, 0);
+    }
+    while (1) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0 && errno == EINTR)	continue;
+        if (pid < 0)	err(1, 0);
+        for (i = 0; i < procs && pids[i] != pid; i++);
+        if (i == procs)	continue;
+
+        int young = time(NULL) - started[i] < 1;
+        if (young && WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "server: process %d failed at start\n", (int)pid);
+            exit(1);
+        }
+        fprintf(stderr, "server: process %d died, starting another\n", (int)pid);
+        if (young)	sleep(1);
+        pids[i] = start_process(i, pin, transport, listeners, procs, nworkers);
+        started[i] = time(NULL);
+        if (pids[i] < 0)	err(1, 0);
+    }
+}
+
+int main(void) {
+    char *serverport;
+    unsigned short port;
+    int listeners[MAXPROCS];
+    int i;
+
+    // Get environment variable indicating the port of the server
+    serverport = getenv("serverport15440");
+    if (serverport)	port = (unsigned short)atoi(serverport);
+    else	port = 15440;
+
+    char *grace = getenv("grace15440");
+    if (grace)	session_grace = atoi(grace);
+
+    // procs15440 pre-forks server processes sharing the port,
+    // pin15440=1 pins each to a cpu of its own
+    char *procs_env = getenv("procs15440");
+    int procs = procs_env ? atoi(procs_env) : 1;
+    if (procs < 1)	procs = 1;
+    if (procs > MAXPROCS)	procs = MAXPROCS;
+    char *pin = getenv("pin15440");
+
+    // workers are split over the processes
+    char *workers = getenv("workers15440");
+    int nworkers = workers ? atoi(workers) : (int)sysconf(_SC_NPROCESSORS_ONLN) / procs;
+    if (nworkers < 1)	nworkers = 1;
+    if (nworkers > MAXTHREADNUM)	nworkers = MAXTHREADNUM;
+
+    // the files of every session share this process's fd table
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // bind to port and start listening for connections,
+    // over tcp unless transport15440 says otherwise
+    int transport = transport_from_env();
+    listeners[0] = conn_listen(transport, port, 0);
+    if (listeners[0] < 0)	err(1, 0);
+
+    if (procs == 1) {
+        fprintf(stderr, "server: listening over %s, %d workers\n", transport_name(transport), nworkers);
+        serve(transport, listeners[0], nworkers);
+        return 0;
+    }
+
+    // Processes sharing a tcp port listen on a socket each, so the kernel
+    // spreads the connections over them; over unix they share one.
+    // The port was bound alone above, so a server already on it is not joined
+    for (i = 0; i < procs; i++) {
+        if (transport != TRANSPORT_TCP) {
+            listeners[i] = listeners[0];
+            continue;
+        }
+        if (i == 0)	close(listeners[0]);
+        if ((listeners[i] = conn_listen(transport, port, 1)) < 0)	err(1, 0);
+    }
+
+    // a session lives in the process its connection landed in,
+    // a new connection to resume it most likely lands in another
+    session_grace = 0;
+    fprintf(stderr, "server: listening over %s, %d processes of %d workers\n",
+            transport_name(transport), procs, nworkers);
+    run_processes(procs, pin && atoi(pin) == 1, transport, listeners, nworkers);
+
+    return 0;
+}
+
+/*
+ * Build a reply, to be sent with send_message
+ * The reply echoes the opcode of the request and uses the same argument codec
+ * A payload larger than REPLY_INLINE_LEN is not copied, so it has to stay
+ * valid until the reply is sent: taken from scratch, or malloc'd and set as
+ * out->release to be freed
+ * @param:
+ *    req: header of the request being answered
+ *    flags: FRAME_F_* bits describing the payload, such as FRAME_F_LZ
+ *    args: encoded reply arguments, starting with the i64 return value
+ *    args_len: length of args
+ *    payload: content to return, may be NULL
+ *    payload_len: length of the content
+ *    out: reply to fill in
+ * @return:
+ *    out
+ */
+struct rpc_reply *build_reply(const struct frame_header *req, int flags, const char *args, int args_len,
+                              const char *payload, size_t payload_len, struct rpc_reply *out) {
+    char *inline_payload = reply_payload(out);
+
+    if (payload_len > REPLY_INLINE_LEN) {
+        build_reply_in_place(req, flags, args, args_len, inline_payload, 0, out);
+        // the header announces the payload sent after it
+        put_le32(out->start, (uint32_t)(FRAME_HDR_SIZE + args_len + payload_len));
+        out->payload = payload;
+        out->payload_len = payload_len;
+        return out;
+    }
+    if (payload_len > 0 && payload != inline_payload)	memcpy(inline_payload, payload, payload_len);
+    return build_reply_in_place(req, flags, args, args_len, inline_payload, payload_len, out);
+}
+
+/*
+ * Build a reply around a payload the handler wrote in its final place,
+ * so that it goes out as one contiguous message without being copied
+ * The header is written into the REPLY_HEADROOM bytes in front of the
+ * payload, which has to stay valid until the reply is sent, as with
+ * build_reply
+ * @param:
+ *    payload: content to return, preceded by REPLY_HEADROOM bytes free for
+ *        the header, such as reply_payload(out) for up to REPLY_INLINE_LEN bytes
+ *    others: as with build_reply
+ * @return:
+ *    out
+ */
+struct rpc_reply *build_reply_in_place(const struct frame_header *req, int flags, const char *args, int args_len,
+                                       char *payload, size_t payload_len, struct rpc_reply *out) {
+    size_t hdr_len = FRAME_LEN_SIZE + FRAME_HDR_SIZE + args_len;
+    char *start = payload - hdr_len;
+
+    put_le32(start, (uint32_t)(FRAME_HDR_SIZE + args_len + payload_len));
+    encode_frame_header(start + FRAME_LEN_SIZE, req->opcode, FRAME_F_REPLY | flags | (req->flags & FRAME_F_VARINT),
+                        args_len, req->req_id);
+    memcpy(start + FRAME_LEN_SIZE + FRAME_HDR_SIZE, args, args_len);
+    out->start = start;
+    out->head_len = hdr_len + payload_len;
+    out->payload = NULL;
+    out->payload_len = 0;
+    out->release = NULL;
+    out->release_buf = -1;
+    return out;
+}
+
+/*
+ * Mark a request as not answered, such as a write chunk followed by more
+ * @return:
+ *    out
+ */
+struct rpc_reply *no_reply(struct rpc_reply *out) {
+    out->start = out->head;
+    out->head_len = 0;
+    out->payload = NULL;
+    out->payload_len = 0;
+    out->release = NULL;
+    out->release_buf = -1;
+    return out;
+}
+
+/*
+ * Build a reply which only carries the return value and a payload
+ * @param:
+ *    req: header of the request being answered
+ *    ret: return value or -errno
+ *    payload: content to return, may be NULL
+ *    payload_len: length of the content
+ *    out: reply to fill in
+ * @return:
+ *    out
+ */
+struct rpc_reply *make_reply(const struct frame_header *req, int64_t ret,
+                             const char *payload, size_t payload_len, struct rpc_reply *out) {
+    struct reply reply = {.ret = ret};
+    char args[reply_max_len];
+    int args_len = pack_reply(args, frame_codec(req), &reply);
+    return build_reply(req, 0, args, args_len, payload, payload_len, out);
 }
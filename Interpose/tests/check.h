@@ -0,0 +1,34 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * check.h
+ * Minimal assertion helpers shared by the unit tests.
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+static int check_failures;
+
+/* Record and report a failed condition without stopping the test */
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        check_failures++; \
+    } \
+} while (0)
+
+/* Print the outcome of a test program and turn it into its exit status */
+static inline int check_report(const char *name) {
+    if (check_failures == 0) {
+        printf("%s: ok\n", name);
+        return 0;
+    }
+    printf("%s: %d check(s) failed\n", name, check_failures);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * restat.c
+ * Client for smoke.sh, run with mylib.so preloaded: stats a path, waits
+ * for a line on stdin while the server is restarted, then stats it again
+ * over the new connection. smoke.sh runs it with a 200 ms metadeadline15440.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* the __xstat of mylib, glibc no longer exports one to link against */
+typedef int (*xstat_fn)(int ver, const char *path, struct stat *stat_buf);
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s path\n", argv[0]);
+        return 2;
+    }
+    xstat_fn xstat = (xstat_fn)dlsym(RTLD_DEFAULT, "__xstat");
+    if (xstat == NULL) {
+        fprintf(stderr, "restat: __xstat not found, is mylib.so preloaded?\n");
+        return 2;
+    }
+
+    struct stat st;
+    if (xstat(1, argv[1], &st) < 0) {
+        printf("first stat: %s\n", strerror(errno));
+        return 1;
+    }
+    printf("first stat ok\n");
+    fflush(stdout);
+
+    char line[16];
+    if (fgets(line, sizeof(line), stdin) == NULL)	return 2;
+
+    /*
+     * The first call after the restart may see the old connection drop.
+     * The retry waits out the deadline of that call, so its reconnect
+     * starts after any deadline left over from before
+     */
+    int attempt;
+    for (attempt = 0; attempt < 2; attempt++) {
+        if (attempt > 0)	usleep(500000);
+        if (xstat(1, argv[1], &st) == 0) {
+            printf("second stat ok\n");
+            return 0;
+        }
+        printf("second stat: %s\n", strerror(errno));
+    }
+    return 1;
+}
@@ -0,0 +1,94 @@
+#!/bin/bash
+#
+# @author: Xinkai Wang
+# @contact: xinkaiw@andrew.cmu.edu
+#
+# smoke.sh
+# Start the server and run the 440 tools through mylib.so over each
+# transport, comparing what they see with the files on the server side.
+# Run from Interpose after make.
+
+R=$(cd "$(dirname "$0")/../.." && pwd)
+W=$(mktemp -d)
+trap 'rm -rf "$W"' EXIT
+export LD_LIBRARY_PATH=$R/lib
+P="env LD_PRELOAD=$R/Interpose/mylib.so"
+fail=0
+
+check() {
+    if [ "$2" -eq 0 ]; then
+        echo "  $1 ok"
+    else
+        echo "  $1 FAIL"
+        fail=1
+    fi
+}
+
+# run the server in $W/srv, where it finds libdirtree through ../lib
+start_server() {
+    (cd "$W/srv" && exec "$R/Interpose/server" >> "$W/server.log" 2>&1) &
+    SP=$!
+    sleep 0.3
+}
+
+stop_server() {
+    kill $SP 2>/dev/null
+    wait $SP 2>/dev/null
+}
+
+head -c 3000000 /dev/urandom > "$W/big.bin"
+
+for transport in tcp unix shm; do
+    echo "transport $transport"
+    export transport15440=$transport
+    export serverport15440=$((20000 + RANDOM % 20000))
+
+    rm -rf "$W/srv" "$W/lib"
+    mkdir -p "$W/srv/a/b/c" "$W/srv/a/d" "$W/srv/e"
+    ln -s "$R/lib" "$W/lib"
+    seq 1 20000 > "$W/srv/small.txt"
+
+    start_server
+
+    cd "$W/srv"
+    $P "$R/tools/440cat" small.txt 2>/dev/null > "$W/out.txt"
+    cmp -s "$W/out.txt" small.txt; check cat $?
+
+    $P "$R/tools/440write" written.txt < small.txt 2>/dev/null
+    cmp -s written.txt small.txt; check write $?
+
+    $P "$R/tools/440write" big.bin < "$W/big.bin" 2>/dev/null
+    cmp -s big.bin "$W/big.bin"; check bigwrite $?
+
+    $P "$R/tools/440cat" big.bin 2>/dev/null > "$W/big.out"
+    cmp -s "$W/big.out" "$W/big.bin"; check bigcat $?
+
+    $P "$R/tools/440ls" -l . 2>/dev/null | grep -q small.txt; check ls $?
+
+    "$R/tools/440tree" . 2>/dev/null > "$W/tree.exp"
+    $P "$R/tools/440tree" . 2>/dev/null > "$W/tree.out"
+    cmp -s "$W/tree.out" "$W/tree.exp"; check tree $?
+
+    $P "$R/tools/440rm" written.txt 2>/dev/null
+    [ ! -e written.txt ]; check rm $?
+
+    $P "$R/tools/440cat" nonexist 2>&1 | grep -qi "no such"; check enoent $?
+
+    # a stat after the server restarted reconnects within a deadline of its own
+    rm -f "$W/go"
+    mkfifo "$W/go"
+    metadeadline15440=200 $P "$R/Interpose/tests/restat" small.txt < "$W/go" > "$W/restat.out" 2>/dev/null &
+    CP=$!
+    exec 3> "$W/go"
+    sleep 0.3
+    stop_server
+    start_server
+    echo go >&3
+    exec 3>&-
+    wait $CP; check restat $?
+    cd - > /dev/null
+
+    stop_server
+done
+
+exit $fail
@@ -0,0 +1,129 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * test_compress.c
+ * Round trips through compress_payload and decompress_payload, and
+ * malformed payloads that decompress_payload has to reject
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "../mycompress.h"
+#include "../myframe.h"
+#include "check.h"
+
+#define MAXLEN (1 << 20)
+
+static char raw[MAXLEN];
+static char packed[MAXLEN];
+static char out[MAXLEN];
+
+/* Text with plenty of repeats, like the files the clients usually move */
+static void fill_text(char *p, size_t len) {
+    static const char *words[] = { "open ", "read ", "write ", "close ", "lseek ", "stat ", "\n" };
+    size_t i = 0;
+    unsigned int seed = 15440;
+    while (i < len) {
+        const char *w = words[rand_r(&seed) % 7];
+        size_t n = strlen(w);
+        if (n > len - i)	n = len - i;
+        memcpy(p + i, w, n);
+        i += n;
+    }
+}
+
+static void fill_random(char *p, size_t len) {
+    unsigned int seed = 18213;
+    size_t i;
+    for (i = 0; i < len; i++)	p[i] = (char)rand_r(&seed);
+}
+
+/* A compressible payload decompresses to itself, and only into a large enough buffer */
+static void round_trip(size_t len) {
+    size_t n = compress_payload(raw, len, packed);
+    CHECK(n > COMPRESS_HDR_SIZE && n < len);
+    CHECK(compressed_raw_len(packed, n) == len);
+
+    memset(out, 0, len);
+    CHECK(decompress_payload(packed, n, out, len) == (ssize_t)len);
+    CHECK(memcmp(out, raw, len) == 0);
+    CHECK(decompress_payload(packed, n, out, MAXLEN) == (ssize_t)len);
+    CHECK(decompress_payload(packed, n, out, len - 1) == -1);
+}
+
+/* Damaged copies of a valid payload never decode to more than cap or out of bounds */
+static void malformed(size_t len) {
+    size_t n = compress_payload(raw, len, packed);
+    CHECK(n > 0);
+
+    /* truncated anywhere, including inside the raw length */
+    size_t cut;
+    for (cut = 0; cut < n; cut++) {
+        CHECK(decompress_payload(packed, cut, out, len) == -1);
+    }
+
+    /* announcing a raw length the block does not produce */
+    put_le32(packed, (uint32_t)len + 1);
+    CHECK(decompress_payload(packed, n, out, MAXLEN) == -1);
+    put_le32(packed, (uint32_t)len - 1);
+    CHECK(decompress_payload(packed, n, out, MAXLEN) == -1);
+    put_le32(packed, 0);
+    CHECK(decompress_payload(packed, n, out, MAXLEN) == -1);
+    put_le32(packed, (uint32_t)len);
+
+    /* a first sequence whose match reaches before the start of the output */
+    char bad[16];
+    put_le32(bad, 64);
+    bad[4] = (char)0x10; /* one literal, match of LZ_MIN_MATCH */
+    bad[5] = 'x';
+    put_le16(bad + 6, 2); /* offset 2 with one byte written */
+    CHECK(decompress_payload(bad, 8, out, MAXLEN) == -1);
+    put_le16(bad + 6, 0); /* offset 0 is never valid */
+    CHECK(decompress_payload(bad, 8, out, MAXLEN) == -1);
+
+    /* flipped bytes: either rejected or decoded within the announced length */
+    unsigned int seed = 7;
+    int trial;
+    for (trial = 0; trial < 2000; trial++) {
+        char *copy = (char *)malloc(n);
+        memcpy(copy, packed, n);
+        int flips = 1 + rand_r(&seed) % 4;
+        while (flips-- > 0) {
+            copy[COMPRESS_HDR_SIZE + rand_r(&seed) % (n - COMPRESS_HDR_SIZE)] ^= (char)(1 + rand_r(&seed) % 255);
+        }
+        ssize_t got = decompress_payload(copy, n, out, len);
+        CHECK(got == -1 || got == (ssize_t)len);
+        free(copy);
+    }
+}
+
+int main(void) {
+    /* too small to be worth it */
+    fill_text(raw, MAXLEN);
+    CHECK(compress_payload(raw, COMPRESS_MIN_LEN - 1, packed) == 0);
+
+    size_t lens[] = { COMPRESS_MIN_LEN, 4096, 65536 + 17, MAXLEN };
+    size_t i;
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        round_trip(lens[i]);
+    }
+    malformed(4096);
+
+    /* a run of one byte, every match overlaps its own output */
+    memset(raw, 'a', MAXLEN);
+    round_trip(MAXLEN);
+    round_trip(COMPRESS_MIN_LEN);
+
+    /* random data is sent raw */
+    fill_random(raw, MAXLEN);
+    CHECK(compress_payload(raw, 4096, packed) == 0);
+    CHECK(compress_payload(raw, MAXLEN, packed) == 0);
+
+    /* bytes that are not a compressed payload at all */
+    CHECK(decompress_payload(raw, 4096, out, MAXLEN) == -1);
+    CHECK(decompress_payload(raw, 0, out, MAXLEN) == -1);
+    CHECK(compressed_raw_len(raw, COMPRESS_HDR_SIZE - 1) == 0);
+
+    return check_report("test_compress");
+}
@@ -0,0 +1,113 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * test_dirtree.c
+ * Round trips of a dirtreenode through dirtreenode_to_buf and ato_dirtreenode
+ */
+
+#include "../mystub.h"
+#include "../myframe.h"
+#include "check.h"
+
+/* Build a node by hand, the way getdirtree lays it out */
+static struct dirtreenode *make_node(const char *name, int num_subdirs) {
+    struct dirtreenode *node = (struct dirtreenode *)malloc(sizeof(struct dirtreenode));
+    node->name = strdup(name);
+    node->num_subdirs = num_subdirs;
+    node->subdirs = num_subdirs > 0 ?
+        (struct dirtreenode **)calloc(num_subdirs, sizeof(struct dirtreenode *)) : NULL;
+    return node;
+}
+
+static void free_node(struct dirtreenode *node) {
+    int i;
+    for (i = 0; i < node->num_subdirs; i++) {
+        free_node(node->subdirs[i]);
+    }
+    free(node->subdirs);
+    free(node->name);
+    free(node);
+}
+
+static int same_tree(const struct dirtreenode *a, const struct dirtreenode *b) {
+    if (strcmp(a->name, b->name) != 0 || a->num_subdirs != b->num_subdirs)	return 0;
+    int i;
+    for (i = 0; i < a->num_subdirs; i++) {
+        if (!same_tree(a->subdirs[i], b->subdirs[i]))	return 0;
+    }
+    return 1;
+}
+
+/* Encode a tree, check it decodes to the same tree, and that damaged copies are rejected */
+static void round_trip(struct dirtreenode *tree) {
+    size_t len = dirtreenode_str_len(tree);
+    char *buf = (char *)malloc(len);
+    dirtreenode_to_buf(tree, buf);
+
+    struct dirtreenode *copy = ato_dirtreenode(buf, len);
+    CHECK(copy != NULL);
+    if (copy != NULL) {
+        CHECK(same_tree(tree, copy));
+        free(copy); /* the decoded tree is one block starting at its root */
+    }
+
+    /* every strict prefix is missing at least one node */
+    size_t cut;
+    for (cut = 0; cut < len; cut++) {
+        CHECK(ato_dirtreenode(buf, cut) == NULL);
+    }
+
+    /* a node count larger than the data can hold */
+    char *bad = (char *)malloc(len);
+    memcpy(bad, buf, len);
+    put_le32(bad, 0xffffffffu);
+    CHECK(ato_dirtreenode(bad, len) == NULL);
+
+    /* a root claiming more subdirectories than the tree has nodes */
+    memcpy(bad, buf, len);
+    put_le32(bad + 8, get_le32(bad) + 1);
+    CHECK(ato_dirtreenode(bad, len) == NULL);
+
+    free(bad);
+    free(buf);
+}
+
+int main(void) {
+    struct dirtreenode *leaf = make_node("", 0);
+    round_trip(leaf);
+    free_node(leaf);
+
+    /*
+     * root
+     *   a
+     *     b
+     *       c
+     *     d
+     *   e
+     */
+    struct dirtreenode *root = make_node("root", 2);
+    struct dirtreenode *a = make_node("a", 2);
+    struct dirtreenode *b = make_node("b", 1);
+    b->subdirs[0] = make_node("c", 0);
+    a->subdirs[0] = b;
+    a->subdirs[1] = make_node("d", 0);
+    root->subdirs[0] = a;
+    root->subdirs[1] = make_node("a directory with a rather longer name", 0);
+    round_trip(root);
+    free_node(root);
+
+    /* a wide and deep tree */
+    root = make_node("wide", 200);
+    int i;
+    for (i = 0; i < 200; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "dir%d", i);
+        root->subdirs[i] = make_node(name, i % 7 == 0 ? 1 : 0);
+        if (i % 7 == 0)	root->subdirs[i]->subdirs[0] = make_node("inner", 0);
+    }
+    round_trip(root);
+    free_node(root);
+
+    return check_report("test_dirtree");
+}
@@ -0,0 +1,111 @@
+/*
+ * @author: Xinkai Wang
+ * @contact: xinkaiw@andrew.cmu.edu
+ *
+ * test_frame.c
+ * Round trips through the varint, zigzag and argument codecs of myframe.h
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "../myframe.h"
+#include "check.h"
+
+static const uint64_t unsigned_cases[] = {
+    0, 1, 127, 128, 255, 300, 16383, 16384, UINT32_MAX, (uint64_t)UINT32_MAX + 1,
+    (uint64_t)1 << 63, UINT64_MAX - 1, UINT64_MAX
+};
+
+static const int64_t signed_cases[] = {
+    0, 1, -1, 63, -64, 64, -65, INT32_MAX, INT32_MIN, INT64_MAX, INT64_MIN, INT64_MIN + 1
+};
+
+#define NCASES(a) (sizeof(a) / sizeof((a)[0]))
+
+/* Every value decodes to itself, and any strict prefix of its encoding is truncated */
+static void test_varint(void) {
+    char buf[16];
+    size_t i;
+    for (i = 0; i < NCASES(unsigned_cases); i++) {
+        int n = put_varint(buf, unsigned_cases[i]);
+        CHECK(n >= 1 && n <= 10);
+
+        uint64_t v = 0;
+        CHECK(get_varint(buf, buf + n, &v) == n);
+        CHECK(v == unsigned_cases[i]);
+
+        int cut;
+        for (cut = 0; cut < n; cut++) {
+            CHECK(get_varint(buf, buf + cut, &v) == -1);
+        }
+    }
+
+    /* single-byte encodings for values below 128 */
+    CHECK(put_varint(buf, 127) == 1);
+    CHECK(put_varint(buf, 128) == 2);
+}
+
+/* Zigzag is a bijection that keeps small magnitudes small */
+static void test_zigzag(void) {
+    size_t i;
+    for (i = 0; i < NCASES(signed_cases); i++) {
+        CHECK(zigzag_decode(zigzag_encode(signed_cases[i])) == signed_cases[i]);
+    }
+    CHECK(zigzag_encode(0) == 0);
+    CHECK(zigzag_encode(-1) == 1);
+    CHECK(zigzag_encode(1) == 2);
+    CHECK(zigzag_encode(INT64_MIN) == UINT64_MAX);
+}
+
+/* Arguments written by msg_put_* are read back by read_arg_* under one codec */
+static void test_args(int codec) {
+    struct msg_writer w;
+    memset(&w, 0, sizeof(w));
+    size_t i;
+
+    /* one frame per value, the writer is reused as the clients do */
+    for (i = 0; i < NCASES(signed_cases); i++) {
+        msg_begin(&w, OP_LSEEK, 0, codec);
+        msg_put_i64(&w, signed_cases[i]);
+        msg_put_i32(&w, (int32_t)signed_cases[i]);
+        msg_put_u32(&w, UINT32_MAX);
+        msg_put_u64(&w, unsigned_cases[i]);
+        msg_put_fd(&w, 3);
+        msg_put_bytes(&w, "payload", 7);
+        msg_set_req_id(&w, (uint32_t)i);
+        size_t len = msg_finish(&w);
+        CHECK(w.error == 0);
+        CHECK(len == w.len);
+
+        struct frame_header hdr;
+        CHECK(decode_frame_header(w.buf, &hdr) == 0);
+        CHECK(hdr.opcode == OP_LSEEK);
+        CHECK(hdr.req_id == i);
+        CHECK(frame_codec(&hdr) == codec);
+        CHECK(frame_payload_len(&hdr) == 7);
+        CHECK(memcmp(frame_payload(w.buf, &hdr), "payload", 7) == 0);
+
+        struct arg_reader r;
+        arg_reader_init(&r, w.buf, &hdr);
+        CHECK(read_arg_i64(&r) == signed_cases[i]);
+        CHECK(read_arg_i32(&r) == (int32_t)signed_cases[i]);
+        CHECK(read_arg_u32(&r) == UINT32_MAX);
+        CHECK(read_arg_u64(&r) == unsigned_cases[i]);
+        CHECK(read_arg_fd(&r) == 3);
+        CHECK(r.error == 0);
+
+        /* reading past the arguments flags the reader instead of running into the payload */
+        read_arg_u64(&r);
+        CHECK(r.error != 0);
+    }
+
+    msg_free(&w);
+}
+
+int main(void) {
+    test_varint();
+    test_zigzag();
+    test_args(CODEC_FIXED);
+    test_args(CODEC_VARINT);
+    return check_report("test_frame");
+}